@@ -0,0 +1,208 @@
+#ifndef LOAM_VELODYNE_ALLOC_COUNTER_H
+#define LOAM_VELODYNE_ALLOC_COUNTER_H
+
+// Heap allocation counter of the ncrl pipeline.
+//
+// Build with -DLOAM_ALLOC_COUNTER=ON (on by default in Debug builds) to enable. Otherwise the
+// macros below expand to nothing. When enabled the header interposes the C allocator (malloc,
+// calloc, realloc and the aligned variants) of the executable, so the allocations of operator
+// new, Eigen's aligned_malloc behind pcl clouds and cv::fastMalloc behind cv::Mat are all
+// counted; it is included by the node source only, once per executable. On other C libraries
+// than glibc only operator new is replaced and the allocations of pcl and OpenCV are missed.
+//
+//   LOAM_ALLOC_SCOPE(Solve);   // counts the allocations of this thread for the rest of the scope
+//   LOAM_ALLOC_BEGIN(Features); ... LOAM_ALLOC_END(Features);
+//
+// Every scope reports on its first allocating pass after warm up and every 10 s while it keeps
+// allocating, and prints a summary on exit. A scope that never reports held zero allocations
+// per frame in steady state.
+
+#ifdef LOAM_ALLOC_COUNTER
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include <ros/console.h>
+
+namespace loam {
+namespace alloc {
+
+inline uint64_t &threadCount()
+{
+  static thread_local uint64_t count = 0;
+  return count;
+}
+
+// statistics of one scope, shared by all threads passing through it
+class Counter
+{
+public:
+  static const uint64_t warmUp = 50;
+
+  explicit Counter(const char *name)
+    : _name(name), _passes(0), _allocatingPasses(0), _allocations(0), _max(0), _lastReport(0)
+  {}
+
+  ~Counter()
+  {
+    if (_passes > warmUp) {
+      fprintf(stderr, "alloc counter: %s %lu passes after warm up, %lu allocating, %lu allocations, max %lu\n",
+              _name, (unsigned long)(_passes - warmUp), (unsigned long)_allocatingPasses.load(),
+              (unsigned long)_allocations.load(), (unsigned long)_max.load());
+    }
+  }
+
+  void record(uint64_t allocations)
+  {
+    if (_passes.fetch_add(1, std::memory_order_relaxed) < warmUp || allocations == 0) {
+      return;
+    }
+    uint64_t first = _allocatingPasses.fetch_add(1, std::memory_order_relaxed);
+    _allocations.fetch_add(allocations, std::memory_order_relaxed);
+    uint64_t max = _max.load(std::memory_order_relaxed);
+    while (allocations > max && !_max.compare_exchange_weak(max, allocations, std::memory_order_relaxed)) {}
+    int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t last = _lastReport.load(std::memory_order_relaxed);
+    if ((first == 0 || now - last >= 10) && _lastReport.compare_exchange_strong(last, now)) {
+      ROS_WARN("alloc counter: %s made %lu heap allocations after warm up, %lu allocating passes so far",
+               _name, (unsigned long)allocations, (unsigned long)(first + 1));
+    }
+  }
+
+private:
+  const char *_name;
+  std::atomic<uint64_t> _passes;
+  std::atomic<uint64_t> _allocatingPasses;
+  std::atomic<uint64_t> _allocations;
+  std::atomic<uint64_t> _max;
+  std::atomic<int64_t> _lastReport;   // steady clock seconds
+};
+
+class Scope
+{
+public:
+  explicit Scope(Counter &counter) : _counter(counter), _start(threadCount()) {}
+  ~Scope() { _counter.record(threadCount() - _start); }
+
+private:
+  Counter &_counter;
+  uint64_t _start;
+};
+
+} // namespace alloc
+} // namespace loam
+
+#ifdef __GLIBC__
+
+// glibc's own entry points, the interposed functions count and forward to them
+extern "C" {
+void *__libc_malloc(std::size_t size);
+void *__libc_calloc(std::size_t num, std::size_t size);
+void *__libc_realloc(void *p, std::size_t size);
+void *__libc_memalign(std::size_t alignment, std::size_t size);
+}
+
+extern "C" void *malloc(std::size_t size) noexcept
+{
+  loam::alloc::threadCount()++;
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(std::size_t num, std::size_t size) noexcept
+{
+  loam::alloc::threadCount()++;
+  return __libc_calloc(num, size);
+}
+
+// counted as an allocation unless it frees, growing in place is not told apart
+extern "C" void *realloc(void *p, std::size_t size) noexcept
+{
+  if (size > 0) {
+    loam::alloc::threadCount()++;
+  }
+  return __libc_realloc(p, size);
+}
+
+extern "C" int posix_memalign(void **p, std::size_t alignment, std::size_t size) noexcept
+{
+  if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  loam::alloc::threadCount()++;
+  *p = __libc_memalign(alignment, size);
+  return *p == NULL && size > 0 ? ENOMEM : 0;
+}
+
+extern "C" void *aligned_alloc(std::size_t alignment, std::size_t size) noexcept
+{
+  loam::alloc::threadCount()++;
+  return __libc_memalign(alignment, size);
+}
+
+extern "C" void *memalign(std::size_t alignment, std::size_t size) noexcept
+{
+  loam::alloc::threadCount()++;
+  return __libc_memalign(alignment, size);
+}
+
+#else
+
+void *operator new(std::size_t size)
+{
+  loam::alloc::threadCount()++;
+  void *p = std::malloc(size ? size : 1);
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](std::size_t size)
+{
+  return operator new(size);
+}
+
+void *operator new(std::size_t size, std::nothrow_t const &) noexcept
+{
+  loam::alloc::threadCount()++;
+  return std::malloc(size ? size : 1);
+}
+
+void *operator new[](std::size_t size, std::nothrow_t const &) noexcept
+{
+  return operator new(size, std::nothrow);
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::nothrow_t const &) noexcept { std::free(p); }
+void operator delete[](void *p, std::nothrow_t const &) noexcept { std::free(p); }
+
+#endif // __GLIBC__
+
+#define LOAM_ALLOC_SCOPE(name) \
+  static loam::alloc::Counter loamAllocCounter##name(#name); \
+  loam::alloc::Scope loamAllocScope##name(loamAllocCounter##name)
+#define LOAM_ALLOC_BEGIN(name) \
+  static loam::alloc::Counter loamAllocCounter##name(#name); \
+  uint64_t loamAllocStart##name = loam::alloc::threadCount()
+#define LOAM_ALLOC_END(name) \
+  loamAllocCounter##name.record(loam::alloc::threadCount() - loamAllocStart##name)
+
+#else
+
+#define LOAM_ALLOC_SCOPE(name) ((void)0)
+#define LOAM_ALLOC_BEGIN(name) ((void)0)
+#define LOAM_ALLOC_END(name) ((void)0)
+
+#endif // LOAM_ALLOC_COUNTER
+
+#endif // LOAM_VELODYNE_ALLOC_COUNTER_H
@@ -0,0 +1,184 @@
+#ifndef LOAM_VELODYNE_CLOUD_POOL_H
+#define LOAM_VELODYNE_CLOUD_POOL_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include <pcl/point_cloud.h>
+
+// Objects recycled across frames. acquire() hands out an idle object and only allocates a new
+// one while all are in use, e.g. still queued downstream or held by a map snapshot. After warm
+// up a pool sized for the frames in flight stops allocating.
+//
+// An object goes back to the pool when its last reference is dropped, from any thread: the
+// deleter of the handed out pointer runs the recycle function (e.g. clearing a cloud, so an
+// idle object holds no references) and returns the object under the pool mutex instead of
+// freeing it, so everything the last holder did happens before the next acquire() of it. The
+// control blocks of the handed out pointers are recycled the same way. Objects still held when
+// the pool is destroyed are freed by their last holder.
+//
+// Ptr is the shared pointer type the object is used through, pcl's Ptr for pcl types.
+template <typename T, typename Ptr = std::shared_ptr<T> >
+class ObjectPool
+{
+public:
+  typedef std::function<void(T &)> Recycle;
+
+  explicit ObjectPool(Recycle recycle = Recycle()) : _state(new State(recycle)) {}
+
+  Ptr acquire()
+  {
+    T *object = NULL;
+    {
+      std::lock_guard<std::mutex> lock(_state->mutex);
+      if (!_state->objects.empty()) {
+        object = _state->objects.back();
+        _state->objects.pop_back();
+      }
+    }
+    if (object == NULL) {
+      object = new T();
+      std::lock_guard<std::mutex> lock(_state->mutex);
+      _state->created++;
+      // room to take every object back without growing in the deleter
+      _state->objects.reserve(_state->created);
+      _state->blocks.reserve(_state->created);
+    }
+    return Ptr(object, Release(_state), BlockAllocator<char>(_state));
+  }
+
+  // objects created so far, handed out or idle
+  size_t size() const
+  {
+    std::lock_guard<std::mutex> lock(_state->mutex);
+    return _state->created;
+  }
+
+private:
+  struct State
+  {
+    explicit State(Recycle const &recycle) : recycle(recycle), created(0), blockSize(0) {}
+
+    ~State()
+    {
+      for (size_t i = 0; i < objects.size(); i++) {
+        delete objects[i];
+      }
+      for (size_t i = 0; i < blocks.size(); i++) {
+        ::operator delete(blocks[i]);
+      }
+    }
+
+    std::mutex mutex;
+    Recycle recycle;
+    size_t created;
+    std::vector<T *> objects;      // idle objects
+    std::vector<void *> blocks;    // idle control blocks, all of blockSize bytes
+    size_t blockSize;
+  };
+
+  // deleter of the handed out pointers
+  struct Release
+  {
+    explicit Release(std::shared_ptr<State> const &state) : state(state) {}
+
+    void operator()(T *object) const
+    {
+      // outside of the lock, recycling may release objects of other pools
+      if (state->recycle) {
+        state->recycle(*object);
+      }
+      std::lock_guard<std::mutex> lock(state->mutex);
+      state->objects.push_back(object);
+    }
+
+    std::shared_ptr<State> state;
+  };
+
+  // allocator of the control blocks, recycles the single block size the pool's pointers use
+  template <typename U>
+  struct BlockAllocator
+  {
+    typedef U value_type;
+    typedef U *pointer;
+    typedef U const *const_pointer;
+    typedef U &reference;
+    typedef U const &const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+    template <typename V> struct rebind { typedef BlockAllocator<V> other; };
+
+    explicit BlockAllocator(std::shared_ptr<State> const &state) : state(state) {}
+    template <typename V> BlockAllocator(BlockAllocator<V> const &other) : state(other.state) {}
+
+    U *allocate(size_t n, void const * = 0)
+    {
+      size_t bytes = n * sizeof(U);
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (state->blockSize == 0) {
+          state->blockSize = bytes;
+        }
+        if (bytes == state->blockSize && !state->blocks.empty()) {
+          void *block = state->blocks.back();
+          state->blocks.pop_back();
+          return static_cast<U *>(block);
+        }
+      }
+      return static_cast<U *>(::operator new(bytes));
+    }
+
+    void deallocate(U *p, size_t n)
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (n * sizeof(U) == state->blockSize) {
+        state->blocks.push_back(p);
+      } else {
+        ::operator delete(p);
+      }
+    }
+
+    size_t max_size() const { return size_t(-1) / sizeof(U); }
+    template <typename V> bool operator==(BlockAllocator<V> const &other) const { return state == other.state; }
+    template <typename V> bool operator!=(BlockAllocator<V> const &other) const { return state != other.state; }
+
+    std::shared_ptr<State> state;
+  };
+
+  std::shared_ptr<State> _state;
+};
+
+// Point clouds recycled across frames, handed out empty with the capacity of earlier frames.
+template <typename PointT>
+class CloudPool
+{
+public:
+  typedef pcl::PointCloud<PointT> Cloud;
+  typedef typename Cloud::Ptr CloudPtr;
+
+  // reserve: points preallocated in every new cloud
+  explicit CloudPool(size_t reserve = 0) : _reserve(reserve), _pool(&CloudPool::recycle) {}
+
+  CloudPtr acquire()
+  {
+    CloudPtr cloud = _pool.acquire();
+    if (cloud->points.capacity() < _reserve) {
+      cloud->points.reserve(_reserve);
+    }
+    return cloud;
+  }
+
+  size_t size() const { return _pool.size(); }
+
+private:
+  static void recycle(Cloud &cloud) { cloud.clear(); }
+
+  size_t _reserve;
+  ObjectPool<Cloud, CloudPtr> _pool;
+};
+
+#endif // LOAM_VELODYNE_CLOUD_POOL_H
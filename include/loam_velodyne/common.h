@@ -30,11 +30,59 @@
 //   J. Zhang and S. Singh. LOAM: Lidar Odometry and Mapping in Real-time.
 //     Robotics: Science and Systems Conference (RSS). Berkeley, CA, July 2014.
 
+#ifndef LOAM_VELODYNE_COMMON_H
+#define LOAM_VELODYNE_COMMON_H
+
 #include <cmath>
+#include <cstdint>
 
 #include <pcl/point_types.h>
+#include <pcl/register_point_struct.h>
+
+namespace loam {
+
+// Point of the ncrl pipeline: the sensor intensity, the ring (scan line) the point was
+// measured on and its time since the start of the sweep in seconds. 32 bytes like
+// pcl::PointXYZI, x, y, z sit in one aligned 16 byte block. Points projected to the end of
+// the sweep carry t = 0.
+//
+// The ncrl targets are compiled with PCL_NO_PRECOMPILE, so the pcl templates they use are
+// instantiated for this type.
+struct EIGEN_ALIGN16 PointXYZIRT
+{
+  PCL_ADD_POINT4D;
+  float intensity;
+  float t;
+  uint16_t ring;
 
+  inline PointXYZIRT()
+  {
+    x = y = z = 0.0f;
+    data[3] = 1.0f;
+    intensity = 0.0f;
+    t = 0.0f;
+    ring = 0;
+  }
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+} // namespace loam
+
+POINT_CLOUD_REGISTER_POINT_STRUCT(loam::PointXYZIRT,
+                                  (float, x, x)
+                                  (float, y, y)
+                                  (float, z, z)
+                                  (float, intensity, intensity)
+                                  (float, t, t)
+                                  (uint16_t, ring, ring))
+
+// the original nodes pack the scan ID and time into intensity, scanID + scanPeriod * relTime
+#ifdef LOAM_XYZI_POINT_TYPE
 typedef pcl::PointXYZI PointType;
+#else
+typedef loam::PointXYZIRT PointType;
+#endif
 
 inline double rad2deg(double radians)
 {
@@ -45,3 +93,5 @@ inline double deg2rad(double degrees)
 {
   return degrees * M_PI / 180.0;
 }
+
+#endif // LOAM_VELODYNE_COMMON_H
@@ -0,0 +1,222 @@
+#ifndef LOAM_VELODYNE_FRAME_SYNC_H
+#define LOAM_VELODYNE_FRAME_SYNC_H
+
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// What a stage does with complete sweeps it has not picked up yet.
+//   Latest  : keep only the newest one, older ones are superseded (conflation)
+//   All     : queue every sweep, nothing is discarded
+//   Bounded : queue up to capacity sweeps, the oldest is dropped on overflow
+enum class FramePolicy { Latest, All, Bounded };
+
+inline bool parseFramePolicy(std::string const &name, FramePolicy &policy)
+{
+  if (name == "latest") {
+    policy = FramePolicy::Latest;
+  } else if (name == "all") {
+    policy = FramePolicy::All;
+  } else if (name == "bounded") {
+    policy = FramePolicy::Bounded;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Queue over fixed storage, grows only when it is full, so a stage that keeps up queues and
+// dequeues without allocating. Freed slots are reset to T() to drop what they hold.
+template <typename T>
+class FrameRing
+{
+public:
+  explicit FrameRing(size_t capacity) : _slots(capacity > 0 ? capacity : 1), _head(0), _size(0) {}
+
+  size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+  T &operator[](size_t i) { return _slots[(_head + i) % _slots.size()]; }
+  T &front() { return _slots[_head]; }
+
+  void pop_front()
+  {
+    _slots[_head] = T();
+    _head = (_head + 1) % _slots.size();
+    _size--;
+  }
+
+  // inserts before position i, i == size() appends
+  void insert(size_t i, T const &value)
+  {
+    if (_size == _slots.size()) {
+      grow();
+    }
+    _size++;
+    for (size_t j = _size - 1; j > i; j--) {
+      std::swap((*this)[j], (*this)[j - 1]);
+    }
+    (*this)[i] = value;
+  }
+
+  void push_back(T const &value) { insert(_size, value); }
+
+private:
+  void grow()
+  {
+    std::vector<T> slots(2 * _slots.size());
+    for (size_t i = 0; i < _size; i++) {
+      std::swap(slots[i], (*this)[i]);
+    }
+    _slots.swap(slots);
+    _head = 0;
+  }
+
+  std::vector<T> _slots;
+  size_t _head;
+  size_t _size;
+};
+
+struct FrameCounters
+{
+  uint64_t received;    // sweeps for which at least one input arrived
+  uint64_t processed;   // sweeps handed to the processing loop
+  uint64_t dropped;     // incomplete sweeps given up on, or complete ones evicted by the queue bound
+  uint64_t superseded;  // complete sweeps replaced by a newer one under FramePolicy::Latest
+
+  FrameCounters() : received(0), processed(0), dropped(0), superseded(0) {}
+};
+
+// Assembles sweeps from Inputs separately published topics. Messages belong to the same sweep
+// when their stamps are within the tolerance. Every topic publishes in stamp order, so once a
+// sweep is complete, no older incomplete sweep can still complete; those are dropped instead
+// of blocking the stage. Frame is the per-sweep payload, filled through the functor passed
+// to add().
+template <typename Frame, int Inputs>
+class FrameSync
+{
+public:
+  FrameSync(FramePolicy policy = FramePolicy::Latest, size_t capacity = 1, double tolerance = 0.005)
+    : _policy(policy), _capacity(capacity > 0 ? capacity : 1), _tolerance(tolerance),
+      _pending(maxPending + 1), _ready(_capacity + 1)
+  {}
+
+  void configure(FramePolicy policy, size_t capacity)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _policy = policy;
+    _capacity = capacity > 0 ? capacity : 1;
+  }
+
+  // called from the subscriber callbacks
+  template <typename Fill>
+  void add(int input, double stamp, Fill fill)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    size_t it = 0;
+    while (it < _pending.size() && _pending[it].stamp < stamp - _tolerance) {
+      it++;
+    }
+    if (it == _pending.size() || fabs(_pending[it].stamp - stamp) >= _tolerance) {
+      _pending.insert(it, Pending(stamp));
+      _counters.received++;
+
+      // an input that stopped publishing must not make the partial sweeps pile up
+      if (_pending.size() > maxPending) {
+        bool front = it == 0;
+        _pending.pop_front();
+        _counters.dropped++;
+        if (front) {
+          return;
+        }
+        it--;
+      }
+    }
+
+    Pending &pending = _pending[it];
+    fill(pending.frame);
+    pending.mask |= 1u << input;
+    if (pending.mask != completeMask) {
+      return;
+    }
+
+    // older sweeps can no longer complete
+    for (; it > 0; it--) {
+      _pending.pop_front();
+      _counters.dropped++;
+    }
+    _ready.push_back(_pending.front());
+    _pending.pop_front();
+
+    if (_policy == FramePolicy::Latest) {
+      while (_ready.size() > 1) {
+        _ready.pop_front();
+        _counters.superseded++;
+      }
+    } else if (_policy == FramePolicy::Bounded) {
+      while (_ready.size() > _capacity) {
+        _ready.pop_front();
+        _counters.dropped++;
+      }
+    }
+    _cond.notify_one();
+  }
+
+  // waits up to timeout for a complete sweep, oldest first
+  template <typename Rep, typename Period>
+  bool pop(Frame &frame, double &stamp, std::chrono::duration<Rep, Period> timeout)
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (!_cond.wait_for(lock, timeout, [this]{ return !_ready.empty(); })) {
+      return false;
+    }
+    frame = _ready.front().frame;
+    stamp = _ready.front().stamp;
+    _ready.pop_front();
+    _counters.processed++;
+    return true;
+  }
+
+  FrameCounters counters() const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _counters;
+  }
+
+  // sweeps complete and waiting for the processing loop
+  size_t backlog() const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _ready.size();
+  }
+
+private:
+  static const unsigned completeMask = (1u << Inputs) - 1;
+  static const size_t maxPending = 16;
+
+  struct Pending
+  {
+    double stamp;
+    unsigned mask;
+    Frame frame;
+
+    Pending() : stamp(0), mask(0), frame() {}
+    explicit Pending(double t) : stamp(t), mask(0), frame() {}
+  };
+
+  mutable std::mutex _mutex;
+  std::condition_variable _cond;
+  FramePolicy _policy;
+  size_t _capacity;
+  double _tolerance;
+  FrameRing<Pending> _pending;   // incomplete sweeps in stamp order
+  FrameRing<Pending> _ready;     // complete sweeps, oldest first
+  FrameCounters _counters;
+};
+
+#endif // LOAM_VELODYNE_FRAME_SYNC_H
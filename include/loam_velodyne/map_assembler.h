@@ -0,0 +1,111 @@
+#ifndef LOAM_VELODYNE_MAP_ASSEMBLER_H
+#define LOAM_VELODYNE_MAP_ASSEMBLER_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <unordered_map>
+
+#include <pcl/point_cloud.h>
+#include <pcl_conversions/pcl_conversions.h>
+
+#include <loam_velodyne/MapCube.h>
+#include <loam_velodyne/tile_store.h>
+
+// Client side of the delta surround output of ncrl_laserMapping (~surround_mode delta): keeps
+// the latest cloud of every cube received on /laser_cloud_surround_cubes, whole or extended by
+// the points added since, and rebuilds the map from them.
+//
+//   MapAssembler<pcl::PointXYZI> assembler;
+//   void cubeHandler(loam_velodyne::MapCube::ConstPtr const &cube)
+//   {
+//     if (assembler.update(*cube)) {
+//       assembler.assemble(map);
+//     }
+//   }
+//
+// Cubes that left the surround of the vehicle are kept until prune() drops them, a cube the
+// node drops from its grid (tiling off) arrives as an empty cloud and is removed. Revisions
+// restart with the mapping node, clear() the assembler when it restarts. Not thread safe.
+template <typename PointT>
+class MapAssembler
+{
+public:
+  typedef typename pcl::PointCloud<PointT>::Ptr CloudPtr;
+
+  // returns true when the map changed, older revisions of a cube than the one held are ignored
+  bool update(loam_velodyne::MapCube const &msg)
+  {
+    CubeKey key = {msg.i, msg.j, msg.k};
+    typename std::unordered_map<CubeKey, Cube, CubeKeyHash>::iterator it = _cubes.find(key);
+    if (it != _cubes.end() && msg.revision < it->second.revision) {
+      return false;
+    }
+    if (msg.append) {
+      // added on top of base_revision, a cube that missed an update waits for the next refresh
+      if (it == _cubes.end() || it->second.revision != msg.base_revision) {
+        return false;
+      }
+      pcl::PointCloud<PointT> added;
+      pcl::fromROSMsg(msg.cloud, added);
+      CloudPtr cloud(new pcl::PointCloud<PointT>(*it->second.cloud));
+      *cloud += added;
+      it->second.revision = msg.revision;
+      it->second.cloud = cloud;
+      return true;
+    }
+    if (msg.cloud.width * msg.cloud.height == 0) {
+      return _cubes.erase(key) > 0;
+    }
+    Cube &cube = _cubes[key];
+    cube.revision = msg.revision;
+    cube.cloud.reset(new pcl::PointCloud<PointT>());
+    pcl::fromROSMsg(msg.cloud, *cube.cloud);
+    return true;
+  }
+
+  // the points of all cubes held
+  void assemble(pcl::PointCloud<PointT> &map) const
+  {
+    map.clear();
+    for (typename std::unordered_map<CubeKey, Cube, CubeKeyHash>::const_iterator it = _cubes.begin();
+         it != _cubes.end(); ++it) {
+      map += *it->second.cloud;
+    }
+  }
+
+  // drops the cubes farther than radius cubes from center along any axis
+  void prune(CubeKey const &center, int radius)
+  {
+    typename std::unordered_map<CubeKey, Cube, CubeKeyHash>::iterator it = _cubes.begin();
+    while (it != _cubes.end()) {
+      if (std::abs(it->first.i - center.i) > radius ||
+          std::abs(it->first.j - center.j) > radius ||
+          std::abs(it->first.k - center.k) > radius) {
+        it = _cubes.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  // the cloud of a cube, null when it is not held
+  CloudPtr cube(CubeKey const &key) const
+  {
+    typename std::unordered_map<CubeKey, Cube, CubeKeyHash>::const_iterator it = _cubes.find(key);
+    return it == _cubes.end() ? CloudPtr() : it->second.cloud;
+  }
+
+  size_t size() const { return _cubes.size(); }
+  void clear() { _cubes.clear(); }
+
+private:
+  struct Cube
+  {
+    uint32_t revision;
+    CloudPtr cloud;
+  };
+
+  std::unordered_map<CubeKey, Cube, CubeKeyHash> _cubes;
+};
+
+#endif // LOAM_VELODYNE_MAP_ASSEMBLER_H
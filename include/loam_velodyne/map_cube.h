@@ -0,0 +1,411 @@
+#ifndef LOAM_VELODYNE_MAP_CUBE_H
+#define LOAM_VELODYNE_MAP_CUBE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <pcl/point_cloud.h>
+
+#include <loam_velodyne/voxel_filter.h>
+
+// Z-order (Morton) code of three 10 bit coordinates, x in the lowest bit
+inline uint32_t mortonCode(uint32_t x, uint32_t y, uint32_t z)
+{
+  uint32_t const c[3] = {x, y, z};
+  uint32_t code[3];
+  for (int a = 0; a < 3; a++) {
+    uint32_t v = c[a] & 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    code[a] = v;
+  }
+  return code[0] | (code[1] << 1) | (code[2] << 2);
+}
+
+// One cube of the mapping grid: at most one point per voxel of leafSize, kept deduplicated at
+// insert time through a hash of the occupied voxels. The stored point is the running mean of
+// every point the voxel received, so maintaining a cube costs O(new points) instead of
+// re-filtering all of it. The index is allocated on the first insert, empty cubes cost no
+// more than an empty vector.
+//
+// Points are stored as 16 bit offsets from the lower corner of the cube, about 0.8 mm steps
+// at 50 m cubes, so a decoded point is within 0.4 mm of the stored mean. Intensity is a 16 bit
+// value over [0, intensityMax], 1/256 steps at the default 256 for 8 bit sensor intensities;
+// sensors reporting more set intensityMax accordingly. Intensities outside of the range are
+// clamped and counted by clampedIntensities(). With the voxel index that is 9 bytes per point,
+// plus 8 per table slot, against 32 and 16 for full points. The table is kept at most half
+// full and vectors grow by doubling, so a cube costs about 37-46 bytes per voxel against
+// 91-98 before (synthetic cubes, not a recorded map), 2-2.6 times less: the table is more
+// than half of it, the points with their headroom a third.
+// The cube is placed on the grid of the mapping node, floor((x + cubeSize / 2) / cubeSize),
+// by its first point; points outside of it are clamped to its faces. Other fields of PointT
+// (ring, time) are not kept, decoded points carry their defaults.
+//
+// Voxels are indexed relative to the cube, 10 bits per axis, by the quantized position. The
+// stored mean never leaves its voxel: a merge that would move it across a face after
+// quantization keeps the position and only updates the intensity. At leaf sizes below
+// cubeSize / 1024 points are appended without deduplication.
+//
+// The points are kept in Z-order of their position at cubeSize / 1024 resolution, so points
+// close in space are close in memory for the kd-trees and the submap assembly built from
+// appendTo(). New voxels are appended unsorted and merged into the sorted points once the
+// tail exceeds an eighth of them, at most that share of a cube is out of order.
+//
+// The revision is a stamp of the owner, set through touch() when insert() reports a new voxel;
+// merges into occupied voxels only move a point within its voxel and do not count as a change.
+template <typename PointT>
+class MapCube
+{
+public:
+  typedef std::shared_ptr<MapCube> Ptr;
+  typedef typename pcl::PointCloud<PointT>::Ptr CloudPtr;
+
+  explicit MapCube(float leafSize = 0.2, float cubeSize = 50.0, float intensityMax = 256.0)
+    : _shift(64), _cubeSize(cubeSize), _intensityMax(intensityMax),
+      _intensityScale(quantizedMax / intensityMax), _placed(false),
+      _sorted(0), _revision(0), _clampedIntensities(0)
+  {
+    _lower[0] = _lower[1] = _lower[2] = 0;
+    setLeaf(leafSize);
+  }
+
+  size_t size() const { return _points.size(); }
+  bool empty() const { return _points.empty(); }
+  float leafSize() const { return _leafSize; }
+  float cubeSize() const { return _cubeSize; }
+  float intensityMax() const { return _intensityMax; }
+  // points whose intensity was outside [0, intensityMax] since the cube was created or cleared
+  size_t clampedIntensities() const { return _clampedIntensities; }
+  uint32_t revision() const { return _revision; }
+  void touch(uint32_t revision) { _revision = revision; }
+
+  // dequantizes the stored points onto the end of cloud
+  void appendTo(pcl::PointCloud<PointT> &cloud) const
+  {
+    size_t offset = cloud.points.size();
+    cloud.points.resize(offset + _points.size());
+    float step = _cubeSize / quantizedMax;
+    for (size_t p = 0; p < _points.size(); p++) {
+      decode(_points[p], step, cloud.points[offset + p]);
+    }
+    cloud.width = cloud.points.size();
+    cloud.height = 1;
+  }
+
+  // the stored points in a new cloud
+  CloudPtr cloud() const
+  {
+    CloudPtr cloud(new pcl::PointCloud<PointT>());
+    appendTo(*cloud);
+    return cloud;
+  }
+
+  // returns true when the point occupied a new voxel
+  bool insert(PointT const &point)
+  {
+    if (!std::isfinite(point.x) || !std::isfinite(point.y) || !std::isfinite(point.z)) {
+      return false;
+    }
+    if (!_placed) {
+      place(point);
+    }
+
+    float step = _cubeSize / quantizedMax;
+    QuantizedPoint quantized = encode(point, step);
+    if (!(point.intensity >= 0 && point.intensity <= _intensityMax)) {
+      _clampedIntensities++;
+    }
+    uint32_t key;
+    if (!voxelKey(quantized, step, key)) {
+      append(quantized);
+      return true;
+    }
+
+    if (2 * (size() + 1) > _table.size()) {
+      grow();
+    }
+    size_t mask = _table.size() - 1;
+    size_t slot = voxelSlot(key, _shift);
+    while (_table[slot].key != emptyKey && _table[slot].key != key) {
+      slot = (slot + 1) & mask;
+    }
+
+    if (_table[slot].key == emptyKey) {
+      _table[slot].key = key;
+      _table[slot].index = size();
+      append(quantized);
+      return true;
+    }
+
+    uint32_t index = _table[slot].index;
+    PointT stored;
+    decode(_points[index], step, stored);
+    if (_counts[index] < 0xff) {
+      _counts[index]++;
+    }
+    float weight = 1.0f / _counts[index];
+    stored.x += (point.x - stored.x) * weight;
+    stored.y += (point.y - stored.y) * weight;
+    stored.z += (point.z - stored.z) * weight;
+    stored.intensity += (point.intensity - stored.intensity) * weight;
+    QuantizedPoint merged = encode(stored, step);
+    uint32_t mergedKey;
+    if (voxelKey(merged, step, mergedKey) && mergedKey == key) {
+      _points[index] = merged;
+    } else {
+      _points[index].intensity = merged.intensity;
+    }
+    return false;
+  }
+
+  void insert(pcl::PointCloud<PointT> const &cloud)
+  {
+    for (size_t i = 0; i < cloud.points.size(); i++) {
+      insert(cloud.points[i]);
+    }
+  }
+
+  // releases the index as well, cubes recycled at the grid edge start small again
+  void clear()
+  {
+    std::vector<QuantizedPoint>().swap(_points);
+    std::vector<uint8_t>().swap(_counts);
+    std::vector<Slot>().swap(_table);
+    std::vector<std::pair<uint32_t, uint32_t> >().swap(_mergeTail);
+    std::vector<QuantizedPoint>().swap(_mergeTailPoints);
+    std::vector<uint8_t>().swap(_mergeTailCounts);
+    _shift = 64;
+    _placed = false;
+    _sorted = 0;
+    _revision = 0;
+    _clampedIntensities = 0;
+  }
+
+  // re-bins the stored points, points that now share a voxel are merged
+  void setLeafSize(float leafSize)
+  {
+    if (leafSize == _leafSize) {
+      return;
+    }
+    setLeaf(leafSize);
+    if (empty()) {
+      return;
+    }
+    pcl::PointCloud<PointT> points;
+    appendTo(points);
+    uint32_t revision = _revision;
+    size_t clampedIntensities = _clampedIntensities;
+    clear();
+    insert(points);
+    _revision = revision;
+    _clampedIntensities = clampedIntensities;
+  }
+
+private:
+  static const uint32_t emptyKey = ~0u;
+  static const int voxelBits = 10;
+  static constexpr float quantizedMax = 65535.0f;
+  static const size_t minUnsorted = 256;
+
+  struct QuantizedPoint
+  {
+    uint16_t x;
+    uint16_t y;
+    uint16_t z;
+    uint16_t intensity;
+  };
+
+  struct Slot
+  {
+    uint32_t key;
+    uint32_t index;
+  };
+
+  // rounds to the nearest step in [0, max], not finite values to 0
+  static uint16_t quantize(float value, float max)
+  {
+    if (!(value > 0.0f)) {
+      return 0;
+    }
+    return uint16_t(std::min(value, max) + 0.5f);
+  }
+
+  QuantizedPoint encode(PointT const &point, float step) const
+  {
+    QuantizedPoint q;
+    q.x = quantize((point.x - _lower[0]) / step, quantizedMax);
+    q.y = quantize((point.y - _lower[1]) / step, quantizedMax);
+    q.z = quantize((point.z - _lower[2]) / step, quantizedMax);
+    q.intensity = quantize(point.intensity * _intensityScale, quantizedMax);
+    return q;
+  }
+
+  void decode(QuantizedPoint const &q, float step, PointT &point) const
+  {
+    point.x = _lower[0] + q.x * step;
+    point.y = _lower[1] + q.y * step;
+    point.z = _lower[2] + q.z * step;
+    point.intensity = q.intensity / _intensityScale;
+  }
+
+  // the cube of the mapping grid the point falls into
+  void place(PointT const &point)
+  {
+    double half = _cubeSize / 2.0;
+    float const coordinate[3] = {point.x, point.y, point.z};
+    for (int a = 0; a < 3; a++) {
+      _lower[a] = float(std::floor((coordinate[a] + half) / _cubeSize) * _cubeSize - half);
+    }
+    _placed = true;
+  }
+
+  void setLeaf(float leafSize)
+  {
+    _leafSize = leafSize;
+    _inverseLeaf = 1.0f / leafSize;
+    _voxelsPerAxis = int(std::ceil(_cubeSize * _inverseLeaf));
+  }
+
+  // voxel of the quantized point within the cube, false when the cube has more voxels than
+  // fit the key. Binning the quantized position keeps a decoded point in its voxel, so cubes
+  // saved or evicted and inserted again do not grow
+  bool voxelKey(QuantizedPoint const &q, float step, uint32_t &key) const
+  {
+    const int maxVoxel = (1 << voxelBits) - 1;
+    if (_voxelsPerAxis > maxVoxel + 1) {
+      return false;
+    }
+    int last = _voxelsPerAxis - 1;
+    int i = std::min(int(q.x * step * _inverseLeaf), last);
+    int j = std::min(int(q.y * step * _inverseLeaf), last);
+    int k = std::min(int(q.z * step * _inverseLeaf), last);
+    key = (uint32_t(k) << (2 * voxelBits)) | (uint32_t(j) << voxelBits) | uint32_t(i);
+    return true;
+  }
+
+  void append(QuantizedPoint const &q)
+  {
+    _points.push_back(q);
+    _counts.push_back(1);
+    if (size() - _sorted > std::max(_sorted / 8, size_t(minUnsorted))) {
+      merge();
+    }
+  }
+
+  static uint32_t orderCode(QuantizedPoint const &q)
+  {
+    return mortonCode(q.x >> 6, q.y >> 6, q.z >> 6);
+  }
+
+  // sorts the unsorted tail and merges it into the sorted points. The tail is copied out sorted
+  // and merged from the back, so the points are moved in place and the scratch buffers, kept
+  // between merges, hold the tail only. Points before the first one moved keep their index,
+  // the table entries of the others are found again by the voxel of the point, a stored point
+  // is always in the voxel of its slot
+  void merge()
+  {
+    size_t pointNum = size();
+    size_t tailNum = pointNum - _sorted;
+    _mergeTail.clear();
+    for (size_t p = _sorted; p < pointNum; p++) {
+      _mergeTail.push_back(std::make_pair(orderCode(_points[p]), uint32_t(p)));
+    }
+    std::sort(_mergeTail.begin(), _mergeTail.end());
+    _mergeTailPoints.resize(tailNum);
+    _mergeTailCounts.resize(tailNum);
+    for (size_t t = 0; t < tailNum; t++) {
+      _mergeTailPoints[t] = _points[_mergeTail[t].second];
+      _mergeTailCounts[t] = _counts[_mergeTail[t].second];
+    }
+
+    // points merged into their voxel since they were sorted may have moved a little, the
+    // sorted part is merged as it is. Equal codes keep the sorted point first
+    size_t s = _sorted;
+    size_t t = tailNum;
+    size_t out = pointNum;
+    while (t > 0) {
+      out--;
+      if (s > 0 && orderCode(_points[s - 1]) > _mergeTail[t - 1].first) {
+        s--;
+        _points[out] = _points[s];
+        _counts[out] = _counts[s];
+      } else {
+        t--;
+        _points[out] = _mergeTailPoints[t];
+        _counts[out] = _mergeTailCounts[t];
+      }
+    }
+
+    if (!_table.empty()) {
+      float step = _cubeSize / quantizedMax;
+      size_t mask = _table.size() - 1;
+      for (size_t p = s; p < pointNum; p++) {
+        uint32_t key;
+        if (!voxelKey(_points[p], step, key)) {
+          continue;
+        }
+        size_t slot = voxelSlot(key, _shift);
+        while (_table[slot].key != key) {
+          slot = (slot + 1) & mask;
+        }
+        _table[slot].index = p;
+      }
+    }
+    _sorted = pointNum;
+  }
+
+  // doubles the table, at most half of it is occupied
+  void grow()
+  {
+    size_t tableSize = _table.empty() ? 16 : 2 * _table.size();
+    std::vector<Slot> table(tableSize);
+    for (size_t i = 0; i < tableSize; i++) {
+      table[i].key = emptyKey;
+    }
+    _shift = 64;
+    for (size_t s = tableSize; s > 1; s >>= 1) {
+      _shift--;
+    }
+
+    size_t mask = tableSize - 1;
+    for (size_t i = 0; i < _table.size(); i++) {
+      if (_table[i].key == emptyKey) {
+        continue;
+      }
+      size_t slot = voxelSlot(_table[i].key, _shift);
+      while (table[slot].key != emptyKey) {
+        slot = (slot + 1) & mask;
+      }
+      table[slot] = _table[i];
+    }
+    _table.swap(table);
+  }
+
+  std::vector<QuantizedPoint> _points;
+  std::vector<uint8_t> _counts;
+  std::vector<Slot> _table;
+  int _shift;
+  float _leafSize;
+  float _inverseLeaf;
+  int _voxelsPerAxis;
+  float _cubeSize;
+  float _intensityMax;
+  float _intensityScale;   // quantized steps per intensity unit
+  float _lower[3];
+  bool _placed;
+  size_t _sorted;     // points [0, _sorted) are in Z-order
+  uint32_t _revision;
+  size_t _clampedIntensities;
+  // scratch of merge()
+  std::vector<std::pair<uint32_t, uint32_t> > _mergeTail;   // order code, index
+  std::vector<QuantizedPoint> _mergeTailPoints;
+  std::vector<uint8_t> _mergeTailCounts;
+};
+
+#endif // LOAM_VELODYNE_MAP_CUBE_H
@@ -0,0 +1,270 @@
+#ifndef LOAM_VELODYNE_MAP_IO_H
+#define LOAM_VELODYNE_MAP_IO_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <pcl/point_cloud.h>
+
+// On-disk cube map of ncrl_laserMapping.
+//
+//   CubeMapHeader
+//   CubeMapEntry[cubeCount]    grid index and point counts of every non-empty cube
+//   CubeMapPoint[pointCount]   corner then surf points of each cube, in entry order
+//
+// Since version 2 an entry may lie outside the grid: a cube that was evicted to the tile store
+// when the map was saved, indexed as if the grid extended that far. Version 1 files hold the
+// grid only and still load. Records are in host byte order and have no padding. A save writes to a temporary file and
+// renames it, so a crash while saving never leaves a truncated map behind. A load maps the
+// file and copies the points straight into the cube clouds.
+
+struct CubeMapHeader
+{
+  char magic[8];
+  uint32_t version;
+  int32_t width;            // grid size in cubes
+  int32_t height;
+  int32_t depth;
+  int32_t cenWidth;         // grid index of the cube centered on the origin of /camera_init
+  int32_t cenHeight;
+  int32_t cenDepth;
+  float cubeSize;
+  float pose[6];            // transformAftMapped when the map was saved
+  uint32_t cubeCount;
+  uint32_t reserved;
+  uint64_t pointCount;
+};
+
+struct CubeMapEntry
+{
+  int32_t i;
+  int32_t j;
+  int32_t k;
+  uint32_t cornerNum;
+  uint32_t surfNum;
+};
+
+struct CubeMapPoint
+{
+  float x;
+  float y;
+  float z;
+  float intensity;
+};
+
+static_assert(sizeof(CubeMapHeader) == 80, "CubeMapHeader layout");
+static_assert(sizeof(CubeMapEntry) == 20, "CubeMapEntry layout");
+static_assert(sizeof(CubeMapPoint) == 16, "CubeMapPoint layout");
+
+const char cubeMapMagic[8] = "NCRLMAP";
+const uint32_t cubeMapVersion = 2;
+
+// A cube outside the grid, i, j, k are grid indices out of range.
+template <typename PointT>
+struct OffGridCube
+{
+  int32_t i;
+  int32_t j;
+  int32_t k;
+  typename pcl::PointCloud<PointT>::Ptr corner;
+  typename pcl::PointCloud<PointT>::Ptr surf;
+};
+
+inline bool inCubeGrid(CubeMapEntry const &entry, int width, int height, int depth)
+{
+  return entry.i >= 0 && entry.i < width &&
+         entry.j >= 0 && entry.j < height &&
+         entry.k >= 0 && entry.k < depth;
+}
+
+// Writes the non-empty cubes of a width x height x depth grid, indexed i + width * j +
+// width * height * k, followed by the non-empty cubes of offGrid. The caller fills the grid
+// and pose fields of header, the counts are filled in here.
+template <typename PointT>
+bool saveCubeMap(std::string const &file, CubeMapHeader &header,
+                 typename pcl::PointCloud<PointT>::Ptr const *cornerArray,
+                 typename pcl::PointCloud<PointT>::Ptr const *surfArray,
+                 std::vector<OffGridCube<PointT> > const &offGrid)
+{
+  typedef pcl::PointCloud<PointT> const *Cloud;
+
+  memcpy(header.magic, cubeMapMagic, sizeof(header.magic));
+  header.version = cubeMapVersion;
+  header.reserved = 0;
+
+  std::vector<CubeMapEntry> entries;
+  std::vector<std::pair<Cloud, Cloud> > clouds;   // corner and surf of each entry
+  header.pointCount = 0;
+  for (int k = 0; k < header.depth; k++) {
+    for (int j = 0; j < header.height; j++) {
+      for (int i = 0; i < header.width; i++) {
+        int ind = i + header.width * j + header.width * header.height * k;
+        CubeMapEntry entry;
+        entry.i = i;
+        entry.j = j;
+        entry.k = k;
+        entry.cornerNum = cornerArray[ind]->points.size();
+        entry.surfNum = surfArray[ind]->points.size();
+        if (entry.cornerNum + entry.surfNum > 0) {
+          entries.push_back(entry);
+          clouds.push_back(std::make_pair(cornerArray[ind].get(), surfArray[ind].get()));
+          header.pointCount += entry.cornerNum + entry.surfNum;
+        }
+      }
+    }
+  }
+  for (size_t c = 0; c < offGrid.size(); c++) {
+    CubeMapEntry entry;
+    entry.i = offGrid[c].i;
+    entry.j = offGrid[c].j;
+    entry.k = offGrid[c].k;
+    entry.cornerNum = offGrid[c].corner->points.size();
+    entry.surfNum = offGrid[c].surf->points.size();
+    if (entry.cornerNum + entry.surfNum > 0) {
+      entries.push_back(entry);
+      clouds.push_back(std::make_pair(offGrid[c].corner.get(), offGrid[c].surf.get()));
+      header.pointCount += entry.cornerNum + entry.surfNum;
+    }
+  }
+  header.cubeCount = entries.size();
+
+  std::string tmpFile = file + ".tmp";
+  FILE *fp = fopen(tmpFile.c_str(), "wb");
+  if (fp == NULL) {
+    return false;
+  }
+
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+  if (ok && !entries.empty()) {
+    ok = fwrite(&entries[0], sizeof(CubeMapEntry), entries.size(), fp) == entries.size();
+  }
+
+  std::vector<CubeMapPoint> buffer;
+  for (size_t e = 0; ok && e < entries.size(); e++) {
+    buffer.clear();
+    for (int c = 0; c < 2; c++) {
+      pcl::PointCloud<PointT> const &cloud = c == 0 ? *clouds[e].first : *clouds[e].second;
+      for (size_t p = 0; p < cloud.points.size(); p++) {
+        CubeMapPoint point;
+        point.x = cloud.points[p].x;
+        point.y = cloud.points[p].y;
+        point.z = cloud.points[p].z;
+        point.intensity = cloud.points[p].intensity;
+        buffer.push_back(point);
+      }
+    }
+    ok = fwrite(&buffer[0], sizeof(CubeMapPoint), buffer.size(), fp) == buffer.size();
+  }
+
+  ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+  ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmpFile.c_str(), file.c_str()) != 0) {
+    unlink(tmpFile.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Reads a map saved from a grid of the same size, the cubes outside the grid go to offGrid. The
+// file is validated completely before any cube is touched; on failure the arrays and offGrid
+// are left as they were. Cubes absent from the file are cleared.
+template <typename PointT>
+bool loadCubeMap(std::string const &file, int width, int height, int depth, CubeMapHeader &header,
+                 typename pcl::PointCloud<PointT>::Ptr *cornerArray,
+                 typename pcl::PointCloud<PointT>::Ptr *surfArray,
+                 std::vector<OffGridCube<PointT> > &offGrid)
+{
+  int fd = open(file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(CubeMapHeader)) {
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+  madvise(mapped, size, MADV_SEQUENTIAL);
+  const char *data = static_cast<const char *>(mapped);
+
+  memcpy(&header, data, sizeof(header));
+  bool ok = memcmp(header.magic, cubeMapMagic, sizeof(header.magic)) == 0 &&
+            (header.version == 1 || header.version == cubeMapVersion) &&
+            header.width == width && header.height == height && header.depth == depth &&
+            header.cubeCount <= size / sizeof(CubeMapEntry) &&
+            header.pointCount <= size / sizeof(CubeMapPoint) &&
+            size == sizeof(CubeMapHeader) + header.cubeCount * sizeof(CubeMapEntry) +
+                    header.pointCount * sizeof(CubeMapPoint);
+
+  const CubeMapEntry *entries = reinterpret_cast<const CubeMapEntry *>(data + sizeof(CubeMapHeader));
+  uint64_t pointCount = 0;
+  for (uint32_t e = 0; ok && e < header.cubeCount; e++) {
+    ok = header.version > 1 || inCubeGrid(entries[e], width, height, depth);
+    pointCount += uint64_t(entries[e].cornerNum) + entries[e].surfNum;
+  }
+  if (!ok || pointCount != header.pointCount) {
+    munmap(mapped, size);
+    return false;
+  }
+
+  for (int ind = 0; ind < width * height * depth; ind++) {
+    cornerArray[ind]->clear();
+    surfArray[ind]->clear();
+  }
+  offGrid.clear();
+
+  const CubeMapPoint *points = reinterpret_cast<const CubeMapPoint *>(
+      data + sizeof(CubeMapHeader) + header.cubeCount * sizeof(CubeMapEntry));
+  for (uint32_t e = 0; e < header.cubeCount; e++) {
+    typename pcl::PointCloud<PointT>::Ptr corner, surf;
+    if (inCubeGrid(entries[e], width, height, depth)) {
+      int ind = entries[e].i + width * entries[e].j + width * height * entries[e].k;
+      corner = cornerArray[ind];
+      surf = surfArray[ind];
+    } else {
+      OffGridCube<PointT> cube;
+      cube.i = entries[e].i;
+      cube.j = entries[e].j;
+      cube.k = entries[e].k;
+      cube.corner.reset(new pcl::PointCloud<PointT>());
+      cube.surf.reset(new pcl::PointCloud<PointT>());
+      offGrid.push_back(cube);
+      corner = cube.corner;
+      surf = cube.surf;
+    }
+    for (int c = 0; c < 2; c++) {
+      pcl::PointCloud<PointT> &cloud = c == 0 ? *corner : *surf;
+      uint32_t num = c == 0 ? entries[e].cornerNum : entries[e].surfNum;
+      cloud.points.resize(num);
+      for (uint32_t p = 0; p < num; p++) {
+        cloud.points[p].x = points[p].x;
+        cloud.points[p].y = points[p].y;
+        cloud.points[p].z = points[p].z;
+        cloud.points[p].intensity = points[p].intensity;
+      }
+      cloud.width = num;
+      cloud.height = 1;
+      cloud.is_dense = true;
+      points += num;
+    }
+  }
+
+  munmap(mapped, size);
+  return true;
+}
+
+#endif // LOAM_VELODYNE_MAP_IO_H
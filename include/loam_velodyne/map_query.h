@@ -0,0 +1,154 @@
+#ifndef LOAM_VELODYNE_MAP_QUERY_H
+#define LOAM_VELODYNE_MAP_QUERY_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <pcl/kdtree/kdtree_flann.h>
+#include <pcl/point_cloud.h>
+
+// The submap ncrl_laserMapping matched a sweep against, together with its kd-trees. A snapshot
+// is never modified once shared, the mapping node builds the next sweep's submap and trees in
+// new objects, so queries run on it without locks or copies while mapping goes on.
+template <typename PointT>
+struct MapSnapshot
+{
+  typedef std::shared_ptr<const MapSnapshot> ConstPtr;
+  typedef typename pcl::PointCloud<PointT>::ConstPtr CloudConstPtr;
+  typedef typename pcl::KdTreeFLANN<PointT>::ConstPtr KdTreeConstPtr;
+
+  double time;                 // sweep the submap was matched against, 0 for a frozen map
+  uint32_t revision;           // map revision the submap was assembled at
+  CloudConstPtr corner;
+  CloudConstPtr surf;
+  KdTreeConstPtr kdtreeCorner; // null when the cloud is empty
+  KdTreeConstPtr kdtreeSurf;
+};
+
+// A query over the layers of a snapshot. The results of all layers are merged by distance to
+// the query center; maxPoints / k bound the merged result.
+template <typename PointT>
+class MapQuery
+{
+public:
+  MapQuery() : _maxPoints(0) {}
+
+  void addLayer(typename MapSnapshot<PointT>::KdTreeConstPtr const &kdtree)
+  {
+    if (kdtree && kdtree->getInputCloud()) {
+      _layers.push_back(kdtree);
+    }
+  }
+
+  // 0 keeps all points of radius and box queries
+  void setMaxPoints(unsigned maxPoints) { _maxPoints = maxPoints; }
+
+  void radius(PointT const &center, float radius)
+  {
+    _results.clear();
+    for (size_t l = 0; l < _layers.size(); l++) {
+      _layers[l]->radiusSearch(center, radius, _indices, _sqDistances, _maxPoints);
+      collect(l);
+    }
+    finish(_maxPoints);
+  }
+
+  void box(PointT const &min, PointT const &max)
+  {
+    PointT center = min;
+    center.x = (min.x + max.x) / 2;
+    center.y = (min.y + max.y) / 2;
+    center.z = (min.z + max.z) / 2;
+    float dx = max.x - min.x;
+    float dy = max.y - min.y;
+    float dz = max.z - min.z;
+    float halfDiagonal = std::sqrt(dx * dx + dy * dy + dz * dz) / 2;
+
+    _results.clear();
+    if (dx < 0 || dy < 0 || dz < 0) {
+      return;
+    }
+    // the sphere around the box, sorted by distance so the nearest points survive maxPoints
+    for (size_t l = 0; l < _layers.size(); l++) {
+      _layers[l]->radiusSearch(center, halfDiagonal, _indices, _sqDistances, 0);
+      pcl::PointCloud<PointT> const &cloud = *_layers[l]->getInputCloud();
+      size_t kept = 0;
+      for (size_t i = 0; i < _indices.size(); i++) {
+        PointT const &point = cloud.points[_indices[i]];
+        if (point.x >= min.x && point.x <= max.x &&
+            point.y >= min.y && point.y <= max.y &&
+            point.z >= min.z && point.z <= max.z) {
+          _indices[kept] = _indices[i];
+          _sqDistances[kept] = _sqDistances[i];
+          kept++;
+        }
+      }
+      _indices.resize(kept);
+      _sqDistances.resize(kept);
+      collect(l);
+    }
+    finish(_maxPoints);
+  }
+
+  void nearest(PointT const &center, int k)
+  {
+    _results.clear();
+    for (size_t l = 0; k > 0 && l < _layers.size(); l++) {
+      _layers[l]->nearestKSearch(center, k, _indices, _sqDistances);
+      collect(l);
+    }
+    finish(k > 0 ? k : 0);
+  }
+
+  // results of the last query, ascending distance
+  void result(pcl::PointCloud<PointT> &cloud, std::vector<float> &sqDistances) const
+  {
+    cloud.clear();
+    cloud.points.reserve(_results.size());
+    sqDistances.resize(_results.size());
+    for (size_t r = 0; r < _results.size(); r++) {
+      cloud.push_back(_layers[_results[r].layer]->getInputCloud()->points[_results[r].index]);
+      sqDistances[r] = _results[r].sqDistance;
+    }
+  }
+
+private:
+  struct Result
+  {
+    float sqDistance;
+    uint32_t layer;
+    int index;
+
+    bool operator<(Result const &other) const { return sqDistance < other.sqDistance; }
+  };
+
+  void collect(size_t layer)
+  {
+    for (size_t i = 0; i < _indices.size(); i++) {
+      Result r = {_sqDistances[i], uint32_t(layer), _indices[i]};
+      _results.push_back(r);
+    }
+  }
+
+  void finish(size_t limit)
+  {
+    if (limit > 0 && _results.size() > limit) {
+      std::partial_sort(_results.begin(), _results.begin() + limit, _results.end());
+      _results.resize(limit);
+    } else {
+      std::sort(_results.begin(), _results.end());
+    }
+  }
+
+  std::vector<typename MapSnapshot<PointT>::KdTreeConstPtr> _layers;
+  unsigned _maxPoints;
+  std::vector<int> _indices;
+  std::vector<float> _sqDistances;
+  std::vector<Result> _results;
+};
+
+#endif // LOAM_VELODYNE_MAP_QUERY_H
@@ -0,0 +1,101 @@
+#ifndef LOAM_VELODYNE_POSE_HISTORY_H
+#define LOAM_VELODYNE_POSE_HISTORY_H
+
+#include <cstddef>
+#include <vector>
+
+#include <tf/transform_datatypes.h>
+
+// Fixed size ring of time ordered poses. Storage is allocated once in the constructor,
+// push() and lookup() never allocate. Not thread safe, the owner serializes access.
+class PoseHistory
+{
+public:
+  explicit PoseHistory(size_t capacity = 2000)
+    : _stamps(capacity > 1 ? capacity : 2),
+      _rotations(_stamps.size()),
+      _positions(_stamps.size()),
+      _head(0),
+      _size(0)
+  {}
+
+  // append a pose, a stamp equal to the newest one replaces it (e.g. after a mapping correction),
+  // an older stamp is rejected
+  bool push(double t, tf::Quaternion const &q, tf::Vector3 const &p)
+  {
+    if (_size > 0) {
+      size_t newest = index(_size - 1);
+      if (t < _stamps[newest]) {
+        return false;
+      }
+      if (t == _stamps[newest]) {
+        _rotations[newest] = q;
+        _positions[newest] = p;
+        return true;
+      }
+    }
+
+    size_t i;
+    if (_size < _stamps.size()) {
+      i = index(_size);
+      _size++;
+    } else {
+      // full, overwrite the oldest
+      i = _head;
+      _head = (_head + 1) % _stamps.size();
+    }
+    _stamps[i] = t;
+    _rotations[i] = q;
+    _positions[i] = p;
+    return true;
+  }
+
+  // pose at time t, slerp / lerp between the two bracketing samples,
+  // false if t lies outside the stored span
+  bool lookup(double t, tf::Quaternion &q, tf::Vector3 &p) const
+  {
+    if (_size == 0 || t < oldest() || t > newest()) {
+      return false;
+    }
+
+    // first sample with stamp >= t
+    size_t lo = 0, hi = _size - 1;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (_stamps[index(mid)] < t) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    size_t front = index(lo);
+    if (lo == 0 || _stamps[front] == t) {
+      q = _rotations[front];
+      p = _positions[front];
+      return true;
+    }
+
+    size_t back = index(lo - 1);
+    double ratio = (t - _stamps[back]) / (_stamps[front] - _stamps[back]);
+    q = _rotations[back].slerp(_rotations[front], ratio);
+    p = _positions[back].lerp(_positions[front], ratio);
+    return true;
+  }
+
+  size_t size() const { return _size; }
+  size_t capacity() const { return _stamps.size(); }
+  double oldest() const { return _stamps[_head]; }
+  double newest() const { return _stamps[index(_size - 1)]; }
+
+private:
+  size_t index(size_t i) const { return (_head + i) % _stamps.size(); }
+
+  std::vector<double> _stamps;
+  std::vector<tf::Quaternion> _rotations;
+  std::vector<tf::Vector3> _positions;
+  size_t _head;
+  size_t _size;
+};
+
+#endif // LOAM_VELODYNE_POSE_HISTORY_H
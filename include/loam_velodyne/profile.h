@@ -0,0 +1,152 @@
+#ifndef LOAM_VELODYNE_PROFILE_H
+#define LOAM_VELODYNE_PROFILE_H
+
+#include <mutex>
+#include <string>
+
+#include <ros/ros.h>
+#include <std_msgs/String.h>
+
+// Knobs that trade cpu for accuracy, shared by the ncrl nodes. Each node reads the ones it uses.
+struct PipelineProfile
+{
+  int skipFrameNum;           // odometry : clouds are published to mapping every skipFrameNum + 1 sweeps
+  int stackFrameNum;          // mapping : sweeps stacked per optimization
+  int mapFrameNum;            // mapping : optimizations per surround map publication
+  int odometryMaxIterations;
+  int mappingMaxIterations;
+  float lessFlatLeafSize;     // scanRegistration
+  float cornerLeafSize;       // mapping
+  float surfLeafSize;         // mapping
+  float mapLeafSize;          // mapping
+  int nearestK;               // mapping : neighbours of a line / plane correspondence
+  float distanceGate;         // mapping : max squared distance of the farthest neighbour
+};
+
+// "embedded", "default" or "survey"
+inline bool profileByName(std::string const &name, PipelineProfile &profile)
+{
+  if (name == "default") {
+    profile.skipFrameNum = 1;
+    profile.stackFrameNum = 1;
+    profile.mapFrameNum = 5;
+    profile.odometryMaxIterations = 25;
+    profile.mappingMaxIterations = 10;
+    profile.lessFlatLeafSize = 0.2;
+    profile.cornerLeafSize = 0.2;
+    profile.surfLeafSize = 0.4;
+    profile.mapLeafSize = 0.6;
+    profile.nearestK = 5;
+    profile.distanceGate = 1.0;
+  } else if (name == "embedded") {
+    profile.skipFrameNum = 2;
+    profile.stackFrameNum = 2;
+    profile.mapFrameNum = 10;
+    profile.odometryMaxIterations = 12;
+    profile.mappingMaxIterations = 5;
+    profile.lessFlatLeafSize = 0.4;
+    profile.cornerLeafSize = 0.4;
+    profile.surfLeafSize = 0.8;
+    profile.mapLeafSize = 1.0;
+    profile.nearestK = 5;
+    profile.distanceGate = 1.0;
+  } else if (name == "survey") {
+    profile.skipFrameNum = 0;
+    profile.stackFrameNum = 1;
+    profile.mapFrameNum = 2;
+    profile.odometryMaxIterations = 30;
+    profile.mappingMaxIterations = 20;
+    profile.lessFlatLeafSize = 0.1;
+    profile.cornerLeafSize = 0.1;
+    profile.surfLeafSize = 0.2;
+    profile.mapLeafSize = 0.4;
+    profile.nearestK = 8;
+    profile.distanceGate = 1.5;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Selects the profile named by ~profile, then applies per-knob private parameters on top.
+// A name published on /loam_profile (std_msgs/String) switches all nodes at runtime; the
+// per-knob parameters still win over the preset.
+class ProfileManager
+{
+public:
+  ProfileManager(ros::NodeHandle &nh, ros::NodeHandle &nhPrivate, std::string const &node)
+    : _nhPrivate(nhPrivate), _node(node)
+  {
+    std::string name;
+    _nhPrivate.param<std::string>("profile", name, "default");
+    if (!select(name)) {
+      ROS_WARN("%s: unknown profile %s, using default", _node.c_str(), name.c_str());
+      select("default");
+    }
+    _subProfile = nh.subscribe<std_msgs::String>("/loam_profile", 1, &ProfileManager::profileHandler, this);
+  }
+
+  PipelineProfile current() const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _profile;
+  }
+
+  std::string name() const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _name;
+  }
+
+  void profileHandler(std_msgs::String::ConstPtr const &msg)
+  {
+    if (select(msg->data)) {
+      ROS_INFO("%s: switched to profile %s", _node.c_str(), msg->data.c_str());
+    } else {
+      ROS_WARN("%s: unknown profile %s ignored", _node.c_str(), msg->data.c_str());
+    }
+  }
+
+private:
+  bool select(std::string const &name)
+  {
+    PipelineProfile profile;
+    if (!profileByName(name, profile)) {
+      return false;
+    }
+
+    _nhPrivate.param("skip_frame_num", profile.skipFrameNum, profile.skipFrameNum);
+    _nhPrivate.param("stack_frame_num", profile.stackFrameNum, profile.stackFrameNum);
+    _nhPrivate.param("map_frame_num", profile.mapFrameNum, profile.mapFrameNum);
+    _nhPrivate.param("odometry_max_iterations", profile.odometryMaxIterations, profile.odometryMaxIterations);
+    _nhPrivate.param("mapping_max_iterations", profile.mappingMaxIterations, profile.mappingMaxIterations);
+    _nhPrivate.param("less_flat_leaf_size", profile.lessFlatLeafSize, profile.lessFlatLeafSize);
+    _nhPrivate.param("corner_leaf_size", profile.cornerLeafSize, profile.cornerLeafSize);
+    _nhPrivate.param("surf_leaf_size", profile.surfLeafSize, profile.surfLeafSize);
+    _nhPrivate.param("map_leaf_size", profile.mapLeafSize, profile.mapLeafSize);
+    _nhPrivate.param("nearest_k", profile.nearestK, profile.nearestK);
+    _nhPrivate.param("distance_gate", profile.distanceGate, profile.distanceGate);
+
+    // the plane fit needs at least 3 neighbours, the counters and solvers at least one step
+    if (profile.nearestK < 3) profile.nearestK = 3;
+    if (profile.stackFrameNum < 1) profile.stackFrameNum = 1;
+    if (profile.mapFrameNum < 1) profile.mapFrameNum = 1;
+    if (profile.skipFrameNum < 0) profile.skipFrameNum = 0;
+    if (profile.odometryMaxIterations < 1) profile.odometryMaxIterations = 1;
+    if (profile.mappingMaxIterations < 1) profile.mappingMaxIterations = 1;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _profile = profile;
+    _name = name;
+    return true;
+  }
+
+  ros::NodeHandle _nhPrivate;
+  std::string _node;
+  ros::Subscriber _subProfile;
+  mutable std::mutex _mutex;
+  PipelineProfile _profile;
+  std::string _name;
+};
+
+#endif // LOAM_VELODYNE_PROFILE_H
@@ -0,0 +1,61 @@
+#ifndef LOAM_VELODYNE_SOLVER_BUFFERS_H
+#define LOAM_VELODYNE_SOLVER_BUFFERS_H
+
+#include <algorithm>
+
+#include <opencv/cv.h>
+
+// Matrices of one Gauss-Newton step of the odometry and mapping solvers, allocated once per
+// node. matA / matB view the first rows of a storage that grows to the largest correspondence
+// count seen, the 6 x 6 products are written in place.
+class SolverBuffers
+{
+public:
+  SolverBuffers()
+    : matAtA(6, 6, CV_32F, cv::Scalar::all(0)),
+      matAtB(6, 1, CV_32F, cv::Scalar::all(0)),
+      matX(6, 1, CV_32F, cv::Scalar::all(0)),
+      matX2(6, 1, CV_32F, cv::Scalar::all(0)),
+      matE(1, 6, CV_32F, cv::Scalar::all(0)),
+      matV(6, 6, CV_32F, cv::Scalar::all(0)),
+      matV2(6, 6, CV_32F, cv::Scalar::all(0)),
+      matVInv(6, 6, CV_32F, cv::Scalar::all(0))
+  {}
+
+  // makes matA / matB rows x 6 / rows x 1, their content is undefined
+  void resize(int rows)
+  {
+    if (rows > _storageA.rows) {
+      int capacity = std::max(rows, 2 * _storageA.rows);
+      _storageA.create(capacity, 6, CV_32F);
+      _storageB.create(capacity, 1, CV_32F);
+    }
+    matA = _storageA.rowRange(0, rows);
+    matB = _storageB.rowRange(0, rows);
+  }
+
+  // matX from the normal equations of matA, matB
+  void solve()
+  {
+    cv::gemm(matA, matA, 1, cv::noArray(), 0, matAtA, cv::GEMM_1_T);
+    cv::gemm(matA, matB, 1, cv::noArray(), 0, matAtB, cv::GEMM_1_T);
+    cv::solve(matAtA, matAtB, matX, cv::DECOMP_QR);
+  }
+
+  cv::Mat matA;
+  cv::Mat matB;
+  cv::Mat matAtA;
+  cv::Mat matAtB;
+  cv::Mat matX;
+  cv::Mat matX2;
+  cv::Mat matE;
+  cv::Mat matV;
+  cv::Mat matV2;
+  cv::Mat matVInv;
+
+private:
+  cv::Mat _storageA;
+  cv::Mat _storageB;
+};
+
+#endif // LOAM_VELODYNE_SOLVER_BUFFERS_H
@@ -0,0 +1,352 @@
+#ifndef LOAM_VELODYNE_TELEMETRY_H
+#define LOAM_VELODYNE_TELEMETRY_H
+
+// Per-stage timing of the ncrl pipeline.
+//
+// Build with -DLOAM_TELEMETRY=ON to enable. Otherwise every macro below expands to nothing
+// and this header pulls in no dependencies.
+//
+//   LOAM_SPAN(Curvature);               // times the rest of the enclosing scope
+//   LOAM_SPAN_BEGIN(Publish); ... LOAM_SPAN_END(Publish);
+//   LOAM_SPAN_DEFER(OdomSolve);         // accumulates several intervals into one sample
+//   for (...) { LOAM_SPAN_RESUME(OdomSolve); ... LOAM_SPAN_PAUSE(OdomSolve); }
+//   LOAM_SPAN_END(OdomSolve);
+//   LOAM_TELEMETRY_REPORTER(nh, nhPrivate, "ncrl_laserMapping");  // in main
+//
+// The reporter publishes p50 / p99 / max per stage on /diagnostics every ~telemetry_period
+// seconds and writes a csv summary to ~telemetry_csv on shutdown.
+// With LOAM_TRACE every span interval is also exported as a trace event, see trace.h.
+
+// LOAM_TRACE_SWEEP / LOAM_TRACE_WRITER come with the spans whether or not telemetry is on
+#include <loam_velodyne/trace.h>
+
+#ifdef LOAM_TELEMETRY
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include <ros/ros.h>
+
+namespace loam {
+namespace telemetry {
+
+enum Stage {
+  Ingest = 0,
+  Deskew,
+  Curvature,
+  FeaturePick,
+  OdomCorrespondence,
+  OdomSolve,
+  SubmapBuild,
+  MappingSolve,
+  MapInsert,
+  Publish,
+  StageCount
+};
+
+inline const char *stageName(int stage)
+{
+  static const char *names[StageCount] = {
+    "ingest", "deskew", "curvature", "feature_pick", "odom_correspondence",
+    "odom_solve", "submap_build", "mapping_solve", "map_insert", "publish"
+  };
+  return names[stage];
+}
+
+// log scale histogram of durations, 4 buckets per octave from 1 us up to ~67 s,
+// lock free so that worker threads record concurrently with the reporter
+class Histogram
+{
+public:
+  static const int bucketsPerOctave = 4;
+  static const int bucketCount = 26 * bucketsPerOctave + 1;
+
+  Histogram() : _count(0), _sumNs(0), _maxNs(0)
+  {
+    for (int i = 0; i < bucketCount; i++) {
+      _buckets[i] = 0;
+    }
+  }
+
+  void record(uint64_t ns)
+  {
+    _buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+    _sumNs.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t max = _maxNs.load(std::memory_order_relaxed);
+    while (ns > max && !_maxNs.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+  }
+
+  static int bucket(uint64_t ns)
+  {
+    double us = ns * 1e-3;
+    if (us <= 1.0) {
+      return 0;
+    }
+    int b = 1 + int(std::log2(us) * bucketsPerOctave);
+    return b < bucketCount ? b : bucketCount - 1;
+  }
+
+  // upper edge of bucket b in milliseconds
+  static double bucketEdgeMs(int b)
+  {
+    return std::pow(2.0, double(b) / bucketsPerOctave) * 1e-3;
+  }
+
+  uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+  uint64_t sumNs() const { return _sumNs.load(std::memory_order_relaxed); }
+  uint64_t maxNs() const { return _maxNs.load(std::memory_order_relaxed); }
+  uint64_t bucketCountAt(int b) const { return _buckets[b].load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> _buckets[bucketCount];
+  std::atomic<uint64_t> _count;
+  std::atomic<uint64_t> _sumNs;
+  std::atomic<uint64_t> _maxNs;
+};
+
+// plain copy of a histogram, the reporter diffs two of them to get the last period
+struct HistogramSnapshot
+{
+  uint64_t buckets[Histogram::bucketCount];
+  uint64_t count;
+  uint64_t sumNs;
+  uint64_t maxNs;
+
+  HistogramSnapshot() : count(0), sumNs(0), maxNs(0)
+  {
+    for (int i = 0; i < Histogram::bucketCount; i++) {
+      buckets[i] = 0;
+    }
+  }
+
+  explicit HistogramSnapshot(Histogram const &h)
+    : count(h.count()), sumNs(h.sumNs()), maxNs(h.maxNs())
+  {
+    for (int i = 0; i < Histogram::bucketCount; i++) {
+      buckets[i] = h.bucketCountAt(i);
+    }
+  }
+
+  // q in [0, 1], bucket upper edge of the q quantile of (*this - since)
+  double quantileMs(double q, HistogramSnapshot const &since) const
+  {
+    uint64_t total = 0;
+    for (int i = 0; i < Histogram::bucketCount; i++) {
+      total += buckets[i] - since.buckets[i];
+    }
+    if (total == 0) {
+      return 0;
+    }
+
+    uint64_t rank = uint64_t(std::ceil(q * total));
+    uint64_t seen = 0;
+    for (int i = 0; i < Histogram::bucketCount; i++) {
+      seen += buckets[i] - since.buckets[i];
+      if (seen >= rank) {
+        return Histogram::bucketEdgeMs(i);
+      }
+    }
+    return Histogram::bucketEdgeMs(Histogram::bucketCount - 1);
+  }
+};
+
+inline Histogram *histograms()
+{
+  static Histogram h[StageCount];
+  return h;
+}
+
+class Span
+{
+public:
+  explicit Span(Stage stage, bool running = true)
+    : _stage(stage), _running(false), _done(false), _elapsed(0)
+  {
+    if (running) {
+      resume();
+    }
+  }
+
+  ~Span()
+  {
+    stop();
+  }
+
+  void resume()
+  {
+    if (!_running) {
+      _start = std::chrono::steady_clock::now();
+      _running = true;
+#ifdef LOAM_TRACE
+      _wallStartUs = trace::wallMicroseconds();
+#endif
+    }
+  }
+
+  void pause()
+  {
+    if (_running) {
+      std::chrono::steady_clock::duration interval = std::chrono::steady_clock::now() - _start;
+      _elapsed += interval;
+      _running = false;
+#ifdef LOAM_TRACE
+      trace::record(stageName(_stage), _wallStartUs,
+                    std::chrono::duration_cast<std::chrono::microseconds>(interval).count());
+#endif
+    }
+  }
+
+  // records once, later calls are no-ops
+  void stop()
+  {
+    if (_done) {
+      return;
+    }
+    pause();
+    _done = true;
+    histograms()[_stage].record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(_elapsed).count());
+  }
+
+private:
+  Stage _stage;
+  bool _running;
+  bool _done;
+  std::chrono::steady_clock::time_point _start;
+  std::chrono::steady_clock::duration _elapsed;
+#ifdef LOAM_TRACE
+  int64_t _wallStartUs;
+#endif
+};
+
+class Reporter
+{
+public:
+  Reporter(ros::NodeHandle &nh, ros::NodeHandle &nhPrivate, std::string const &node)
+    : _node(node)
+  {
+    double period;
+    nhPrivate.param("telemetry_period", period, 1.0);
+    nhPrivate.param<std::string>("telemetry_csv", _csvFile, "");
+
+    _pubDiagnostics = nh.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 5);
+    _lastReport = ros::WallTime::now();
+    _timer = nh.createWallTimer(ros::WallDuration(period), &Reporter::report, this);
+  }
+
+  ~Reporter()
+  {
+    if (!_csvFile.empty() && !dumpCsv(_csvFile)) {
+      ROS_WARN("%s: failed to write telemetry to %s", _node.c_str(), _csvFile.c_str());
+    }
+  }
+
+  void report(ros::WallTimerEvent const &)
+  {
+    ros::WallTime now = ros::WallTime::now();
+    double period = (now - _lastReport).toSec();
+    _lastReport = now;
+
+    diagnostic_msgs::DiagnosticArray msg;
+    msg.header.stamp = ros::Time::now();
+    for (int s = 0; s < StageCount; s++) {
+      HistogramSnapshot current(histograms()[s]);
+      HistogramSnapshot &last = _last[s];
+      uint64_t count = current.count - last.count;
+      if (current.count == 0) {
+        continue;
+      }
+
+      diagnostic_msgs::DiagnosticStatus status;
+      status.level = diagnostic_msgs::DiagnosticStatus::OK;
+      status.name = _node + ": " + stageName(s);
+      status.hardware_id = _node;
+      status.message = count > 0 ? "active" : "idle";
+      addValue(status, "count", double(current.count));
+      addValue(status, "rate_hz", period > 0 ? count / period : 0);
+      addValue(status, "mean_ms", count > 0 ? (current.sumNs - last.sumNs) * 1e-6 / count : 0);
+      addValue(status, "p50_ms", current.quantileMs(0.5, last));
+      addValue(status, "p99_ms", current.quantileMs(0.99, last));
+      addValue(status, "max_ms", current.maxNs * 1e-6);
+      msg.status.push_back(status);
+
+      last = current;
+    }
+
+    if (!msg.status.empty()) {
+      _pubDiagnostics.publish(msg);
+    }
+  }
+
+  // whole run summary, one row per stage
+  bool dumpCsv(std::string const &file) const
+  {
+    FILE *fp = fopen(file.c_str(), "w");
+    if (fp == NULL) {
+      return false;
+    }
+
+    HistogramSnapshot empty;
+    fprintf(fp, "node,stage,count,mean_ms,p50_ms,p99_ms,max_ms\n");
+    for (int s = 0; s < StageCount; s++) {
+      HistogramSnapshot h(histograms()[s]);
+      if (h.count == 0) {
+        continue;
+      }
+      fprintf(fp, "%s,%s,%llu,%.3f,%.3f,%.3f,%.3f\n", _node.c_str(), stageName(s),
+              (unsigned long long)h.count, h.sumNs * 1e-6 / h.count,
+              h.quantileMs(0.5, empty), h.quantileMs(0.99, empty), h.maxNs * 1e-6);
+    }
+    return fclose(fp) == 0;
+  }
+
+private:
+  static void addValue(diagnostic_msgs::DiagnosticStatus &status, std::string const &key, double value)
+  {
+    diagnostic_msgs::KeyValue kv;
+    kv.key = key;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.3f", value);
+    kv.value = buf;
+    status.values.push_back(kv);
+  }
+
+  std::string _node;
+  std::string _csvFile;
+  ros::Publisher _pubDiagnostics;
+  ros::WallTimer _timer;
+  ros::WallTime _lastReport;
+  HistogramSnapshot _last[StageCount];
+};
+
+} // namespace telemetry
+} // namespace loam
+
+#define LOAM_SPAN(stage) loam::telemetry::Span _loam_span_##stage(loam::telemetry::stage)
+#define LOAM_SPAN_BEGIN(stage) loam::telemetry::Span _loam_span_##stage(loam::telemetry::stage)
+#define LOAM_SPAN_DEFER(stage) loam::telemetry::Span _loam_span_##stage(loam::telemetry::stage, false)
+#define LOAM_SPAN_RESUME(stage) _loam_span_##stage.resume()
+#define LOAM_SPAN_PAUSE(stage) _loam_span_##stage.pause()
+#define LOAM_SPAN_END(stage) _loam_span_##stage.stop()
+#define LOAM_TELEMETRY_REPORTER(nh, nhPrivate, node) \
+  loam::telemetry::Reporter _loam_telemetry_reporter(nh, nhPrivate, node)
+
+#else
+
+#define LOAM_SPAN(stage) ((void)0)
+#define LOAM_SPAN_BEGIN(stage) ((void)0)
+#define LOAM_SPAN_DEFER(stage) ((void)0)
+#define LOAM_SPAN_RESUME(stage) ((void)0)
+#define LOAM_SPAN_PAUSE(stage) ((void)0)
+#define LOAM_SPAN_END(stage) ((void)0)
+#define LOAM_TELEMETRY_REPORTER(nh, nhPrivate, node) ((void)0)
+
+#endif // LOAM_TELEMETRY
+
+#endif // LOAM_VELODYNE_TELEMETRY_H
@@ -0,0 +1,295 @@
+#ifndef LOAM_VELODYNE_TILE_STORE_H
+#define LOAM_VELODYNE_TILE_STORE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <pcl/point_cloud.h>
+#include <ros/console.h>
+
+#include <loam_velodyne/map_io.h>
+
+// Map cube by its position in /camera_init, in cubes, independent of where the sliding grid
+// currently holds it.
+struct CubeKey
+{
+  int i;
+  int j;
+  int k;
+
+  bool operator==(CubeKey const &other) const
+  {
+    return i == other.i && j == other.j && k == other.k;
+  }
+};
+
+struct CubeKeyHash
+{
+  size_t operator()(CubeKey const &key) const
+  {
+    return (size_t(key.i) * 73856093u) ^ (size_t(key.j) * 19349663u) ^ (size_t(key.k) * 83492791u);
+  }
+};
+
+// Cubes evicted from the mapping grid, one file per cube in a local directory. The files are
+// written and read by a background thread in request order, so the caller never waits for disk.
+// A cube evicted again before it was paged back in is appended to its file, and a page in
+// removes the file; a cube is therefore either resident or on disk, never both. Tiles left in
+// the directory by an earlier run are deleted, the saved map carries its evicted cubes itself.
+// All public methods are called from one thread.
+template <typename PointT>
+class TileStore
+{
+public:
+  typedef typename pcl::PointCloud<PointT>::Ptr CloudPtr;
+
+  struct Tile
+  {
+    CubeKey key;
+    CloudPtr corner;
+    CloudPtr surf;
+  };
+
+  explicit TileStore(std::string const &directory)
+    : _directory(directory), _quit(false), _busy(false), _thread(&TileStore::run, this)
+  {
+    DIR *dir = opendir(_directory.c_str());
+    if (dir == NULL) {
+      return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      CubeKey key;
+      char suffix[8];
+      if (sscanf(entry->d_name, "%d_%d_%d.%7s", &key.i, &key.j, &key.k, suffix) != 4 ||
+          strcmp(suffix, "tile") != 0) {
+        continue;
+      }
+      unlink(path(key).c_str());
+    }
+    closedir(dir);
+  }
+
+  ~TileStore()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _quit = true;
+      _cond.notify_all();
+    }
+    _thread.join();
+  }
+
+  // hands the clouds of a cube over to be written, the caller must not touch them afterwards
+  void evict(CubeKey const &key, CloudPtr const &corner, CloudPtr const &surf)
+  {
+    Tile tile;
+    tile.key = key;
+    tile.corner = corner;
+    tile.surf = surf;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stored.insert(key);
+    _ops.push_back(Op(Op::Write, tile));
+    _cond.notify_all();
+  }
+
+  bool stored(CubeKey const &key) const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stored.count(key) > 0;
+  }
+
+  // queues a page in, returns false when the cube is not on disk
+  bool request(CubeKey const &key)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_stored.erase(key) == 0) {
+      return false;
+    }
+    Tile tile;
+    tile.key = key;
+    _ops.push_back(Op(Op::Read, tile));
+    _cond.notify_all();
+    return true;
+  }
+
+  // cubes paged in since the last call
+  void collect(std::vector<Tile> &tiles)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    tiles.insert(tiles.end(), _loaded.begin(), _loaded.end());
+    _loaded.clear();
+  }
+
+  // every cube that is not resident, for saving the whole map: waits for the queued operations,
+  // reads the stored cubes without removing them and adds the paged in cubes not yet collected.
+  // Returns false when a stored cube could not be read completely.
+  bool snapshot(std::vector<Tile> &tiles)
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cond.wait(lock, [this]{ return _ops.empty() && !_busy; });
+    bool ok = true;
+    for (typename std::unordered_set<CubeKey, CubeKeyHash>::const_iterator it = _stored.begin();
+         it != _stored.end(); ++it) {
+      Tile tile;
+      tile.key = *it;
+      tile.corner.reset(new pcl::PointCloud<PointT>());
+      tile.surf.reset(new pcl::PointCloud<PointT>());
+      if (!read(tile, false)) {
+        ROS_WARN("tile store: failed to read %s", path(tile.key).c_str());
+        ok = false;
+      }
+      tiles.push_back(tile);
+    }
+    tiles.insert(tiles.end(), _loaded.begin(), _loaded.end());
+    return ok;
+  }
+
+  size_t storedCount() const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stored.size();
+  }
+
+  // operations not yet executed by the background thread
+  size_t backlog() const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _ops.size();
+  }
+
+private:
+  struct Op
+  {
+    enum Type { Write, Read };
+    Type type;
+    Tile tile;
+
+    Op(Type t, Tile const &x) : type(t), tile(x) {}
+  };
+
+  std::string path(CubeKey const &key) const
+  {
+    char name[64];
+    snprintf(name, sizeof(name), "/%d_%d_%d.tile", key.i, key.j, key.k);
+    return _directory + name;
+  }
+
+  void run()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+      _cond.wait(lock, [this]{ return !_ops.empty() || _quit; });
+      if (_ops.empty()) {
+        return;
+      }
+      Op op = _ops.front();
+      _ops.pop_front();
+      _busy = true;
+      lock.unlock();
+
+      if (op.type == Op::Write) {
+        if (!write(op.tile)) {
+          ROS_WARN("tile store: failed to write %s, cube dropped", path(op.tile.key).c_str());
+        }
+        op.tile.corner.reset();
+        op.tile.surf.reset();
+        lock.lock();
+      } else {
+        op.tile.corner.reset(new pcl::PointCloud<PointT>());
+        op.tile.surf.reset(new pcl::PointCloud<PointT>());
+        read(op.tile, true);
+        lock.lock();
+        _loaded.push_back(op.tile);
+      }
+      _busy = false;
+      _cond.notify_all();
+    }
+  }
+
+  // a file is a sequence of blocks, one per eviction: corner count, surf count, points
+  bool write(Tile const &tile) const
+  {
+    FILE *fp = fopen(path(tile.key).c_str(), "ab");
+    if (fp == NULL) {
+      return false;
+    }
+    uint32_t counts[2] = {uint32_t(tile.corner->points.size()), uint32_t(tile.surf->points.size())};
+    bool ok = fwrite(counts, sizeof(counts), 1, fp) == 1;
+    for (int c = 0; ok && c < 2; c++) {
+      pcl::PointCloud<PointT> const &cloud = c == 0 ? *tile.corner : *tile.surf;
+      for (size_t p = 0; ok && p < cloud.points.size(); p++) {
+        CubeMapPoint point;
+        point.x = cloud.points[p].x;
+        point.y = cloud.points[p].y;
+        point.z = cloud.points[p].z;
+        point.intensity = cloud.points[p].intensity;
+        ok = fwrite(&point, sizeof(point), 1, fp) == 1;
+      }
+    }
+    return fclose(fp) == 0 && ok;
+  }
+
+  // reads whatever complete blocks the file holds and, with remove, deletes the file. Returns
+  // false when the file is missing or truncated
+  bool read(Tile &tile, bool remove) const
+  {
+    std::string file = path(tile.key);
+    FILE *fp = fopen(file.c_str(), "rb");
+    if (fp == NULL) {
+      return false;
+    }
+    uint32_t counts[2];
+    std::vector<CubeMapPoint> buffer;
+    while (fread(counts, sizeof(counts), 1, fp) == 1) {
+      for (int c = 0; c < 2; c++) {
+        buffer.resize(counts[c]);
+        if (counts[c] > 0 && fread(&buffer[0], sizeof(CubeMapPoint), counts[c], fp) != counts[c]) {
+          fclose(fp);
+          if (remove) {
+            unlink(file.c_str());
+          }
+          return false;
+        }
+        pcl::PointCloud<PointT> &cloud = c == 0 ? *tile.corner : *tile.surf;
+        for (size_t p = 0; p < buffer.size(); p++) {
+          PointT point;
+          point.x = buffer[p].x;
+          point.y = buffer[p].y;
+          point.z = buffer[p].z;
+          point.intensity = buffer[p].intensity;
+          cloud.push_back(point);
+        }
+      }
+    }
+    fclose(fp);
+    if (remove) {
+      unlink(file.c_str());
+    }
+    return true;
+  }
+
+  std::string _directory;
+  mutable std::mutex _mutex;
+  std::condition_variable _cond;
+  bool _quit;
+  bool _busy;   // the background thread executes an operation
+  std::unordered_set<CubeKey, CubeKeyHash> _stored;
+  std::deque<Op> _ops;
+  std::vector<Tile> _loaded;
+  std::thread _thread;
+};
+
+#endif // LOAM_VELODYNE_TILE_STORE_H
@@ -0,0 +1,194 @@
+#ifndef LOAM_VELODYNE_TRACE_H
+#define LOAM_VELODYNE_TRACE_H
+
+// Chrome trace export of the telemetry spans.
+//
+// Build with -DLOAM_TRACE=ON (implies LOAM_TELEMETRY). Every span interval is then also stored
+// as a complete event in a fixed size in-memory buffer. The event is tagged with the sweep
+// stamp the thread is working on (LOAM_TRACE_SWEEP), so frames line up across nodes. The
+// buffer is written as Chrome trace json to ~trace_file on shutdown and whenever a message
+// arrives on ~flush_trace. Each node writes its own file. Open them in chrome://tracing or
+// ui.perfetto.dev; the timestamps are wall clock microseconds, so files from one machine
+// share a time base.
+
+#ifdef LOAM_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+
+#include <ros/ros.h>
+#include <std_msgs/Empty.h>
+
+namespace loam {
+namespace trace {
+
+struct Event
+{
+  std::atomic<bool> ready;
+  const char *name;
+  uint32_t tid;
+  double sweep;
+  int64_t beginUs;
+  int64_t durationUs;
+};
+
+// fixed capacity, events past the end are dropped. Writers only take an atomic index, so
+// recording never blocks or allocates.
+class Buffer
+{
+public:
+  static const size_t capacity = 1 << 18;
+
+  Buffer() : _events(new Event[capacity]), _next(0)
+  {
+    for (size_t i = 0; i < capacity; i++) {
+      _events[i].ready = false;
+    }
+  }
+
+  ~Buffer() { delete[] _events; }
+
+  void record(const char *name, uint32_t tid, double sweep, int64_t beginUs, int64_t durationUs)
+  {
+    size_t i = _next.fetch_add(1, std::memory_order_relaxed);
+    if (i >= capacity) {
+      return;
+    }
+    Event &e = _events[i];
+    e.name = name;
+    e.tid = tid;
+    e.sweep = sweep;
+    e.beginUs = beginUs;
+    e.durationUs = durationUs;
+    e.ready.store(true, std::memory_order_release);
+  }
+
+  size_t size() const
+  {
+    size_t n = _next.load(std::memory_order_relaxed);
+    return n < capacity ? n : capacity;
+  }
+
+  size_t dropped() const
+  {
+    size_t n = _next.load(std::memory_order_relaxed);
+    return n > capacity ? n - capacity : 0;
+  }
+
+  Event const &at(size_t i) const { return _events[i]; }
+
+private:
+  Event *_events;
+  std::atomic<size_t> _next;
+};
+
+inline Buffer &buffer()
+{
+  static Buffer b;
+  return b;
+}
+
+// sweep stamp the calling thread is currently processing
+inline double &currentSweep()
+{
+  static thread_local double sweep = 0;
+  return sweep;
+}
+
+// small stable id per thread for the tid field
+inline uint32_t threadIndex()
+{
+  static std::atomic<uint32_t> count(0);
+  static thread_local uint32_t index = count.fetch_add(1);
+  return index;
+}
+
+inline int64_t wallMicroseconds()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+inline void record(const char *name, int64_t beginUs, int64_t durationUs)
+{
+  buffer().record(name, threadIndex(), currentSweep(), beginUs, durationUs);
+}
+
+class Writer
+{
+public:
+  Writer(ros::NodeHandle &nh, ros::NodeHandle &nhPrivate, std::string const &node)
+    : _node(node)
+  {
+    nhPrivate.param<std::string>("trace_file", _file, "/tmp/" + node + "_trace.json");
+    _subFlush = nhPrivate.subscribe<std_msgs::Empty>("flush_trace", 1, &Writer::flushHandler, this);
+  }
+
+  ~Writer()
+  {
+    write();
+  }
+
+  void flushHandler(std_msgs::Empty::ConstPtr const &)
+  {
+    write();
+  }
+
+  // writes every event recorded so far, the buffer is kept so later flushes are supersets
+  bool write() const
+  {
+    FILE *fp = fopen(_file.c_str(), "w");
+    if (fp == NULL) {
+      ROS_WARN("%s: failed to write trace to %s", _node.c_str(), _file.c_str());
+      return false;
+    }
+
+    int pid = getpid();
+    fprintf(fp, "{\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+            pid, _node.c_str());
+
+    Buffer const &b = buffer();
+    size_t n = b.size();
+    for (size_t i = 0; i < n; i++) {
+      Event const &e = b.at(i);
+      if (!e.ready.load(std::memory_order_acquire)) {
+        continue;
+      }
+      fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+                  "\"pid\":%d,\"tid\":%u,\"args\":{\"sweep\":%.6f}}",
+              e.name, _node.c_str(), (long long)e.beginUs, (long long)e.durationUs,
+              pid, e.tid, e.sweep);
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    if (b.dropped() > 0) {
+      ROS_WARN("%s: trace buffer full, %zu events dropped", _node.c_str(), b.dropped());
+    }
+    return fclose(fp) == 0;
+  }
+
+private:
+  std::string _node;
+  std::string _file;
+  ros::Subscriber _subFlush;
+};
+
+} // namespace trace
+} // namespace loam
+
+#define LOAM_TRACE_SWEEP(t) (loam::trace::currentSweep() = (t))
+#define LOAM_TRACE_WRITER(nh, nhPrivate, node) loam::trace::Writer _loam_trace_writer(nh, nhPrivate, node)
+
+#else
+
+#define LOAM_TRACE_SWEEP(t) ((void)0)
+#define LOAM_TRACE_WRITER(nh, nhPrivate, node) ((void)0)
+
+#endif // LOAM_TRACE
+
+#endif // LOAM_VELODYNE_TRACE_H
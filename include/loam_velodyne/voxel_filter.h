@@ -0,0 +1,188 @@
+#ifndef LOAM_VELODYNE_VOXEL_FILTER_H
+#define LOAM_VELODYNE_VOXEL_FILTER_H
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <pcl/point_cloud.h>
+
+const uint64_t emptyVoxelKey = ~0ull;
+
+// Packs the voxel coordinates of (x, y, z) into 21 bits per axis, about +-100 km at 0.1 m
+// leaves. The top bit stays clear, so no key equals emptyVoxelKey. Returns false when the
+// point is too far out to be packed.
+inline bool packVoxelKey(float x, float y, float z, float const inverseLeaf[3], uint64_t &key)
+{
+  const int keyBits = 21;
+  const int64_t limit = int64_t(1) << (keyBits - 1);
+  int64_t i = int64_t(std::floor(x * inverseLeaf[0]));
+  int64_t j = int64_t(std::floor(y * inverseLeaf[1]));
+  int64_t k = int64_t(std::floor(z * inverseLeaf[2]));
+  if (i < -limit || i >= limit || j < -limit || j >= limit || k < -limit || k >= limit) {
+    return false;
+  }
+  key = (uint64_t(i + limit) << (2 * keyBits)) | (uint64_t(j + limit) << keyBits) | uint64_t(k + limit);
+  return true;
+}
+
+// slot of a key in an open addressing table of 2^(64 - shift) entries
+inline size_t voxelSlot(uint64_t key, int shift)
+{
+  return size_t((key * 0x9E3779B97F4A7C15ull) >> shift);
+}
+
+// Voxel grid downsampling with an open addressing hash over the occupied voxels, used instead
+// of pcl::VoxelGrid on the per sweep paths. The table and the per voxel accumulators are kept
+// between calls, so a filter reused at similar point counts no longer allocates. Input and
+// output may be the same cloud.
+//
+// Not a drop-in for pcl::VoxelGrid. Points are binned the same way, floor(x * (1 / leaf)) per
+// axis, but the voxels come out in the order they are first hit instead of sorted by voxel
+// index, and only x, y, z and intensity are averaged, summed in input order where
+// pcl::VoxelGrid sums in its sorted order, so centroids may differ in the last bits. Unlike
+// pcl::VoxelGrid it does not refuse extents whose voxel indices overflow 32 bits. Fine for the
+// kd-trees and maps fed from it, not for code relying on the output order.
+// test/voxel_filter_test.cpp compares voxels and centroids with pcl::VoxelGrid, and
+// src/voxel_filter_benchmark.cpp the run times.
+//
+//   Centroid   : mean of x, y, z and intensity over the voxel; the other fields of the point
+//                (ring, time) are those of the first point
+//   FirstPoint : the first input point of the voxel, cheaper and keeps measured positions
+//
+// Not thread safe, give every thread its own filter.
+template <typename PointT>
+class VoxelFilter
+{
+public:
+  enum Mode { Centroid, FirstPoint };
+
+  explicit VoxelFilter(float leafSize = 0.2, Mode mode = Centroid)
+    : _mode(mode)
+  {
+    setLeafSize(leafSize, leafSize, leafSize);
+  }
+
+  void setLeafSize(float x, float y, float z)
+  {
+    _inverseLeaf[0] = 1.0f / x;
+    _inverseLeaf[1] = 1.0f / y;
+    _inverseLeaf[2] = 1.0f / z;
+  }
+
+  void setMode(Mode mode) { _mode = mode; }
+
+  void filter(pcl::PointCloud<PointT> const &input, pcl::PointCloud<PointT> &output)
+  {
+    size_t inputNum = input.points.size();
+    size_t tableSize = 16;
+    while (tableSize < 2 * inputNum) {
+      tableSize <<= 1;
+    }
+    if (_table.size() != tableSize) {
+      _table.resize(tableSize);
+    }
+    for (size_t i = 0; i < tableSize; i++) {
+      _table[i].key = emptyVoxelKey;
+    }
+    int shift = 64;
+    for (size_t s = tableSize; s > 1; s >>= 1) {
+      shift--;
+    }
+    const size_t mask = tableSize - 1;
+
+    _voxels.clear();
+    for (size_t p = 0; p < inputNum; p++) {
+      PointT const &point = input.points[p];
+      if (!std::isfinite(point.x) || !std::isfinite(point.y) || !std::isfinite(point.z)) {
+        continue;
+      }
+
+      uint64_t key;
+      if (!packVoxelKey(point.x, point.y, point.z, _inverseLeaf, key)) {
+        // too far out to be packed, kept as its own voxel
+        addVoxel(point, p);
+        continue;
+      }
+
+      size_t slot = voxelSlot(key, shift);
+      while (_table[slot].key != emptyVoxelKey && _table[slot].key != key) {
+        slot = (slot + 1) & mask;
+      }
+      if (_table[slot].key == emptyVoxelKey) {
+        _table[slot].key = key;
+        _table[slot].voxel = _voxels.size();
+        addVoxel(point, p);
+      } else if (_mode == Centroid) {
+        Voxel &voxel = _voxels[_table[slot].voxel];
+        voxel.x += point.x;
+        voxel.y += point.y;
+        voxel.z += point.z;
+        voxel.intensity += point.intensity;
+        voxel.count++;
+      }
+    }
+
+    // voxels are numbered in input order, so voxel v never reads an input point before v and
+    // filtering in place is safe as long as the cloud is shrunk last
+    size_t voxelNum = _voxels.size();
+    output.header = input.header;
+    if (&input != &output) {
+      output.points.resize(voxelNum);
+    }
+    for (size_t v = 0; v < voxelNum; v++) {
+      Voxel const &voxel = _voxels[v];
+      PointT &point = output.points[v];
+      if (voxel.first != v || &input != &output) {
+        point = input.points[voxel.first];
+      }
+      if (_mode == Centroid) {
+        float scale = 1.0f / voxel.count;
+        point.x = voxel.x * scale;
+        point.y = voxel.y * scale;
+        point.z = voxel.z * scale;
+        point.intensity = voxel.intensity * scale;
+      }
+    }
+    output.points.resize(voxelNum);
+    output.width = voxelNum;
+    output.height = 1;
+    output.is_dense = true;
+  }
+
+private:
+  struct Slot
+  {
+    uint64_t key;
+    uint32_t voxel;
+  };
+
+  struct Voxel
+  {
+    float x;
+    float y;
+    float z;
+    float intensity;
+    uint32_t count;
+    uint32_t first;
+  };
+
+  void addVoxel(PointT const &point, size_t first)
+  {
+    Voxel voxel;
+    voxel.x = point.x;
+    voxel.y = point.y;
+    voxel.z = point.z;
+    voxel.intensity = point.intensity;
+    voxel.count = 1;
+    voxel.first = first;
+    _voxels.push_back(voxel);
+  }
+
+  Mode _mode;
+  float _inverseLeaf[3];
+  std::vector<Slot> _table;
+  std::vector<Voxel> _voxels;
+};
+
+#endif // LOAM_VELODYNE_VOXEL_FILTER_H
@@ -0,0 +1,141 @@
+// Compares nearest neighbor queries on map cubes in Z-order, as MapCube keeps them, with the
+// same voxels in insertion order. The submap case concatenates cubes as the mapping node
+// assembles them, a working set larger than the caches. Built with -DLOAM_BENCHMARKS=ON, run without arguments;
+// for cache miss counts run it under perf stat -e cache-references,cache-misses with one
+// order at a time (argument "insertion" or "morton").
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include <pcl/kdtree/kdtree_flann.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include <loam_velodyne/map_cube.h>
+
+typedef pcl::PointXYZI PointType;
+
+// ground plane, two walls and a few poles with 2 cm noise inside one 50 m cube, in random order,
+// the cube shifted by offset along x
+pcl::PointCloud<PointType>::Ptr makePoints(size_t num, unsigned seed, float offset = 0)
+{
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> uniform(-24.5, 24.5);
+  std::normal_distribution<float> noise(0, 0.02);
+  pcl::PointCloud<PointType>::Ptr cloud(new pcl::PointCloud<PointType>());
+  cloud->points.reserve(num);
+  for (size_t i = 0; i < num; i++) {
+    PointType point;
+    float u = uniform(rng);
+    float v = uniform(rng);
+    switch (i % 4) {
+      case 0: point.x = u; point.y = -1.5 + noise(rng); point.z = v; break;
+      case 1: point.x = 12 + noise(rng); point.y = (v + 24.5) / 8 - 1.5; point.z = u; break;
+      case 2: point.x = u; point.y = (v + 24.5) / 8 - 1.5; point.z = -12 + noise(rng); break;
+      default: point.x = 5 * int(u / 5) + noise(rng); point.y = (v + 24.5) / 8 - 1.5; point.z = 5 * int(v / 5) + noise(rng); break;
+    }
+    point.x += offset;
+    point.intensity = i % 256;
+    cloud->push_back(point);
+  }
+  return cloud;
+}
+
+template <typename Fn>
+double medianMs(int repeats, Fn fn)
+{
+  std::vector<double> times;
+  for (int r = 0; r < repeats; r++) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    fn();
+    times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+  }
+  std::sort(times.begin(), times.end());
+  return times[times.size() / 2];
+}
+
+int main(int argc, char **argv)
+{
+  bool runInsertion = argc < 2 || strcmp(argv[1], "insertion") == 0;
+  bool runMorton = argc < 2 || strcmp(argv[1], "morton") == 0;
+
+  struct Case { const char *name; size_t points; float leaf; int cubes; int repeats; };
+  const Case cases[] = {
+    {"corner cube", 30000, 0.2, 1, 20},
+    {"surf cube", 200000, 0.4, 1, 10},
+    {"dense cube", 600000, 0.2, 1, 5},
+    {"submap", 600000, 0.2, 8, 3},
+  };
+  const int queryNum = 20000;
+
+  printf("%-12s %8s %-10s %12s %12s %12s %12s\n",
+         "case", "voxels", "order", "assemble ms", "build ms", "knn5 ms", "radius1 ms");
+  for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    Case const &cs = cases[c];
+
+    // the voxels in the order they were first hit, the layout of the cubes before Z-ordering
+    std::vector<MapCube<PointType> > cubes(cs.cubes, MapCube<PointType>(cs.leaf));
+    pcl::PointCloud<PointType>::Ptr insertion(new pcl::PointCloud<PointType>());
+    pcl::PointCloud<PointType>::Ptr morton(new pcl::PointCloud<PointType>());
+    for (int i = 0; i < cs.cubes; i++) {
+      pcl::PointCloud<PointType>::Ptr points = makePoints(cs.points, c + 1 + i, 50 * i);
+      for (size_t p = 0; p < points->points.size(); p++) {
+        if (cubes[i].insert(points->points[p])) {
+          insertion->push_back(points->points[p]);
+        }
+      }
+      cubes[i].appendTo(*morton);
+    }
+
+    std::mt19937 rng(c + 100);
+    std::uniform_int_distribution<size_t> pick(0, insertion->points.size() - 1);
+    std::vector<PointType> queries(queryNum);
+    for (int q = 0; q < queryNum; q++) {
+      queries[q] = insertion->points[pick(rng)];
+    }
+
+    for (int o = 0; o < 2; o++) {
+      if ((o == 0 && !runInsertion) || (o == 1 && !runMorton)) {
+        continue;
+      }
+      pcl::PointCloud<PointType>::Ptr cloud = o == 0 ? insertion : morton;
+      pcl::PointCloud<PointType> assembled;
+      double assembleMs = medianMs(cs.repeats, [&]{
+        assembled.clear();
+        if (o == 0) {
+          assembled += *insertion;
+        } else {
+          for (int i = 0; i < cs.cubes; i++) {
+            cubes[i].appendTo(assembled);
+          }
+        }
+      });
+
+      pcl::KdTreeFLANN<PointType> kdtree;
+      double buildMs = medianMs(cs.repeats, [&]{ kdtree.setInputCloud(cloud); });
+
+      std::vector<int> indices;
+      std::vector<float> sqDistances;
+      double knnMs = medianMs(cs.repeats, [&]{
+        for (int q = 0; q < queryNum; q++) {
+          kdtree.nearestKSearch(queries[q], 5, indices, sqDistances);
+        }
+      });
+      double radiusMs = medianMs(cs.repeats, [&]{
+        for (int q = 0; q < queryNum; q++) {
+          kdtree.radiusSearch(queries[q], 1.0, indices, sqDistances);
+        }
+      });
+
+      printf("%-12s %8zu %-10s %12.3f %12.3f %12.3f %12.3f\n", cs.name, cloud->points.size(),
+             o == 0 ? "insertion" : "morton", assembleMs, buildMs, knnMs, radiusMs);
+    }
+  }
+  printf("knn5 / radius1 : %d queries at map points, assemble : insertion copies, morton decodes\n",
+         queryNum);
+  return 0;
+}
@@ -31,14 +31,37 @@
 //     Robotics: Science and Systems Conference (RSS). Berkeley, CA, July 2014.
 
 #include <math.h>
-
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <loam_velodyne/alloc_counter.h>
+#include <loam_velodyne/cloud_pool.h>
 #include <loam_velodyne/common.h>
+#include <loam_velodyne/frame_sync.h>
+#include <loam_velodyne/MapCube.h>
+#include <loam_velodyne/map_cube.h>
+#include <loam_velodyne/map_io.h>
+#include <loam_velodyne/map_query.h>
+#include <loam_velodyne/profile.h>
+#include <loam_velodyne/QueryMap.h>
+#include <loam_velodyne/SaveMap.h>
+#include <loam_velodyne/tile_store.h>
+#include <loam_velodyne/voxel_filter.h>
+#include <loam_velodyne/solver_buffers.h>
+#include <loam_velodyne/SolverStats.h>
+#include <loam_velodyne/telemetry.h>
 #include <nav_msgs/Odometry.h>
 #include <opencv/cv.h>
 #include <pcl_conversions/pcl_conversions.h>
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
-#include <pcl/filters/voxel_grid.h>
 #include <pcl/kdtree/kdtree_flann.h>
 #include <ros/ros.h>
 #include <sensor_msgs/Imu.h>
@@ -48,18 +71,32 @@
 
 const float scanPeriod = 0.1;
 
-const int stackFrameNum = 1;
-const int mapFrameNum = 5;
-
-double timeLaserCloudCornerLast = 0;
-double timeLaserCloudSurfLast = 0;
-double timeLaserCloudFullRes = 0;
-double timeLaserOdometry = 0;
-
-bool newLaserCloudCornerLast = false;
-bool newLaserCloudSurfLast = false;
-bool newLaserCloudFullRes = false;
-bool newLaserOdometry = false;
+// set from the active profile at the start of every sweep
+int stackFrameNum = 1;
+int mapFrameNum = 5;
+
+// the subscriber thread assembles sweeps from the four inputs, the processing loop picks up
+// complete ones according to the drop policy
+enum MappingInput {
+  InputLaserCloudCornerLast = 0,
+  InputLaserCloudSurfLast,
+  InputLaserCloudFullRes,
+  InputLaserOdometry,
+  MappingInputNum
+};
+
+struct MappingFrame {
+  pcl::PointCloud<PointType>::Ptr laserCloudCornerLast;
+  pcl::PointCloud<PointType>::Ptr laserCloudSurfLast;
+  pcl::PointCloud<PointType>::Ptr laserCloudFullRes;
+  float transformSum[6];
+};
+
+FrameSync<MappingFrame, MappingInputNum> frameSync;
+double timeSweep = 0;
+
+// guards the imu queue shared with the subscriber thread
+std::mutex mBuf;
 
 int laserCloudCenWidth = 10;
 int laserCloudCenHeight = 5;
@@ -85,20 +122,180 @@ pcl::PointCloud<PointType>::Ptr laserCloudSurround2(new pcl::PointCloud<PointTyp
 pcl::PointCloud<PointType>::Ptr laserCloudCornerFromMap(new pcl::PointCloud<PointType>());
 pcl::PointCloud<PointType>::Ptr laserCloudSurfFromMap(new pcl::PointCloud<PointType>());
 pcl::PointCloud<PointType>::Ptr laserCloudFullRes(new pcl::PointCloud<PointType>());
-pcl::PointCloud<PointType>::Ptr laserCloudCornerArray[laserCloudNum];
-pcl::PointCloud<PointType>::Ptr laserCloudSurfArray[laserCloudNum];
-pcl::PointCloud<PointType>::Ptr laserCloudCornerArray2[laserCloudNum];
-pcl::PointCloud<PointType>::Ptr laserCloudSurfArray2[laserCloudNum];
+// input clouds acquired by the spinner thread, recycled once mapping dropped them
+CloudPool<PointType> laserCloudCornerLastPool;
+CloudPool<PointType> laserCloudSurfLastPool;
+CloudPool<PointType> laserCloudFullResPool;
+// submap clouds acquired by the processing loop, recycled once no map snapshot holds them
+CloudPool<PointType> laserCloudCornerFromMapPool(20000);
+CloudPool<PointType> laserCloudSurfFromMapPool(60000);
+// deduplicated at the corner / surf leaf size on insertion, stored quantized to the cube.
+// ~map_intensity_max is the intensity range the cubes keep, larger intensities are clamped
+MapCube<PointType>::Ptr laserCloudCornerArray[laserCloudNum];
+MapCube<PointType>::Ptr laserCloudSurfArray[laserCloudNum];
+float mapIntensityMax = 256.0;
+bool intensityClampReported = false;
 
 pcl::KdTreeFLANN<PointType>::Ptr kdtreeCornerFromMap(new pcl::KdTreeFLANN<PointType>());
 pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurfFromMap(new pcl::KdTreeFLANN<PointType>());
+// submap kd-trees, rebuilt in an idle tree every sweep and recycled once no map snapshot holds
+// them. an idle tree keeps its last cloud until it is rebuilt
+ObjectPool<pcl::KdTreeFLANN<PointType>, pcl::KdTreeFLANN<PointType>::Ptr> kdtreeCornerFromMapPool;
+ObjectPool<pcl::KdTreeFLANN<PointType>, pcl::KdTreeFLANN<PointType>::Ptr> kdtreeSurfFromMapPool;
 
 float transformSum[6] = {0};
-float transformIncre[6] = {0};
 float transformTobeMapped[6] = {0};
 float transformBefMapped[6] = {0};
 float transformAftMapped[6] = {0};
 
+// the last refinement for the odometry callback, which publishes the provisional pose of every
+// odometry message as it arrives
+std::mutex mMapped;
+float sharedBefMapped[6] = {0};
+float sharedAftMapped[6] = {0};
+ros::Publisher pubOdomAftMappedProvisional;
+nav_msgs::Odometry odomAftMappedProvisional;
+
+void shareMappedPose()
+{
+  std::lock_guard<std::mutex> lock(mMapped);
+  for (int i = 0; i < 6; i++) {
+    sharedBefMapped[i] = transformBefMapped[i];
+    sharedAftMapped[i] = transformAftMapped[i];
+  }
+}
+
+// shared by the processing loop and the map update worker, which never run them concurrently
+VoxelFilter<PointType> downSizeFilterCorner;
+VoxelFilter<PointType> downSizeFilterSurf;
+VoxelFilter<PointType> downSizeFilterMap;
+
+// map maintenance of sweep k (deduplicating cube insertion, surround and full-res output),
+// executed by the worker thread while sweep k+1 is received and associated. the cubes are only
+// read to assemble the submap of the next sweep after the worker is idle, so every optimization
+// matches against a fully updated map
+struct MapUpdateJob {
+  float transform[6];
+  pcl::PointCloud<PointType>::Ptr laserCloudCornerStack;
+  pcl::PointCloud<PointType>::Ptr laserCloudSurfStack;
+  pcl::PointCloud<PointType>::Ptr laserCloudFullRes;
+  int laserCloudSurroundNum;
+  bool updateMap;           // false in localization only mode, the cubes are not touched
+  bool publishSurround;
+  double timeSweep;
+};
+
+std::mutex mWorker;
+std::condition_variable workerCond;
+bool workerBusy = false;
+bool workerQuit = false;
+MapUpdateJob workerJob;
+
+ros::Publisher pubLaserCloudSurround;
+ros::Publisher pubLaserCloudSurroundCubes;
+ros::Publisher pubLaserCloudFullRes;
+
+// surround output, ~surround_mode full publishes the merged cloud on /laser_cloud_surround,
+// delta publishes on /laser_cloud_surround_cubes only the points the surround cubes gained
+// since they were last sent and an empty cloud for a sent cube that was dropped from the grid,
+// both does both. a cube is sent whole the first time and whenever its added points were not
+// tracked. every surroundRefresh publications all surround cubes are sent whole again, for
+// subscribers that joined late or missed a message, 0 never does
+bool surroundFull = true;
+bool surroundDelta = false;
+int surroundRefresh = 20;
+long surroundPublishCount = 0;
+// stamp of the last map change, cubes are touched with it when they gain a voxel. advanced by
+// the worker and by the processing loop while the worker is idle
+uint32_t mapRevision = 0;
+struct PublishedCube
+{
+  uint32_t revision;                        // revision the subscribers hold
+  bool tracked;                             // added holds every point of a new voxel since
+  pcl::PointCloud<PointType>::Ptr added;
+};
+std::unordered_map<CubeKey, PublishedCube, CubeKeyHash> publishedCubes;
+
+// ~localization_only : the loaded map is frozen, laserCloudCornerFromMap / SurfFromMap hold all
+// of it and their kd-trees are built once at startup. sweeps are registered against it and
+// never inserted, the grid is not recentered
+bool localizationOnly = false;
+
+// keyframe gating : a sweep is inserted into the map only once the pose moved keyframeDistance
+// or turned keyframeAngle since the last inserted sweep, or keyframeInterval seconds passed.
+// the pose is still optimized every sweep. 0 disables a threshold, all 0 inserts every sweep
+float keyframeDistance = 0.2;
+float keyframeAngle = 0.05;
+float keyframeInterval = 5.0;
+bool keyframeInserted = false;
+double keyframeTime = 0;
+float keyframeTransform[6] = {0};
+long keyframeSkipped = 0;
+
+bool isKeyframe(double time)
+{
+  if (!keyframeInserted) {
+    return true;
+  }
+  if (keyframeDistance <= 0 && keyframeAngle <= 0 && keyframeInterval <= 0) {
+    return true;
+  }
+  float dx = transformTobeMapped[3] - keyframeTransform[3];
+  float dy = transformTobeMapped[4] - keyframeTransform[4];
+  float dz = transformTobeMapped[5] - keyframeTransform[5];
+  if (keyframeDistance > 0 && dx * dx + dy * dy + dz * dz >= keyframeDistance * keyframeDistance) {
+    return true;
+  }
+  tf::Quaternion current = tf::createQuaternionFromRPY
+                           (transformTobeMapped[2], -transformTobeMapped[0], -transformTobeMapped[1]);
+  tf::Quaternion last = tf::createQuaternionFromRPY
+                        (keyframeTransform[2], -keyframeTransform[0], -keyframeTransform[1]);
+  if (keyframeAngle > 0 && current.angleShortestPath(last) >= keyframeAngle) {
+    return true;
+  }
+  return keyframeInterval > 0 && time - keyframeTime >= keyframeInterval;
+}
+
+void setKeyframe(double time)
+{
+  keyframeInserted = true;
+  keyframeTime = time;
+  for (int i = 0; i < 6; i++) {
+    keyframeTransform[i] = transformTobeMapped[i];
+  }
+}
+
+// the submap and kd-trees of the last optimization, shared with /query_map. the processing loop
+// builds every submap in new clouds and trees, a published snapshot is never modified
+std::mutex mSnapshot;
+MapSnapshot<PointType>::ConstPtr mapSnapshot;
+
+// an idle snapshot holds no clouds or trees, they go back to their own pools
+void recycleSnapshot(MapSnapshot<PointType> &snapshot)
+{
+  snapshot.corner.reset();
+  snapshot.surf.reset();
+  snapshot.kdtreeCorner.reset();
+  snapshot.kdtreeSurf.reset();
+}
+ObjectPool<MapSnapshot<PointType> > mapSnapshotPool(&recycleSnapshot);
+
+// map saves requested through the service are served by the processing loop between sweeps,
+// when the map update worker is idle. the single spinner thread serializes the requests
+struct SaveMapRequest {
+  std::string file;
+  bool pending;
+  bool closed;              // the processing loop has exited
+  bool success;
+  uint32_t cubes;
+  uint64_t points;
+};
+
+std::mutex mSave;
+std::condition_variable saveCond;
+SaveMapRequest saveRequest;
+std::string mapFile;
+
 int imuPointerFront = 0;
 int imuPointerLast = -1;
 const int imuQueLength = 200;
@@ -107,49 +304,52 @@ double imuTime[imuQueLength] = {0};
 float imuRoll[imuQueLength] = {0};
 float imuPitch[imuQueLength] = {0};
 
-void transformAssociateToMap()
+// predicts the mapped pose of odometry pose sum from the last refinement, which mapped odometry
+// pose bef to aft
+void transformAssociateToMap(float const *sum, float const *bef, float const *aft, float *tobe)
 {
-  float x1 = cos(transformSum[1]) * (transformBefMapped[3] - transformSum[3]) 
-           - sin(transformSum[1]) * (transformBefMapped[5] - transformSum[5]);
-  float y1 = transformBefMapped[4] - transformSum[4];
-  float z1 = sin(transformSum[1]) * (transformBefMapped[3] - transformSum[3]) 
-           + cos(transformSum[1]) * (transformBefMapped[5] - transformSum[5]);
+  float incre[6];
+  float x1 = cos(sum[1]) * (bef[3] - sum[3]) 
+           - sin(sum[1]) * (bef[5] - sum[5]);
+  float y1 = bef[4] - sum[4];
+  float z1 = sin(sum[1]) * (bef[3] - sum[3]) 
+           + cos(sum[1]) * (bef[5] - sum[5]);
 
   float x2 = x1;
-  float y2 = cos(transformSum[0]) * y1 + sin(transformSum[0]) * z1;
-  float z2 = -sin(transformSum[0]) * y1 + cos(transformSum[0]) * z1;
-
-  transformIncre[3] = cos(transformSum[2]) * x2 + sin(transformSum[2]) * y2;
-  transformIncre[4] = -sin(transformSum[2]) * x2 + cos(transformSum[2]) * y2;
-  transformIncre[5] = z2;
-
-  float sbcx = sin(transformSum[0]);
-  float cbcx = cos(transformSum[0]);
-  float sbcy = sin(transformSum[1]);
-  float cbcy = cos(transformSum[1]);
-  float sbcz = sin(transformSum[2]);
-  float cbcz = cos(transformSum[2]);
-
-  float sblx = sin(transformBefMapped[0]);
-  float cblx = cos(transformBefMapped[0]);
-  float sbly = sin(transformBefMapped[1]);
-  float cbly = cos(transformBefMapped[1]);
-  float sblz = sin(transformBefMapped[2]);
-  float cblz = cos(transformBefMapped[2]);
-
-  float salx = sin(transformAftMapped[0]);
-  float calx = cos(transformAftMapped[0]);
-  float saly = sin(transformAftMapped[1]);
-  float caly = cos(transformAftMapped[1]);
-  float salz = sin(transformAftMapped[2]);
-  float calz = cos(transformAftMapped[2]);
+  float y2 = cos(sum[0]) * y1 + sin(sum[0]) * z1;
+  float z2 = -sin(sum[0]) * y1 + cos(sum[0]) * z1;
+
+  incre[3] = cos(sum[2]) * x2 + sin(sum[2]) * y2;
+  incre[4] = -sin(sum[2]) * x2 + cos(sum[2]) * y2;
+  incre[5] = z2;
+
+  float sbcx = sin(sum[0]);
+  float cbcx = cos(sum[0]);
+  float sbcy = sin(sum[1]);
+  float cbcy = cos(sum[1]);
+  float sbcz = sin(sum[2]);
+  float cbcz = cos(sum[2]);
+
+  float sblx = sin(bef[0]);
+  float cblx = cos(bef[0]);
+  float sbly = sin(bef[1]);
+  float cbly = cos(bef[1]);
+  float sblz = sin(bef[2]);
+  float cblz = cos(bef[2]);
+
+  float salx = sin(aft[0]);
+  float calx = cos(aft[0]);
+  float saly = sin(aft[1]);
+  float caly = cos(aft[1]);
+  float salz = sin(aft[2]);
+  float calz = cos(aft[2]);
 
   float srx = -sbcx*(salx*sblx + calx*caly*cblx*cbly + calx*cblx*saly*sbly) 
             - cbcx*cbcz*(calx*saly*(cbly*sblz - cblz*sblx*sbly) 
             - calx*caly*(sbly*sblz + cbly*cblz*sblx) + cblx*cblz*salx) 
             - cbcx*sbcz*(calx*caly*(cblz*sbly - cbly*sblx*sblz) 
             - calx*saly*(cbly*cblz + sblx*sbly*sblz) + cblx*salx*sblz);
-  transformTobeMapped[0] = -asin(srx);
+  tobe[0] = -asin(srx);
 
   float srycrx = (cbcy*sbcz - cbcz*sbcx*sbcy)*(calx*saly*(cbly*sblz - cblz*sblx*sbly) 
                - calx*caly*(sbly*sblz + cbly*cblz*sblx) + cblx*cblz*salx) 
@@ -161,8 +361,8 @@ void transformAssociateToMap()
                - (sbcy*sbcz + cbcy*cbcz*sbcx)*(calx*saly*(cbly*sblz - cblz*sblx*sbly) 
                - calx*caly*(sbly*sblz + cbly*cblz*sblx) + cblx*cblz*salx) 
                + cbcx*cbcy*(salx*sblx + calx*caly*cblx*cbly + calx*cblx*saly*sbly);
-  transformTobeMapped[1] = atan2(srycrx / cos(transformTobeMapped[0]), 
-                                 crycrx / cos(transformTobeMapped[0]));
+  tobe[1] = atan2(srycrx / cos(tobe[0]), 
+                                 crycrx / cos(tobe[0]));
   
   float srzcrx = sbcx*(cblx*cbly*(calz*saly - caly*salx*salz) 
                - cblx*sbly*(caly*calz + salx*saly*salz) + calx*salz*sblx) 
@@ -178,43 +378,50 @@ void transformAssociateToMap()
                + calx*calz*cblx*cblz) - cbcx*sbcz*((saly*salz + caly*calz*salx)*(cblz*sbly 
                - cbly*sblx*sblz) + (caly*salz - calz*salx*saly)*(cbly*cblz + sblx*sbly*sblz) 
                - calx*calz*cblx*sblz);
-  transformTobeMapped[2] = atan2(srzcrx / cos(transformTobeMapped[0]), 
-                                 crzcrx / cos(transformTobeMapped[0]));
+  tobe[2] = atan2(srzcrx / cos(tobe[0]), 
+                                 crzcrx / cos(tobe[0]));
 
-  x1 = cos(transformTobeMapped[2]) * transformIncre[3] - sin(transformTobeMapped[2]) * transformIncre[4];
-  y1 = sin(transformTobeMapped[2]) * transformIncre[3] + cos(transformTobeMapped[2]) * transformIncre[4];
-  z1 = transformIncre[5];
+  x1 = cos(tobe[2]) * incre[3] - sin(tobe[2]) * incre[4];
+  y1 = sin(tobe[2]) * incre[3] + cos(tobe[2]) * incre[4];
+  z1 = incre[5];
 
   x2 = x1;
-  y2 = cos(transformTobeMapped[0]) * y1 - sin(transformTobeMapped[0]) * z1;
-  z2 = sin(transformTobeMapped[0]) * y1 + cos(transformTobeMapped[0]) * z1;
-
-  transformTobeMapped[3] = transformAftMapped[3] 
-                         - (cos(transformTobeMapped[1]) * x2 + sin(transformTobeMapped[1]) * z2);
-  transformTobeMapped[4] = transformAftMapped[4] - y2;
-  transformTobeMapped[5] = transformAftMapped[5] 
-                         - (-sin(transformTobeMapped[1]) * x2 + cos(transformTobeMapped[1]) * z2);
+  y2 = cos(tobe[0]) * y1 - sin(tobe[0]) * z1;
+  z2 = sin(tobe[0]) * y1 + cos(tobe[0]) * z1;
+
+  tobe[3] = aft[3] 
+                         - (cos(tobe[1]) * x2 + sin(tobe[1]) * z2);
+  tobe[4] = aft[4] - y2;
+  tobe[5] = aft[5] 
+                         - (-sin(tobe[1]) * x2 + cos(tobe[1]) * z2);
+}
+
+void transformAssociateToMap()
+{
+  transformAssociateToMap(transformSum, transformBefMapped, transformAftMapped, transformTobeMapped);
 }
 
 void transformUpdate()
 {
+  // the imu queue is filled by the subscriber thread
+  std::lock_guard<std::mutex> lock(mBuf);
   if (imuPointerLast >= 0) {
     float imuRollLast = 0, imuPitchLast = 0;
     while (imuPointerFront != imuPointerLast) {
-      if (timeLaserOdometry + scanPeriod < imuTime[imuPointerFront]) {
+      if (timeSweep + scanPeriod < imuTime[imuPointerFront]) {
         break;
       }
       imuPointerFront = (imuPointerFront + 1) % imuQueLength;
     }
 
-    if (timeLaserOdometry + scanPeriod > imuTime[imuPointerFront]) {
+    if (timeSweep + scanPeriod > imuTime[imuPointerFront]) {
       imuRollLast = imuRoll[imuPointerFront];
       imuPitchLast = imuPitch[imuPointerFront];
     } else {
       int imuPointerBack = (imuPointerFront + imuQueLength - 1) % imuQueLength;
-      float ratioFront = (timeLaserOdometry + scanPeriod - imuTime[imuPointerBack]) 
+      float ratioFront = (timeSweep + scanPeriod - imuTime[imuPointerBack]) 
                        / (imuTime[imuPointerFront] - imuTime[imuPointerBack]);
-      float ratioBack = (imuTime[imuPointerFront] - timeLaserOdometry - scanPeriod) 
+      float ratioBack = (imuTime[imuPointerFront] - timeSweep - scanPeriod) 
                       / (imuTime[imuPointerFront] - imuTime[imuPointerBack]);
 
       imuRollLast = imuRoll[imuPointerFront] * ratioFront + imuRoll[imuPointerBack] * ratioBack;
@@ -229,26 +436,34 @@ void transformUpdate()
     transformBefMapped[i] = transformSum[i];
     transformAftMapped[i] = transformTobeMapped[i];
   }
+  shareMappedPose();
 }
 
-void pointAssociateToMap(PointType const * const pi, PointType * const po)
+void pointAssociateToMap(PointType const * const pi, PointType * const po, float const * const t)
 {
-  float x1 = cos(transformTobeMapped[2]) * pi->x
-           - sin(transformTobeMapped[2]) * pi->y;
-  float y1 = sin(transformTobeMapped[2]) * pi->x
-           + cos(transformTobeMapped[2]) * pi->y;
+  float x1 = cos(t[2]) * pi->x
+           - sin(t[2]) * pi->y;
+  float y1 = sin(t[2]) * pi->x
+           + cos(t[2]) * pi->y;
   float z1 = pi->z;
 
   float x2 = x1;
-  float y2 = cos(transformTobeMapped[0]) * y1 - sin(transformTobeMapped[0]) * z1;
-  float z2 = sin(transformTobeMapped[0]) * y1 + cos(transformTobeMapped[0]) * z1;
-
-  po->x = cos(transformTobeMapped[1]) * x2 + sin(transformTobeMapped[1]) * z2
-        + transformTobeMapped[3];
-  po->y = y2 + transformTobeMapped[4];
-  po->z = -sin(transformTobeMapped[1]) * x2 + cos(transformTobeMapped[1]) * z2
-        + transformTobeMapped[5];
+  float y2 = cos(t[0]) * y1 - sin(t[0]) * z1;
+  float z2 = sin(t[0]) * y1 + cos(t[0]) * z1;
+
+  po->x = cos(t[1]) * x2 + sin(t[1]) * z2
+        + t[3];
+  po->y = y2 + t[4];
+  po->z = -sin(t[1]) * x2 + cos(t[1]) * z2
+        + t[5];
   po->intensity = pi->intensity;
+  po->t = pi->t;
+  po->ring = pi->ring;
+}
+
+void pointAssociateToMap(PointType const * const pi, PointType * const po)
+{
+  pointAssociateToMap(pi, po, transformTobeMapped);
 }
 
 void pointAssociateTobeMapped(PointType const * const pi, PointType * const po)
@@ -269,55 +484,91 @@ void pointAssociateTobeMapped(PointType const * const pi, PointType * const po)
         + cos(transformTobeMapped[2]) * y2;
   po->z = z2;
   po->intensity = pi->intensity;
+  po->t = pi->t;
+  po->ring = pi->ring;
 }
 
 void laserCloudCornerLastHandler(const sensor_msgs::PointCloud2ConstPtr& laserCloudCornerLast2)
 {
-  timeLaserCloudCornerLast = laserCloudCornerLast2->header.stamp.toSec();
-
-  laserCloudCornerLast->clear();
-  pcl::fromROSMsg(*laserCloudCornerLast2, *laserCloudCornerLast);
+  LOAM_TRACE_SWEEP(laserCloudCornerLast2->header.stamp.toSec());
+  LOAM_SPAN(Ingest);
+  pcl::PointCloud<PointType>::Ptr cloud = laserCloudCornerLastPool.acquire();
+  pcl::fromROSMsg(*laserCloudCornerLast2, *cloud);
 
-  newLaserCloudCornerLast = true;
+  frameSync.add(InputLaserCloudCornerLast, laserCloudCornerLast2->header.stamp.toSec(),
+                [&cloud](MappingFrame &frame) { frame.laserCloudCornerLast = cloud; });
 }
 
 void laserCloudSurfLastHandler(const sensor_msgs::PointCloud2ConstPtr& laserCloudSurfLast2)
 {
-  timeLaserCloudSurfLast = laserCloudSurfLast2->header.stamp.toSec();
+  LOAM_TRACE_SWEEP(laserCloudSurfLast2->header.stamp.toSec());
+  LOAM_SPAN(Ingest);
+  pcl::PointCloud<PointType>::Ptr cloud = laserCloudSurfLastPool.acquire();
+  pcl::fromROSMsg(*laserCloudSurfLast2, *cloud);
 
-  laserCloudSurfLast->clear();
-  pcl::fromROSMsg(*laserCloudSurfLast2, *laserCloudSurfLast);
-
-  newLaserCloudSurfLast = true;
+  frameSync.add(InputLaserCloudSurfLast, laserCloudSurfLast2->header.stamp.toSec(),
+                [&cloud](MappingFrame &frame) { frame.laserCloudSurfLast = cloud; });
 }
 
 void laserCloudFullResHandler(const sensor_msgs::PointCloud2ConstPtr& laserCloudFullRes2)
 {
-  timeLaserCloudFullRes = laserCloudFullRes2->header.stamp.toSec();
-
-  laserCloudFullRes->clear();
-  pcl::fromROSMsg(*laserCloudFullRes2, *laserCloudFullRes);
+  LOAM_TRACE_SWEEP(laserCloudFullRes2->header.stamp.toSec());
+  LOAM_SPAN(Ingest);
+  pcl::PointCloud<PointType>::Ptr cloud = laserCloudFullResPool.acquire();
+  pcl::fromROSMsg(*laserCloudFullRes2, *cloud);
 
-  newLaserCloudFullRes = true;
+  frameSync.add(InputLaserCloudFullRes, laserCloudFullRes2->header.stamp.toSec(),
+                [&cloud](MappingFrame &frame) { frame.laserCloudFullRes = cloud; });
 }
 
 void laserOdometryHandler(const nav_msgs::Odometry::ConstPtr& laserOdometry)
 {
-  timeLaserOdometry = laserOdometry->header.stamp.toSec();
-
   double roll, pitch, yaw;
   geometry_msgs::Quaternion geoQuat = laserOdometry->pose.pose.orientation;
   tf::Matrix3x3(tf::Quaternion(geoQuat.z, -geoQuat.x, -geoQuat.y, geoQuat.w)).getRPY(roll, pitch, yaw);
 
-  transformSum[0] = -pitch;
-  transformSum[1] = -yaw;
-  transformSum[2] = roll;
-
-  transformSum[3] = laserOdometry->pose.pose.position.x;
-  transformSum[4] = laserOdometry->pose.pose.position.y;
-  transformSum[5] = laserOdometry->pose.pose.position.z;
-
-  newLaserOdometry = true;
+  frameSync.add(InputLaserOdometry, laserOdometry->header.stamp.toSec(),
+                [&](MappingFrame &frame) {
+    frame.transformSum[0] = -pitch;
+    frame.transformSum[1] = -yaw;
+    frame.transformSum[2] = roll;
+
+    frame.transformSum[3] = laserOdometry->pose.pose.position.x;
+    frame.transformSum[4] = laserOdometry->pose.pose.position.y;
+    frame.transformSum[5] = laserOdometry->pose.pose.position.z;
+  });
+
+  // the twist carries the odometry pose the provisional pose was associated from, same
+  // convention as /aft_mapped_to_init
+  float sum[6] = {float(-pitch), float(-yaw), float(roll), float(laserOdometry->pose.pose.position.x),
+                  float(laserOdometry->pose.pose.position.y), float(laserOdometry->pose.pose.position.z)};
+  float bef[6], aft[6], tobe[6];
+  {
+    std::lock_guard<std::mutex> lock(mMapped);
+    for (int i = 0; i < 6; i++) {
+      bef[i] = sharedBefMapped[i];
+      aft[i] = sharedAftMapped[i];
+    }
+  }
+  transformAssociateToMap(sum, bef, aft, tobe);
+
+  geometry_msgs::Quaternion geoQuatProvisional = tf::createQuaternionMsgFromRollPitchYaw
+                                                 (tobe[2], -tobe[0], -tobe[1]);
+  odomAftMappedProvisional.header.stamp = laserOdometry->header.stamp;
+  odomAftMappedProvisional.pose.pose.orientation.x = -geoQuatProvisional.y;
+  odomAftMappedProvisional.pose.pose.orientation.y = -geoQuatProvisional.z;
+  odomAftMappedProvisional.pose.pose.orientation.z = geoQuatProvisional.x;
+  odomAftMappedProvisional.pose.pose.orientation.w = geoQuatProvisional.w;
+  odomAftMappedProvisional.pose.pose.position.x = tobe[3];
+  odomAftMappedProvisional.pose.pose.position.y = tobe[4];
+  odomAftMappedProvisional.pose.pose.position.z = tobe[5];
+  odomAftMappedProvisional.twist.twist.angular.x = sum[0];
+  odomAftMappedProvisional.twist.twist.angular.y = sum[1];
+  odomAftMappedProvisional.twist.twist.angular.z = sum[2];
+  odomAftMappedProvisional.twist.twist.linear.x = sum[3];
+  odomAftMappedProvisional.twist.twist.linear.y = sum[4];
+  odomAftMappedProvisional.twist.twist.linear.z = sum[5];
+  pubOdomAftMappedProvisional.publish(odomAftMappedProvisional);
 }
 
 void imuHandler(const sensor_msgs::Imu::ConstPtr& imuIn)
@@ -328,6 +579,7 @@ void imuHandler(const sensor_msgs::Imu::ConstPtr& imuIn)
   tf::quaternionMsgToTF(imuIn->orientation, orientation);
   tf::Matrix3x3(orientation).getRPY(roll, pitch, yaw);
 
+  std::lock_guard<std::mutex> lock(mBuf);
   imuPointerLast = (imuPointerLast + 1) % imuQueLength;
 
   imuTime[imuPointerLast] = imuIn->header.stamp.toSec();
@@ -335,31 +587,679 @@ void imuHandler(const sensor_msgs::Imu::ConstPtr& imuIn)
   imuPitch[imuPointerLast] = pitch;
 }
 
+void submitMapUpdate(MapUpdateJob const &job)
+{
+  std::lock_guard<std::mutex> lock(mWorker);
+  workerJob = job;
+  workerBusy = true;
+  workerCond.notify_all();
+}
+
+// block until the cubes are consistent again
+void waitMapUpdate()
+{
+  std::unique_lock<std::mutex> lock(mWorker);
+  workerCond.wait(lock, []{ return !workerBusy; });
+}
+
+CubeKey cubeKeyAt(int i, int j, int k)
+{
+  CubeKey key = {i - laserCloudCenWidth, j - laserCloudCenHeight, k - laserCloudCenDepth};
+  return key;
+}
+
+CubeKey cubeKeyOf(int ind)
+{
+  int i = ind % laserCloudWidth;
+  int j = (ind / laserCloudWidth) % laserCloudHeight;
+  int k = ind / (laserCloudWidth * laserCloudHeight);
+  return cubeKeyAt(i, j, k);
+}
+
+// one message per surround cube whose revision is newer than the one last sent, cubes that
+// were never sent are skipped while empty
+void publishSurroundCubes(MapUpdateJob const &job)
+{
+  bool refresh = surroundRefresh > 0 && surroundPublishCount % surroundRefresh == 0;
+  surroundPublishCount++;
+
+  for (int i = 0; i < job.laserCloudSurroundNum; i++) {
+    int ind = laserCloudSurroundInd[i];
+    MapCube<PointType> const &corner = *laserCloudCornerArray[ind];
+    MapCube<PointType> const &surf = *laserCloudSurfArray[ind];
+    CubeKey key = cubeKeyOf(ind);
+    uint32_t revision = std::max(corner.revision(), surf.revision());
+
+    std::unordered_map<CubeKey, PublishedCube, CubeKeyHash>::iterator sent = publishedCubes.find(key);
+    if (sent == publishedCubes.end()) {
+      if (corner.empty() && surf.empty()) {
+        continue;
+      }
+      PublishedCube published;
+      published.revision = 0;
+      published.tracked = false;
+      published.added.reset(new pcl::PointCloud<PointType>());
+      sent = publishedCubes.insert(std::make_pair(key, published)).first;
+    } else if (!refresh && revision <= sent->second.revision) {
+      continue;
+    }
+
+    loam_velodyne::MapCube cube;
+    laserCloudSurround2->clear();
+    if (sent->second.tracked && !refresh) {
+      cube.append = true;
+      cube.base_revision = sent->second.revision;
+      *laserCloudSurround2 += *sent->second.added;
+    } else {
+      corner.appendTo(*laserCloudSurround2);
+      surf.appendTo(*laserCloudSurround2);
+    }
+    sent->second.revision = revision;
+    sent->second.tracked = true;
+    sent->second.added->clear();
+
+    laserCloudSurround->clear();
+    downSizeFilterCorner.filter(*laserCloudSurround2, *laserCloudSurround);
+
+    cube.header.stamp = ros::Time().fromSec(job.timeSweep);
+    cube.header.frame_id = "/camera_init";
+    cube.i = key.i;
+    cube.j = key.j;
+    cube.k = key.k;
+    cube.cube_size = 50.0;
+    cube.revision = revision;
+    pcl::toROSMsg(*laserCloudSurround, cube.cloud);
+    cube.cloud.header = cube.header;
+    pubLaserCloudSurroundCubes.publish(cube);
+  }
+}
+
+// a point inserted into a new voxel of cube ind, kept for the next delta of the cube
+void trackAddedPoint(int ind, PointType const &point)
+{
+  if (!surroundDelta) {
+    return;
+  }
+  std::unordered_map<CubeKey, PublishedCube, CubeKeyHash>::iterator sent = publishedCubes.find(cubeKeyOf(ind));
+  if (sent != publishedCubes.end() && sent->second.tracked) {
+    sent->second.added->push_back(point);
+  }
+}
+
+// tells delta subscribers that a cube they were sent is gone, called while the worker is idle
+void retractCube(CubeKey const &key)
+{
+  std::unordered_map<CubeKey, PublishedCube, CubeKeyHash>::iterator sent = publishedCubes.find(key);
+  if (sent == publishedCubes.end()) {
+    return;
+  }
+  publishedCubes.erase(sent);
+
+  loam_velodyne::MapCube cube;
+  cube.header.stamp = ros::Time().fromSec(timeSweep);
+  cube.header.frame_id = "/camera_init";
+  cube.i = key.i;
+  cube.j = key.j;
+  cube.k = key.k;
+  cube.cube_size = 50.0;
+  cube.revision = mapRevision;
+  cube.cloud.header = cube.header;
+  pubLaserCloudSurroundCubes.publish(cube);
+}
+
+void mapUpdateWorker()
+{
+  PointType pointSel;
+  while (true) {
+    std::unique_lock<std::mutex> lock(mWorker);
+    workerCond.wait(lock, []{ return workerBusy || workerQuit; });
+    if (!workerBusy) {
+      return;
+    }
+    MapUpdateJob job = workerJob;
+    lock.unlock();
+    LOAM_TRACE_SWEEP(job.timeSweep);
+
+    LOAM_SPAN_BEGIN(MapInsert);
+    LOAM_ALLOC_BEGIN(MapInsert);
+
+    if (job.updateMap) {
+      mapRevision++;
+      int laserCloudCornerStackNum = job.laserCloudCornerStack->points.size();
+      for (int i = 0; i < laserCloudCornerStackNum; i++) {
+        pointAssociateToMap(&job.laserCloudCornerStack->points[i], &pointSel, job.transform);
+
+        int cubeI = int((pointSel.x + 25.0) / 50.0) + laserCloudCenWidth;
+        int cubeJ = int((pointSel.y + 25.0) / 50.0) + laserCloudCenHeight;
+        int cubeK = int((pointSel.z + 25.0) / 50.0) + laserCloudCenDepth;
+
+        if (pointSel.x + 25.0 < 0) cubeI--;
+        if (pointSel.y + 25.0 < 0) cubeJ--;
+        if (pointSel.z + 25.0 < 0) cubeK--;
+
+        if (cubeI >= 0 && cubeI < laserCloudWidth && 
+            cubeJ >= 0 && cubeJ < laserCloudHeight && 
+            cubeK >= 0 && cubeK < laserCloudDepth) {
+          int cubeInd = cubeI + laserCloudWidth * cubeJ + laserCloudWidth * laserCloudHeight * cubeK;
+          if (laserCloudCornerArray[cubeInd]->insert(pointSel)) {
+            laserCloudCornerArray[cubeInd]->touch(mapRevision);
+            trackAddedPoint(cubeInd, pointSel);
+          }
+        }
+      }
+
+      int laserCloudSurfStackNum = job.laserCloudSurfStack->points.size();
+      for (int i = 0; i < laserCloudSurfStackNum; i++) {
+        pointAssociateToMap(&job.laserCloudSurfStack->points[i], &pointSel, job.transform);
+
+        int cubeI = int((pointSel.x + 25.0) / 50.0) + laserCloudCenWidth;
+        int cubeJ = int((pointSel.y + 25.0) / 50.0) + laserCloudCenHeight;
+        int cubeK = int((pointSel.z + 25.0) / 50.0) + laserCloudCenDepth;
+
+        if (pointSel.x + 25.0 < 0) cubeI--;
+        if (pointSel.y + 25.0 < 0) cubeJ--;
+        if (pointSel.z + 25.0 < 0) cubeK--;
+
+        if (cubeI >= 0 && cubeI < laserCloudWidth && 
+            cubeJ >= 0 && cubeJ < laserCloudHeight && 
+            cubeK >= 0 && cubeK < laserCloudDepth) {
+          int cubeInd = cubeI + laserCloudWidth * cubeJ + laserCloudWidth * laserCloudHeight * cubeK;
+          if (laserCloudSurfArray[cubeInd]->insert(pointSel)) {
+            laserCloudSurfArray[cubeInd]->touch(mapRevision);
+            trackAddedPoint(cubeInd, pointSel);
+          }
+        }
+      }
+    }
+
+    LOAM_ALLOC_END(MapInsert);
+    LOAM_SPAN_END(MapInsert);
+
+    if (job.updateMap && !intensityClampReported) {
+      for (int i = 0; i < job.laserCloudSurroundNum; i++) {
+        int ind = laserCloudSurroundInd[i];
+        if (laserCloudCornerArray[ind]->clampedIntensities() > 0 || laserCloudSurfArray[ind]->clampedIntensities() > 0) {
+          ROS_WARN("laserMapping: point intensities outside [0, %g] are clamped in the map, raise ~map_intensity_max",
+                   mapIntensityMax);
+          intensityClampReported = true;
+          break;
+        }
+      }
+    }
+
+    if (job.publishSurround && surroundDelta) {
+      publishSurroundCubes(job);
+    }
+
+    if (job.publishSurround && surroundFull) {
+      laserCloudSurround2->clear();
+      for (int i = 0; i < job.laserCloudSurroundNum; i++) {
+        int ind = laserCloudSurroundInd[i];
+        laserCloudCornerArray[ind]->appendTo(*laserCloudSurround2);
+        laserCloudSurfArray[ind]->appendTo(*laserCloudSurround2);
+      }
+
+      laserCloudSurround->clear();
+      downSizeFilterCorner.filter(*laserCloudSurround2, *laserCloudSurround);
+
+      sensor_msgs::PointCloud2 laserCloudSurround3;
+      pcl::toROSMsg(*laserCloudSurround, laserCloudSurround3);
+      laserCloudSurround3.header.stamp = ros::Time().fromSec(job.timeSweep);
+      laserCloudSurround3.header.frame_id = "/camera_init";
+      pubLaserCloudSurround.publish(laserCloudSurround3);
+    }
+
+    int laserCloudFullResNum = job.laserCloudFullRes->points.size();
+    for (int i = 0; i < laserCloudFullResNum; i++) {
+      pointAssociateToMap(&job.laserCloudFullRes->points[i], &job.laserCloudFullRes->points[i], job.transform);
+    }
+
+    sensor_msgs::PointCloud2 laserCloudFullRes3;
+    pcl::toROSMsg(*job.laserCloudFullRes, laserCloudFullRes3);
+    laserCloudFullRes3.header.stamp = ros::Time().fromSec(job.timeSweep);
+    laserCloudFullRes3.header.frame_id = "/camera_init";
+    pubLaserCloudFullRes.publish(laserCloudFullRes3);
+
+    lock.lock();
+    workerBusy = false;
+    workerCond.notify_all();
+  }
+}
+
+// out-of-core tiling : once more than maxResidentCubes cubes hold points, the least recently
+// used ones farther than residentRadius cubes from the center cube are written to the tile
+// store. cubes are paged back in asynchronously around the center cube and around the cube
+// prefetchDistance ahead in the direction of travel, matching never waits for them
+std::unique_ptr<TileStore<PointType> > tileStore;
+int residentRadius = 4;
+int maxResidentCubes = 500;
+float prefetchDistance = 100.0;
+long laserCloudLastUsed[laserCloudNum] = {0};
+long mapSweepCount = 0;
+float lastTilePosition[3] = {0};
+std::vector<std::pair<long, int> > evictionCandidates;   // last used sweep, cube; reserved for all cubes
+
+// cubes of the loaded map outside the grid. they go to the tile store when tiling is on, else
+// they are only kept to be saved again
+std::vector<TileStore<PointType>::Tile> unresidentCubes;
+
+// hands the clouds of a cube to the tile store and gives the slot empty ones
+void evictCube(int ind)
+{
+  if (laserCloudCornerArray[ind]->empty() && laserCloudSurfArray[ind]->empty()) {
+    return;
+  }
+  CubeKey key = cubeKeyOf(ind);
+  tileStore->evict(key, laserCloudCornerArray[ind]->cloud(), laserCloudSurfArray[ind]->cloud());
+  // subscribers keep the cube, it is sent whole once it is paged in again
+  std::unordered_map<CubeKey, PublishedCube, CubeKeyHash>::iterator sent = publishedCubes.find(key);
+  if (sent != publishedCubes.end()) {
+    sent->second.tracked = false;
+    sent->second.added->clear();
+  }
+  laserCloudCornerArray[ind].reset(new MapCube<PointType>(laserCloudCornerArray[ind]->leafSize(), 50.0, mapIntensityMax));
+  laserCloudSurfArray[ind].reset(new MapCube<PointType>(laserCloudSurfArray[ind]->leafSize(), 50.0, mapIntensityMax));
+}
+
+// moves the grid content one cube along axis (0 : i, 1 : j, 2 : k) by step (+1 / -1) and keeps
+// the cube center in place. the cubes pushed off the far edge are evicted to the tile store if
+// tiling is on, lost otherwise and retracted from delta subscribers, and their emptied clouds
+// are reused at the near edge
+void shiftCubes(int axis, int step)
+{
+  const int size[3] = {laserCloudWidth, laserCloudHeight, laserCloudDepth};
+  const int stride[3] = {1, laserCloudWidth, laserCloudWidth * laserCloudHeight};
+  int *center[3] = {&laserCloudCenWidth, &laserCloudCenHeight, &laserCloudCenDepth};
+
+  int b = (axis + 1) % 3;
+  int c = (axis + 2) % 3;
+  int leaving = step > 0 ? size[axis] - 1 : 0;
+  int entering = step > 0 ? 0 : size[axis] - 1;
+  for (int u = 0; u < size[b]; u++) {
+    for (int v = 0; v < size[c]; v++) {
+      int base = u * stride[b] + v * stride[c];
+      if (tileStore) {
+        evictCube(base + leaving * stride[axis]);
+      } else if (surroundDelta) {
+        retractCube(cubeKeyOf(base + leaving * stride[axis]));
+      }
+
+      MapCube<PointType>::Ptr laserCloudCubeCornerPointer = laserCloudCornerArray[base + leaving * stride[axis]];
+      MapCube<PointType>::Ptr laserCloudCubeSurfPointer = laserCloudSurfArray[base + leaving * stride[axis]];
+      for (int n = leaving; n != entering; n -= step) {
+        int ind = base + n * stride[axis];
+        int from = ind - step * stride[axis];
+        laserCloudCornerArray[ind] = laserCloudCornerArray[from];
+        laserCloudSurfArray[ind] = laserCloudSurfArray[from];
+        laserCloudLastUsed[ind] = laserCloudLastUsed[from];
+      }
+      int ind = base + entering * stride[axis];
+      laserCloudCornerArray[ind] = laserCloudCubeCornerPointer;
+      laserCloudSurfArray[ind] = laserCloudCubeSurfPointer;
+      laserCloudLastUsed[ind] = 0;
+      laserCloudCubeCornerPointer->clear();
+      laserCloudCubeSurfPointer->clear();
+    }
+  }
+  *center[axis] += step;
+}
+
+void requestTiles(int centerCubeI, int centerCubeJ, int centerCubeK)
+{
+  for (int i = std::max(centerCubeI - 2, 0); i <= std::min(centerCubeI + 2, laserCloudWidth - 1); i++) {
+    for (int j = std::max(centerCubeJ - 2, 0); j <= std::min(centerCubeJ + 2, laserCloudHeight - 1); j++) {
+      for (int k = std::max(centerCubeK - 2, 0); k <= std::min(centerCubeK + 2, laserCloudDepth - 1); k++) {
+        tileStore->request(cubeKeyAt(i, j, k));
+      }
+    }
+  }
+}
+
+// once per optimization, after the grid is recentered and while the worker is idle
+void updateTiles(int centerCubeI, int centerCubeJ, int centerCubeK)
+{
+  // install the cubes paged in since the last sweep, points inserted into the cube in the
+  // meantime are kept
+  std::vector<TileStore<PointType>::Tile> tiles;
+  tileStore->collect(tiles);
+  if (!tiles.empty()) {
+    mapRevision++;
+  }
+  for (size_t t = 0; t < tiles.size(); t++) {
+    int i = tiles[t].key.i + laserCloudCenWidth;
+    int j = tiles[t].key.j + laserCloudCenHeight;
+    int k = tiles[t].key.k + laserCloudCenDepth;
+    if (i >= 0 && i < laserCloudWidth &&
+        j >= 0 && j < laserCloudHeight &&
+        k >= 0 && k < laserCloudDepth) {
+      int ind = i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k;
+      laserCloudCornerArray[ind]->insert(*tiles[t].corner);
+      laserCloudCornerArray[ind]->touch(mapRevision);
+      laserCloudSurfArray[ind]->insert(*tiles[t].surf);
+      laserCloudSurfArray[ind]->touch(mapRevision);
+      laserCloudLastUsed[ind] = mapSweepCount;
+    } else {
+      tileStore->evict(tiles[t].key, tiles[t].corner, tiles[t].surf);
+    }
+  }
+
+  float dx = transformTobeMapped[3] - lastTilePosition[0];
+  float dy = transformTobeMapped[4] - lastTilePosition[1];
+  float dz = transformTobeMapped[5] - lastTilePosition[2];
+  float travel = sqrt(dx * dx + dy * dy + dz * dz);
+  lastTilePosition[0] = transformTobeMapped[3];
+  lastTilePosition[1] = transformTobeMapped[4];
+  lastTilePosition[2] = transformTobeMapped[5];
+
+  requestTiles(centerCubeI, centerCubeJ, centerCubeK);
+  if (travel > 0.01) {
+    float aheadX = transformTobeMapped[3] + dx / travel * prefetchDistance;
+    float aheadY = transformTobeMapped[4] + dy / travel * prefetchDistance;
+    float aheadZ = transformTobeMapped[5] + dz / travel * prefetchDistance;
+    int aheadI = int((aheadX + 25.0) / 50.0) + laserCloudCenWidth;
+    int aheadJ = int((aheadY + 25.0) / 50.0) + laserCloudCenHeight;
+    int aheadK = int((aheadZ + 25.0) / 50.0) + laserCloudCenDepth;
+    if (aheadX + 25.0 < 0) aheadI--;
+    if (aheadY + 25.0 < 0) aheadJ--;
+    if (aheadZ + 25.0 < 0) aheadK--;
+    requestTiles(aheadI, aheadJ, aheadK);
+  }
+
+  int residentNum = 0;
+  std::vector<std::pair<long, int> > &candidates = evictionCandidates;
+  candidates.clear();
+  for (int k = 0; k < laserCloudDepth; k++) {
+    for (int j = 0; j < laserCloudHeight; j++) {
+      for (int i = 0; i < laserCloudWidth; i++) {
+        int ind = i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k;
+        if (laserCloudCornerArray[ind]->empty() && laserCloudSurfArray[ind]->empty()) {
+          continue;
+        }
+        residentNum++;
+        int distance = std::max(std::abs(i - centerCubeI),
+                                std::max(std::abs(j - centerCubeJ), std::abs(k - centerCubeK)));
+        if (distance > residentRadius) {
+          candidates.push_back(std::make_pair(laserCloudLastUsed[ind], ind));
+        }
+      }
+    }
+  }
+
+  if (residentNum > maxResidentCubes) {
+    size_t evictNum = std::min(candidates.size(), size_t(residentNum - maxResidentCubes));
+    std::partial_sort(candidates.begin(), candidates.begin() + evictNum, candidates.end());
+    for (size_t c = 0; c < evictNum; c++) {
+      evictCube(candidates[c].second);
+    }
+  }
+
+  ROS_DEBUG_THROTTLE(10.0, "laserMapping: %d cubes resident, %zu on disk, %zu tile operations pending",
+                     residentNum, tileStore->storedCount(), tileStore->backlog());
+}
+
+void publishMapSnapshot(double time)
+{
+  std::shared_ptr<MapSnapshot<PointType> > snapshot = mapSnapshotPool.acquire();
+  snapshot->time = time;
+  snapshot->revision = mapRevision;
+  snapshot->corner = laserCloudCornerFromMap;
+  snapshot->surf = laserCloudSurfFromMap;
+  if (!laserCloudCornerFromMap->empty()) {
+    snapshot->kdtreeCorner = kdtreeCornerFromMap;
+  }
+  if (!laserCloudSurfFromMap->empty()) {
+    snapshot->kdtreeSurf = kdtreeSurfFromMap;
+  }
+
+  std::lock_guard<std::mutex> lock(mSnapshot);
+  mapSnapshot = snapshot;
+}
+
+// matches every following sweep against the whole map as it is now
+void freezeMap()
+{
+  laserCloudCornerFromMap->clear();
+  laserCloudSurfFromMap->clear();
+  for (int i = 0; i < laserCloudNum; i++) {
+    laserCloudCornerArray[i]->appendTo(*laserCloudCornerFromMap);
+    laserCloudSurfArray[i]->appendTo(*laserCloudSurfFromMap);
+  }
+  if (!laserCloudCornerFromMap->empty()) {
+    kdtreeCornerFromMap->setInputCloud(laserCloudCornerFromMap);
+  }
+  if (!laserCloudSurfFromMap->empty()) {
+    kdtreeSurfFromMap->setInputCloud(laserCloudSurfFromMap);
+  }
+  publishMapSnapshot(0);
+}
+
+// served on the spinner thread from the snapshot current at the call, mapping never waits
+bool queryMapService(loam_velodyne::QueryMap::Request &req, loam_velodyne::QueryMap::Response &res)
+{
+  MapSnapshot<PointType>::ConstPtr snapshot;
+  {
+    std::lock_guard<std::mutex> lock(mSnapshot);
+    snapshot = mapSnapshot;
+  }
+  res.success = false;
+  if (!snapshot) {
+    return true;
+  }
+  res.map_time = snapshot->time;
+  res.revision = snapshot->revision;
+
+  MapQuery<PointType> query;
+  uint8_t layers = req.layers == 0 ? loam_velodyne::QueryMap::Request::CORNER | loam_velodyne::QueryMap::Request::SURF
+                                   : req.layers;
+  if (layers & loam_velodyne::QueryMap::Request::CORNER) {
+    query.addLayer(snapshot->kdtreeCorner);
+  }
+  if (layers & loam_velodyne::QueryMap::Request::SURF) {
+    query.addLayer(snapshot->kdtreeSurf);
+  }
+  query.setMaxPoints(req.max_points);
+
+  PointType center, min, max;
+  center.x = req.center.x;
+  center.y = req.center.y;
+  center.z = req.center.z;
+  min.x = req.min.x;
+  min.y = req.min.y;
+  min.z = req.min.z;
+  max.x = req.max.x;
+  max.y = req.max.y;
+  max.z = req.max.z;
+  switch (req.type) {
+    case loam_velodyne::QueryMap::Request::RADIUS:
+      query.radius(center, req.radius);
+      break;
+    case loam_velodyne::QueryMap::Request::BOX:
+      query.box(min, max);
+      break;
+    case loam_velodyne::QueryMap::Request::NEAREST:
+      query.nearest(center, req.k);
+      break;
+    default:
+      return true;
+  }
+
+  pcl::PointCloud<PointType> cloud;
+  query.result(cloud, res.squared_distances);
+  pcl::toROSMsg(cloud, res.cloud);
+  res.cloud.header.stamp = ros::Time().fromSec(snapshot->time);
+  res.cloud.header.frame_id = "/camera_init";
+  res.success = true;
+  return true;
+}
+
+// the caller makes sure the worker is idle
+bool saveMap(std::string const &file, CubeMapHeader &header)
+{
+  header.width = laserCloudWidth;
+  header.height = laserCloudHeight;
+  header.depth = laserCloudDepth;
+  header.cenWidth = laserCloudCenWidth;
+  header.cenHeight = laserCloudCenHeight;
+  header.cenDepth = laserCloudCenDepth;
+  header.cubeSize = 50.0;
+  for (int i = 0; i < 6; i++) {
+    header.pose[i] = transformAftMapped[i];
+  }
+
+  std::vector<pcl::PointCloud<PointType>::Ptr> corner(laserCloudNum), surf(laserCloudNum);
+  for (int i = 0; i < laserCloudNum; i++) {
+    corner[i] = laserCloudCornerArray[i]->cloud();
+    surf[i] = laserCloudSurfArray[i]->cloud();
+  }
+
+  // the evicted cubes are part of the map, those in the grid are merged into their cube
+  std::vector<TileStore<PointType>::Tile> tiles = unresidentCubes;
+  if (tileStore && !tileStore->snapshot(tiles)) {
+    return false;
+  }
+  std::vector<OffGridCube<PointType> > offGrid;
+  for (size_t t = 0; t < tiles.size(); t++) {
+    int i = tiles[t].key.i + laserCloudCenWidth;
+    int j = tiles[t].key.j + laserCloudCenHeight;
+    int k = tiles[t].key.k + laserCloudCenDepth;
+    if (i >= 0 && i < laserCloudWidth &&
+        j >= 0 && j < laserCloudHeight &&
+        k >= 0 && k < laserCloudDepth) {
+      int ind = i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k;
+      *corner[ind] += *tiles[t].corner;
+      *surf[ind] += *tiles[t].surf;
+    } else {
+      OffGridCube<PointType> cube;
+      cube.i = i;
+      cube.j = j;
+      cube.k = k;
+      cube.corner = tiles[t].corner;
+      cube.surf = tiles[t].surf;
+      offGrid.push_back(cube);
+    }
+  }
+  return saveCubeMap<PointType>(file, header, &corner[0], &surf[0], offGrid);
+}
+
+// loads the map and resumes from the pose it was saved at, odometry restarts from identity
+bool loadMap(std::string const &file, bool loadPose, CubeMapHeader &header)
+{
+  std::vector<pcl::PointCloud<PointType>::Ptr> corner(laserCloudNum), surf(laserCloudNum);
+  std::vector<OffGridCube<PointType> > offGrid;
+  for (int i = 0; i < laserCloudNum; i++) {
+    corner[i].reset(new pcl::PointCloud<PointType>());
+    surf[i].reset(new pcl::PointCloud<PointType>());
+  }
+  if (!loadCubeMap<PointType>(file, laserCloudWidth, laserCloudHeight, laserCloudDepth, header,
+                              &corner[0], &surf[0], offGrid)) {
+    return false;
+  }
+  for (int i = 0; i < laserCloudNum; i++) {
+    laserCloudCornerArray[i]->clear();
+    laserCloudCornerArray[i]->insert(*corner[i]);
+    laserCloudSurfArray[i]->clear();
+    laserCloudSurfArray[i]->insert(*surf[i]);
+  }
+  laserCloudCenWidth = header.cenWidth;
+  laserCloudCenHeight = header.cenHeight;
+  laserCloudCenDepth = header.cenDepth;
+  unresidentCubes.resize(offGrid.size());
+  for (size_t c = 0; c < offGrid.size(); c++) {
+    unresidentCubes[c].key = cubeKeyAt(offGrid[c].i, offGrid[c].j, offGrid[c].k);
+    unresidentCubes[c].corner = offGrid[c].corner;
+    unresidentCubes[c].surf = offGrid[c].surf;
+  }
+  if (loadPose) {
+    for (int i = 0; i < 6; i++) {
+      transformAftMapped[i] = header.pose[i];
+      transformTobeMapped[i] = header.pose[i];
+    }
+    shareMappedPose();
+  }
+  return true;
+}
+
+bool saveMapService(loam_velodyne::SaveMap::Request &req, loam_velodyne::SaveMap::Response &res)
+{
+  std::unique_lock<std::mutex> lock(mSave);
+  saveRequest.file = req.file.empty() ? mapFile : req.file;
+  if (saveRequest.file.empty() || saveRequest.closed) {
+    res.success = false;
+    return true;
+  }
+  saveRequest.pending = true;
+  saveCond.wait(lock, []{ return !saveRequest.pending || saveRequest.closed; });
+  if (saveRequest.pending) {
+    saveRequest.pending = false;
+    res.success = false;
+    return true;
+  }
+  res.success = saveRequest.success;
+  res.cubes = saveRequest.cubes;
+  res.points = saveRequest.points;
+  return true;
+}
+
+// called from the processing loop, close stops accepting requests
+void serveSaveRequest(bool close = false)
+{
+  std::lock_guard<std::mutex> lock(mSave);
+  saveRequest.closed = close;
+  if (!saveRequest.pending) {
+    saveCond.notify_all();
+    return;
+  }
+  waitMapUpdate();
+  CubeMapHeader header;
+  saveRequest.success = saveMap(saveRequest.file, header);
+  saveRequest.cubes = saveRequest.success ? header.cubeCount : 0;
+  saveRequest.points = saveRequest.success ? header.pointCount : 0;
+  if (saveRequest.success) {
+    ROS_INFO("laserMapping: saved %u cubes, %lu points to %s",
+             header.cubeCount, header.pointCount, saveRequest.file.c_str());
+  } else {
+    ROS_WARN("laserMapping: failed to save the map to %s", saveRequest.file.c_str());
+  }
+  saveRequest.pending = false;
+  saveCond.notify_all();
+}
+
 int main(int argc, char** argv)
 {
   ros::init(argc, argv, "laserMapping");
   ros::NodeHandle nh;
+  ros::NodeHandle nhPrivate("~");
   // declare subscriber
   ros::Subscriber subLaserCloudCornerLast = nh.subscribe<sensor_msgs::PointCloud2>
-                                            ("/laser_cloud_corner_last", 2, laserCloudCornerLastHandler);
+                                            ("/laser_cloud_corner_last", 5, laserCloudCornerLastHandler);
   ros::Subscriber subLaserCloudSurfLast = nh.subscribe<sensor_msgs::PointCloud2>
-                                          ("/laser_cloud_surf_last", 2, laserCloudSurfLastHandler);
+                                          ("/laser_cloud_surf_last", 5, laserCloudSurfLastHandler);
   ros::Subscriber subLaserOdometry = nh.subscribe<nav_msgs::Odometry> 
                                      ("/laser_odom_to_init", 5, laserOdometryHandler);
   ros::Subscriber subLaserCloudFullRes = nh.subscribe<sensor_msgs::PointCloud2> 
-                                         ("/velodyne_cloud_3", 2, laserCloudFullResHandler);
+                                         ("/velodyne_cloud_3", 5, laserCloudFullResHandler);
   ros::Subscriber subImu = nh.subscribe<sensor_msgs::Imu> ("/imu/data", 50, imuHandler);
  // declare publisher
-  ros::Publisher pubLaserCloudSurround = nh.advertise<sensor_msgs::PointCloud2> 
+  pubLaserCloudSurround = nh.advertise<sensor_msgs::PointCloud2> 
                                          ("/laser_cloud_surround", 1);
-  ros::Publisher pubLaserCloudFullRes = nh.advertise<sensor_msgs::PointCloud2> 
+  // a publication can hold all 125 surround cubes
+  pubLaserCloudSurroundCubes = nh.advertise<loam_velodyne::MapCube> 
+                                              ("/laser_cloud_surround_cubes", 125);
+  pubLaserCloudFullRes = nh.advertise<sensor_msgs::PointCloud2> 
                                         ("/velodyne_cloud_registered", 2);
   ros::Publisher pubOdomAftMapped = nh.advertise<nav_msgs::Odometry> ("/aft_mapped_to_init", 5);
+  ros::Publisher pubSolverStats = nh.advertise<loam_velodyne::SolverStats> ("/aft_mapped_solver_stats", 5);
+  // pose predicted from odometry and the last refinement, published on every odometry message
+  pubOdomAftMappedProvisional = nh.advertise<nav_msgs::Odometry> 
+                                ("/aft_mapped_to_init_provisional", 5);
 
   nav_msgs::Odometry odomAftMapped;
   odomAftMapped.header.frame_id = "/camera_init";
   odomAftMapped.child_frame_id = "/aft_mapped";
 
+  odomAftMappedProvisional.header.frame_id = "/camera_init";
+  odomAftMappedProvisional.child_frame_id = "/aft_mapped";
+
   tf::TransformBroadcaster tfBroadcaster;
   tf::StampedTransform aftMappedTrans;
   aftMappedTrans.frame_id_ = "/camera_init";
@@ -370,6 +1270,7 @@ int main(int argc, char** argv)
 
   PointType pointOri, pointSel, pointProj, coeff;
 
+  // one row per neighbour of a plane correspondence, resized when the profile changes nearestK
   cv::Mat matA0(5, 3, CV_32F, cv::Scalar::all(0));
   cv::Mat matB0(5, 1, CV_32F, cv::Scalar::all(-1));
   cv::Mat matX0(3, 1, CV_32F, cv::Scalar::all(0));
@@ -380,38 +1281,138 @@ int main(int argc, char** argv)
 
   bool isDegenerate = false;
   cv::Mat matP(6, 6, CV_32F, cv::Scalar::all(0));
+  SolverBuffers solver;
 
-  pcl::VoxelGrid<PointType> downSizeFilterCorner;
-  downSizeFilterCorner.setLeafSize(0.2, 0.2, 0.2);
-
-  pcl::VoxelGrid<PointType> downSizeFilterSurf;
-  downSizeFilterSurf.setLeafSize(0.4, 0.4, 0.4);
+  ProfileManager profiles(nh, nhPrivate, "laserMapping");
+  PipelineProfile profile = profiles.current();
+  stackFrameNum = profile.stackFrameNum;
+  mapFrameNum = profile.mapFrameNum;
 
-  pcl::VoxelGrid<PointType> downSizeFilterMap;
-  downSizeFilterMap.setLeafSize(0.6, 0.6, 0.6);
+  downSizeFilterCorner.setLeafSize(profile.cornerLeafSize, profile.cornerLeafSize, profile.cornerLeafSize);
+  downSizeFilterSurf.setLeafSize(profile.surfLeafSize, profile.surfLeafSize, profile.surfLeafSize);
+  downSizeFilterMap.setLeafSize(profile.mapLeafSize, profile.mapLeafSize, profile.mapLeafSize);
 
+  nhPrivate.param("map_intensity_max", mapIntensityMax, float(256.0));
+  if (!(mapIntensityMax > 0)) {
+    ROS_WARN("laserMapping: ~map_intensity_max must be positive, using 256");
+    mapIntensityMax = 256.0;
+  }
   for (int i = 0; i < laserCloudNum; i++) {
-    laserCloudCornerArray[i].reset(new pcl::PointCloud<PointType>());
-    laserCloudSurfArray[i].reset(new pcl::PointCloud<PointType>());
-    laserCloudCornerArray2[i].reset(new pcl::PointCloud<PointType>());
-    laserCloudSurfArray2[i].reset(new pcl::PointCloud<PointType>());
+    laserCloudCornerArray[i].reset(new MapCube<PointType>(profile.cornerLeafSize, 50.0, mapIntensityMax));
+    laserCloudSurfArray[i].reset(new MapCube<PointType>(profile.surfLeafSize, 50.0, mapIntensityMax));
+  }
+
+  // a prior map lets a restarted node match against it from the first sweep
+  bool mapSaveOnShutdown, mapLoadPose;
+  bool mapLoaded = false;
+  nhPrivate.param<std::string>("map_file", mapFile, "");
+  nhPrivate.param("map_save_on_shutdown", mapSaveOnShutdown, true);
+  nhPrivate.param("map_load_pose", mapLoadPose, true);
+  if (!mapFile.empty()) {
+    CubeMapHeader header;
+    mapLoaded = loadMap(mapFile, mapLoadPose, header);
+    if (mapLoaded) {
+      ROS_INFO("laserMapping: loaded %u cubes, %lu points from %s",
+               header.cubeCount, header.pointCount, mapFile.c_str());
+    } else if (access(mapFile.c_str(), F_OK) == 0) {
+      ROS_WARN("laserMapping: %s is not a valid map, starting with an empty one", mapFile.c_str());
+    } else {
+      ROS_INFO("laserMapping: no map at %s yet, starting with an empty one", mapFile.c_str());
+    }
+  }
+  nhPrivate.param("localization_only", localizationOnly, false);
+  if (localizationOnly && !mapLoaded) {
+    ROS_WARN("laserMapping: localization_only needs a map loaded from map_file, mapping instead");
+    localizationOnly = false;
+  }
+  if (localizationOnly) {
+    freezeMap();
+    ROS_INFO("laserMapping: localization only, map frozen at %zu corner and %zu surf points",
+             laserCloudCornerFromMap->points.size(), laserCloudSurfFromMap->points.size());
   }
 
+  // tiles left by an earlier run are deleted, the loaded map brings its own evicted cubes
+  std::string tileDirectory;
+  nhPrivate.param<std::string>("tile_directory", tileDirectory, "");
+  nhPrivate.param("resident_radius", residentRadius, 4);
+  nhPrivate.param("max_resident_cubes", maxResidentCubes, 500);
+  nhPrivate.param("prefetch_distance", prefetchDistance, float(100.0));
+  if (!tileDirectory.empty() && localizationOnly) {
+    ROS_INFO("laserMapping: tiling is off in localization only mode");
+  } else if (!tileDirectory.empty()) {
+    mkdir(tileDirectory.c_str(), 0755);
+    residentRadius = std::max(residentRadius, 2);
+    tileStore.reset(new TileStore<PointType>(tileDirectory));
+    evictionCandidates.reserve(laserCloudNum);
+    for (size_t c = 0; c < unresidentCubes.size(); c++) {
+      tileStore->evict(unresidentCubes[c].key, unresidentCubes[c].corner, unresidentCubes[c].surf);
+    }
+    unresidentCubes.clear();
+    ROS_INFO("laserMapping: tiling to %s, %zu cubes on disk", tileDirectory.c_str(), tileStore->storedCount());
+  } else if (!unresidentCubes.empty()) {
+    ROS_WARN("laserMapping: %zu cubes of the map are outside the grid, they are saved again but only "
+             "matched against with a tile_directory", unresidentCubes.size());
+  }
+
+  nhPrivate.param("keyframe_distance", keyframeDistance, float(0.2));
+  nhPrivate.param("keyframe_angle", keyframeAngle, float(0.05));
+  nhPrivate.param("keyframe_interval", keyframeInterval, float(5.0));
+
+  std::string surroundMode;
+  nhPrivate.param<std::string>("surround_mode", surroundMode, "full");
+  nhPrivate.param("surround_refresh", surroundRefresh, 20);
+  if (surroundMode == "delta" || surroundMode == "both") {
+    surroundDelta = true;
+    surroundFull = surroundMode == "both";
+  } else if (surroundMode != "full") {
+    ROS_WARN("laserMapping: unknown surround_mode %s, using full", surroundMode.c_str());
+  }
+
+  saveRequest.pending = false;
+  saveRequest.closed = false;
+  ros::ServiceServer srvSaveMap = nh.advertiseService("/save_map", saveMapService);
+  ros::ServiceServer srvQueryMap = nh.advertiseService("/query_map", queryMapService);
+
   int frameCount = stackFrameNum - 1;
   int mapFrameCount = mapFrameNum - 1;
-  ros::Rate rate(100);
-  bool status = ros::ok();
-  while (status) {
-    ros::spinOnce();
-
-    if (newLaserCloudCornerLast && newLaserCloudSurfLast && newLaserCloudFullRes && newLaserOdometry &&
-        fabs(timeLaserCloudCornerLast - timeLaserOdometry) < 0.005 &&
-        fabs(timeLaserCloudSurfLast - timeLaserOdometry) < 0.005 &&
-        fabs(timeLaserCloudFullRes - timeLaserOdometry) < 0.005) {
-      newLaserCloudCornerLast = false;
-      newLaserCloudSurfLast = false;
-      newLaserCloudFullRes = false;
-      newLaserOdometry = false;
+
+  // when mapping falls behind it conflates to the newest odometry sweep by default
+  std::string framePolicyName;
+  int frameQueueSize;
+  nhPrivate.param<std::string>("frame_policy", framePolicyName, "latest");
+  nhPrivate.param("frame_queue_size", frameQueueSize, 1);
+  FramePolicy framePolicy;
+  if (!parseFramePolicy(framePolicyName, framePolicy)) {
+    ROS_WARN("laserMapping: unknown frame_policy %s, using latest", framePolicyName.c_str());
+    framePolicy = FramePolicy::Latest;
+  }
+  frameSync.configure(framePolicy, frameQueueSize);
+
+  LOAM_TELEMETRY_REPORTER(nh, nhPrivate, "ncrl_laserMapping");
+  LOAM_TRACE_WRITER(nh, nhPrivate, "ncrl_laserMapping");
+
+  // callbacks run on the spinner thread, the sweep is processed here as soon as it is complete
+  ros::AsyncSpinner spinner(1);
+  spinner.start();
+  std::thread worker(mapUpdateWorker);
+  MappingFrame frame;
+  while (ros::ok()) {
+    // the timeout only bounds the shutdown latency, frames wake the loop immediately
+    if (frameSync.pop(frame, timeSweep, std::chrono::milliseconds(100))) {
+      laserCloudCornerLast = frame.laserCloudCornerLast;
+      laserCloudSurfLast = frame.laserCloudSurfLast;
+      laserCloudFullRes = frame.laserCloudFullRes;
+      for (int i = 0; i < 6; i++) {
+        transformSum[i] = frame.transformSum[i];
+      }
+      LOAM_TRACE_SWEEP(timeSweep);
+      ros::WallTime timeFrameStart = ros::WallTime::now();
+
+      // a profile switch takes effect at a sweep boundary; the filters are shared with the
+      // map update worker, their leaf sizes are changed once it is idle below
+      profile = profiles.current();
+      stackFrameNum = profile.stackFrameNum;
+      mapFrameNum = profile.mapFrameNum;
 
       frameCount++;
       if (frameCount >= stackFrameNum) {
@@ -433,6 +1434,27 @@ int main(int argc, char** argv)
       if (frameCount >= stackFrameNum) {
         frameCount = 0;
 
+        // the cubes are recentered and read below, wait for the previous map update
+        waitMapUpdate();
+
+        downSizeFilterCorner.setLeafSize(profile.cornerLeafSize, profile.cornerLeafSize, profile.cornerLeafSize);
+        downSizeFilterSurf.setLeafSize(profile.surfLeafSize, profile.surfLeafSize, profile.surfLeafSize);
+        downSizeFilterMap.setLeafSize(profile.mapLeafSize, profile.mapLeafSize, profile.mapLeafSize);
+        for (int i = 0; !localizationOnly && i < laserCloudNum; i++) {
+          laserCloudCornerArray[i]->setLeafSize(profile.cornerLeafSize);
+          laserCloudSurfArray[i]->setLeafSize(profile.surfLeafSize);
+        }
+
+        const int nearestK = profile.nearestK;
+        if (matA0.rows != nearestK) {
+          matA0 = cv::Mat(nearestK, 3, CV_32F, cv::Scalar::all(0));
+          matB0 = cv::Mat(nearestK, 1, CV_32F, cv::Scalar::all(-1));
+        }
+
+        LOAM_SPAN_BEGIN(SubmapBuild);
+        loam_velodyne::SolverStats solverStats;
+        solverStats.max_iterations = profile.mappingMaxIterations;
+
         PointType pointOnYAxis;
         pointOnYAxis.x = 0.0;
         pointOnYAxis.y = 10.0;
@@ -447,170 +1469,41 @@ int main(int argc, char** argv)
         if (transformTobeMapped[4] + 25.0 < 0) centerCubeJ--;
         if (transformTobeMapped[5] + 25.0 < 0) centerCubeK--;
 
-        while (centerCubeI < 3) {
-          for (int j = 0; j < laserCloudHeight; j++) {
-            for (int k = 0; k < laserCloudDepth; k++) {
-              int i = laserCloudWidth - 1;
-              pcl::PointCloud<PointType>::Ptr laserCloudCubeCornerPointer =
-              laserCloudCornerArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k];
-              pcl::PointCloud<PointType>::Ptr laserCloudCubeSurfPointer =
-              laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k];
-              for (; i >= 1; i--) {
-                laserCloudCornerArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] =
-                laserCloudCornerArray[i - 1 + laserCloudWidth*j + laserCloudWidth * laserCloudHeight * k];
-                laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] =
-                laserCloudSurfArray[i - 1 + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k];
-              }
-              laserCloudCornerArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] = 
-              laserCloudCubeCornerPointer;
-              laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] = 
-              laserCloudCubeSurfPointer;
-              laserCloudCubeCornerPointer->clear();
-              laserCloudCubeSurfPointer->clear();
-            }
+        // a frozen map stays where it was loaded, the surround is clipped at the grid edge
+        if (!localizationOnly) {
+          while (centerCubeI < 3) {
+            shiftCubes(0, 1);
+            centerCubeI++;
           }
-
-          centerCubeI++;
-          laserCloudCenWidth++;
-        }
-
-        while (centerCubeI >= laserCloudWidth - 3) {
-          for (int j = 0; j < laserCloudHeight; j++) {
-            for (int k = 0; k < laserCloudDepth; k++) {
-              int i = 0;
-              pcl::PointCloud<PointType>::Ptr laserCloudCubeCornerPointer =
-              laserCloudCornerArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k];
-              pcl::PointCloud<PointType>::Ptr laserCloudCubeSurfPointer =
-              laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k];
-              for (; i < laserCloudWidth - 1; i++) {
-                laserCloudCornerArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] =
-                laserCloudCornerArray[i + 1 + laserCloudWidth*j + laserCloudWidth * laserCloudHeight * k];
-                laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] =
-                laserCloudSurfArray[i + 1 + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k];
-              }
-              laserCloudCornerArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] = 
-              laserCloudCubeCornerPointer;
-              laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] = 
-              laserCloudCubeSurfPointer;
-              laserCloudCubeCornerPointer->clear();
-              laserCloudCubeSurfPointer->clear();
-            }
+          while (centerCubeI >= laserCloudWidth - 3) {
+            shiftCubes(0, -1);
+            centerCubeI--;
           }
-
-          centerCubeI--;
-          laserCloudCenWidth--;
-        }
-
-        while (centerCubeJ < 3) {
-          for (int i = 0; i < laserCloudWidth; i++) {
-            for (int k = 0; k < laserCloudDepth; k++) {
-              int j = laserCloudHeight - 1;
-              pcl::PointCloud<PointType>::Ptr laserCloudCubeCornerPointer =
-              laserCloudCornerArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k];
-              pcl::PointCloud<PointType>::Ptr laserCloudCubeSurfPointer =
-              laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k];
-              for (; j >= 1; j--) {
-                laserCloudCornerArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] =
-                laserCloudCornerArray[i + laserCloudWidth*(j - 1) + laserCloudWidth * laserCloudHeight*k];
-                laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] =
-                laserCloudSurfArray[i + laserCloudWidth * (j - 1) + laserCloudWidth * laserCloudHeight*k];
-              }
-              laserCloudCornerArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] = 
-              laserCloudCubeCornerPointer;
-              laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] = 
-              laserCloudCubeSurfPointer;
-              laserCloudCubeCornerPointer->clear();
-              laserCloudCubeSurfPointer->clear();
-            }
+          while (centerCubeJ < 3) {
+            shiftCubes(1, 1);
+            centerCubeJ++;
           }
- 
-          centerCubeJ++;
-          laserCloudCenHeight++;
-        } 
-
-        while (centerCubeJ >= laserCloudHeight - 3) {
-          for (int i = 0; i < laserCloudWidth; i++) {
-            for (int k = 0; k < laserCloudDepth; k++) {
-              int j = 0;
-              pcl::PointCloud<PointType>::Ptr laserCloudCubeCornerPointer =
-              laserCloudCornerArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k];
-              pcl::PointCloud<PointType>::Ptr laserCloudCubeSurfPointer =
-              laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k];
-              for (; j < laserCloudHeight - 1; j++) {
-                laserCloudCornerArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] =
-                laserCloudCornerArray[i + laserCloudWidth*(j + 1) + laserCloudWidth * laserCloudHeight*k];
-                laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] =
-                laserCloudSurfArray[i + laserCloudWidth * (j + 1) + laserCloudWidth * laserCloudHeight*k];
-              }
-              laserCloudCornerArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] = 
-              laserCloudCubeCornerPointer;
-              laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] = 
-              laserCloudCubeSurfPointer;
-              laserCloudCubeCornerPointer->clear();
-              laserCloudCubeSurfPointer->clear();
-            }
+          while (centerCubeJ >= laserCloudHeight - 3) {
+            shiftCubes(1, -1);
+            centerCubeJ--;
           }
-
-          centerCubeJ--;
-          laserCloudCenHeight--;
-        }
-
-        while (centerCubeK < 3) {
-          for (int i = 0; i < laserCloudWidth; i++) {
-            for (int j = 0; j < laserCloudHeight; j++) {
-              int k = laserCloudDepth - 1;
-              pcl::PointCloud<PointType>::Ptr laserCloudCubeCornerPointer =
-              laserCloudCornerArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k];
-              pcl::PointCloud<PointType>::Ptr laserCloudCubeSurfPointer =
-              laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k];
-              for (; k >= 1; k--) {
-                laserCloudCornerArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] =
-                laserCloudCornerArray[i + laserCloudWidth*j + laserCloudWidth * laserCloudHeight*(k - 1)];
-                laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] =
-                laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight*(k - 1)];
-              }
-              laserCloudCornerArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] = 
-              laserCloudCubeCornerPointer;
-              laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] = 
-              laserCloudCubeSurfPointer;
-              laserCloudCubeCornerPointer->clear();
-              laserCloudCubeSurfPointer->clear();
-            }
+          while (centerCubeK < 3) {
+            shiftCubes(2, 1);
+            centerCubeK++;
           }
-
-          centerCubeK++;
-          laserCloudCenDepth++;
-        }
-      
-        while (centerCubeK >= laserCloudDepth - 3) {
-          for (int i = 0; i < laserCloudWidth; i++) {
-            for (int j = 0; j < laserCloudHeight; j++) {
-              int k = 0;
-              pcl::PointCloud<PointType>::Ptr laserCloudCubeCornerPointer =
-              laserCloudCornerArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k];
-              pcl::PointCloud<PointType>::Ptr laserCloudCubeSurfPointer =
-              laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k];
-              for (; k < laserCloudDepth - 1; k++) {
-                laserCloudCornerArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] =
-                laserCloudCornerArray[i + laserCloudWidth*j + laserCloudWidth * laserCloudHeight*(k + 1)];
-                laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] =
-                laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight*(k + 1)];
-              }
-              laserCloudCornerArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] = 
-              laserCloudCubeCornerPointer;
-              laserCloudSurfArray[i + laserCloudWidth * j + laserCloudWidth * laserCloudHeight * k] = 
-              laserCloudCubeSurfPointer;
-              laserCloudCubeCornerPointer->clear();
-              laserCloudCubeSurfPointer->clear();
-            }
+          while (centerCubeK >= laserCloudDepth - 3) {
+            shiftCubes(2, -1);
+            centerCubeK--;
           }
 
-          centerCubeK--;
-          laserCloudCenDepth--;
+          if (tileStore) {
+            updateTiles(centerCubeI, centerCubeJ, centerCubeK);
+          }
         }
 
         int laserCloudValidNum = 0;
         int laserCloudSurroundNum = 0;
+        mapSweepCount++;
         for (int i = centerCubeI - 2; i <= centerCubeI + 2; i++) {
           for (int j = centerCubeJ - 2; j <= centerCubeJ + 2; j++) {
             for (int k = centerCubeK - 2; k <= centerCubeK + 2; k++) {
@@ -661,17 +1554,21 @@ int main(int argc, char** argv)
                 }
                 laserCloudSurroundInd[laserCloudSurroundNum] = i + laserCloudWidth * j 
                                                              + laserCloudWidth * laserCloudHeight * k;
+                laserCloudLastUsed[laserCloudSurroundInd[laserCloudSurroundNum]] = mapSweepCount;
                 laserCloudSurroundNum++;
               }
             }
           }
         }
 
-        laserCloudCornerFromMap->clear();
-        laserCloudSurfFromMap->clear();
-        for (int i = 0; i < laserCloudValidNum; i++) {
-          *laserCloudCornerFromMap += *laserCloudCornerArray[laserCloudValidInd[i]];
-          *laserCloudSurfFromMap += *laserCloudSurfArray[laserCloudValidInd[i]];
+        if (!localizationOnly) {
+          // fresh clouds every sweep, the last ones may still be read through a map snapshot
+          laserCloudCornerFromMap = laserCloudCornerFromMapPool.acquire();
+          laserCloudSurfFromMap = laserCloudSurfFromMapPool.acquire();
+          for (int i = 0; i < laserCloudValidNum; i++) {
+            laserCloudCornerArray[laserCloudValidInd[i]]->appendTo(*laserCloudCornerFromMap);
+            laserCloudSurfArray[laserCloudValidInd[i]]->appendTo(*laserCloudSurfFromMap);
+          }
         }
         int laserCloudCornerFromMapNum = laserCloudCornerFromMap->points.size();
         int laserCloudSurfFromMapNum = laserCloudSurfFromMap->points.size();
@@ -687,43 +1584,51 @@ int main(int argc, char** argv)
         }
 
         laserCloudCornerStack->clear();
-        downSizeFilterCorner.setInputCloud(laserCloudCornerStack2);
-        downSizeFilterCorner.filter(*laserCloudCornerStack);
+        downSizeFilterCorner.filter(*laserCloudCornerStack2, *laserCloudCornerStack);
         int laserCloudCornerStackNum = laserCloudCornerStack->points.size();
 
         laserCloudSurfStack->clear();
-        downSizeFilterSurf.setInputCloud(laserCloudSurfStack2);
-        downSizeFilterSurf.filter(*laserCloudSurfStack);
+        downSizeFilterSurf.filter(*laserCloudSurfStack2, *laserCloudSurfStack);
         int laserCloudSurfStackNum = laserCloudSurfStack->points.size();
 
         laserCloudCornerStack2->clear();
         laserCloudSurfStack2->clear();
 
-        if (laserCloudCornerFromMapNum > 10 && laserCloudSurfFromMapNum > 100) {
+        bool submapUsable = laserCloudCornerFromMapNum > 10 && laserCloudSurfFromMapNum > 100;
+        if (submapUsable && !localizationOnly) {
+          kdtreeCornerFromMap = kdtreeCornerFromMapPool.acquire();
+          kdtreeSurfFromMap = kdtreeSurfFromMapPool.acquire();
           kdtreeCornerFromMap->setInputCloud(laserCloudCornerFromMap);
           kdtreeSurfFromMap->setInputCloud(laserCloudSurfFromMap);
+          publishMapSnapshot(timeSweep);
+        }
+        LOAM_SPAN_END(SubmapBuild);
 
-          for (int iterCount = 0; iterCount < 10; iterCount++) {
+        if (submapUsable) {
+          LOAM_SPAN_BEGIN(MappingSolve);
+          LOAM_ALLOC_BEGIN(MappingSolve);
+          for (int iterCount = 0; iterCount < profile.mappingMaxIterations; iterCount++) {
+            solverStats.iterations = iterCount + 1;
             laserCloudOri->clear();
             coeffSel->clear();
 
             for (int i = 0; i < laserCloudCornerStackNum; i++) {
               pointOri = laserCloudCornerStack->points[i];
               pointAssociateToMap(&pointOri, &pointSel);
-              kdtreeCornerFromMap->nearestKSearch(pointSel, 5, pointSearchInd, pointSearchSqDis);
+              kdtreeCornerFromMap->nearestKSearch(pointSel, nearestK, pointSearchInd, pointSearchSqDis);
               
-              if (pointSearchSqDis[4] < 1.0) {
+              if (int(pointSearchSqDis.size()) == nearestK && pointSearchSqDis[nearestK - 1] < profile.distanceGate) {
                 float cx = 0;
                 float cy = 0; 
                 float cz = 0;
-                for (int j = 0; j < 5; j++) {
+                for (int j = 0; j < nearestK; j++) {
                   cx += laserCloudCornerFromMap->points[pointSearchInd[j]].x;
                   cy += laserCloudCornerFromMap->points[pointSearchInd[j]].y;
                   cz += laserCloudCornerFromMap->points[pointSearchInd[j]].z;
                 }
-                cx /= 5;
-                cy /= 5; 
-                cz /= 5;
+                cx /= nearestK;
+                cy /= nearestK; 
+                cz /= nearestK;
 
                 float a11 = 0;
                 float a12 = 0; 
@@ -731,7 +1636,7 @@ int main(int argc, char** argv)
                 float a22 = 0;
                 float a23 = 0; 
                 float a33 = 0;
-                for (int j = 0; j < 5; j++) {
+                for (int j = 0; j < nearestK; j++) {
                   float ax = laserCloudCornerFromMap->points[pointSearchInd[j]].x - cx;
                   float ay = laserCloudCornerFromMap->points[pointSearchInd[j]].y - cy;
                   float az = laserCloudCornerFromMap->points[pointSearchInd[j]].z - cz;
@@ -743,12 +1648,12 @@ int main(int argc, char** argv)
                   a23 += ay * az;
                   a33 += az * az;
                 }
-                a11 /= 5;
-                a12 /= 5; 
-                a13 /= 5;
-                a22 /= 5;
-                a23 /= 5; 
-                a33 /= 5;
+                a11 /= nearestK;
+                a12 /= nearestK; 
+                a13 /= nearestK;
+                a22 /= nearestK;
+                a23 /= nearestK; 
+                a33 /= nearestK;
 
                 matA1.at<float>(0, 0) = a11;
                 matA1.at<float>(0, 1) = a12;
@@ -817,10 +1722,10 @@ int main(int argc, char** argv)
             for (int i = 0; i < laserCloudSurfStackNum; i++) {
               pointOri = laserCloudSurfStack->points[i];
               pointAssociateToMap(&pointOri, &pointSel); 
-              kdtreeSurfFromMap->nearestKSearch(pointSel, 5, pointSearchInd, pointSearchSqDis);
+              kdtreeSurfFromMap->nearestKSearch(pointSel, nearestK, pointSearchInd, pointSearchSqDis);
 
-              if (pointSearchSqDis[4] < 1.0) {
-                for (int j = 0; j < 5; j++) {
+              if (int(pointSearchSqDis.size()) == nearestK && pointSearchSqDis[nearestK - 1] < profile.distanceGate) {
+                for (int j = 0; j < nearestK; j++) {
                   matA0.at<float>(j, 0) = laserCloudSurfFromMap->points[pointSearchInd[j]].x;
                   matA0.at<float>(j, 1) = laserCloudSurfFromMap->points[pointSearchInd[j]].y;
                   matA0.at<float>(j, 2) = laserCloudSurfFromMap->points[pointSearchInd[j]].z;
@@ -839,7 +1744,7 @@ int main(int argc, char** argv)
                 pd /= ps;
 
                 bool planeValid = true;
-                for (int j = 0; j < 5; j++) {
+                for (int j = 0; j < nearestK; j++) {
                   if (fabs(pa * laserCloudSurfFromMap->points[pointSearchInd[j]].x +
                       pb * laserCloudSurfFromMap->points[pointSearchInd[j]].y +
                       pc * laserCloudSurfFromMap->points[pointSearchInd[j]].z + pd) > 0.2) {
@@ -884,15 +1789,16 @@ int main(int argc, char** argv)
               continue;
             }
 
-            cv::Mat matA(laserCloudSelNum, 6, CV_32F, cv::Scalar::all(0));
-            cv::Mat matAt(6, laserCloudSelNum, CV_32F, cv::Scalar::all(0));
-            cv::Mat matAtA(6, 6, CV_32F, cv::Scalar::all(0));
-            cv::Mat matB(laserCloudSelNum, 1, CV_32F, cv::Scalar::all(0));
-            cv::Mat matAtB(6, 1, CV_32F, cv::Scalar::all(0));
-            cv::Mat matX(6, 1, CV_32F, cv::Scalar::all(0));
+            solver.resize(laserCloudSelNum);
+            cv::Mat &matA = solver.matA;
+            cv::Mat &matB = solver.matB;
+            cv::Mat &matAtA = solver.matAtA;
+            cv::Mat &matX = solver.matX;
+            float residualSqSum = 0;
             for (int i = 0; i < laserCloudSelNum; i++) {
               pointOri = laserCloudOri->points[i];
               coeff = coeffSel->points[i];
+              residualSqSum += coeff.intensity * coeff.intensity;
 
               float arx = (crx*sry*srz*pointOri.x + crx*crz*sry*pointOri.y - srx*sry*pointOri.z) * coeff.x
                         + (-srx*srz*pointOri.x - crz*srx*pointOri.y - crx*pointOri.z) * coeff.y
@@ -915,18 +1821,21 @@ int main(int argc, char** argv)
               matA.at<float>(i, 5) = coeff.z;
               matB.at<float>(i, 0) = -coeff.intensity;
             }
-            cv::transpose(matA, matAt);
-            matAtA = matAt * matA;
-            matAtB = matAt * matB;
-            cv::solve(matAtA, matAtB, matX, cv::DECOMP_QR);
+            solver.solve();
+            solverStats.inliers = laserCloudSelNum;
+            solverStats.residual_rms = sqrt(residualSqSum / laserCloudSelNum);
 
             if (iterCount == 0) {
-              cv::Mat matE(1, 6, CV_32F, cv::Scalar::all(0));
-              cv::Mat matV(6, 6, CV_32F, cv::Scalar::all(0));
-              cv::Mat matV2(6, 6, CV_32F, cv::Scalar::all(0));
+              cv::Mat &matE = solver.matE;
+              cv::Mat &matV = solver.matV;
+              cv::Mat &matV2 = solver.matV2;
 
               cv::eigen(matAtA, matE, matV);
               matV.copyTo(matV2);
+              // cv::eigen sorts descending
+              for (int i = 0; i < 6; i++) {
+                solverStats.eigenvalues[i] = matE.at<float>(0, 5 - i);
+              }
 
               isDegenerate = false;
               float eignThre[6] = {100, 100, 100, 100, 100, 100};
@@ -940,11 +1849,12 @@ int main(int argc, char** argv)
                   break;
                 }
               }
-              matP = matV.inv() * matV2;
+              cv::invert(matV, solver.matVInv);
+              matP = solver.matVInv * matV2;
             }
 
             if (isDegenerate) {
-              cv::Mat matX2(6, 1, CV_32F, cv::Scalar::all(0));
+              cv::Mat &matX2 = solver.matX2;
               matX.copyTo(matX2);
               matX = matP * matX2;
             }
@@ -966,108 +1876,22 @@ int main(int argc, char** argv)
                                 pow(matX.at<float>(5, 0) * 100, 2));
 
             if (deltaR < 0.05 && deltaT < 0.05) {
+              solverStats.converged = true;
               break;
             }
           }
 
-          transformUpdate();
-        }
-
-        for (int i = 0; i < laserCloudCornerStackNum; i++) {
-          pointAssociateToMap(&laserCloudCornerStack->points[i], &pointSel);
-
-          int cubeI = int((pointSel.x + 25.0) / 50.0) + laserCloudCenWidth;
-          int cubeJ = int((pointSel.y + 25.0) / 50.0) + laserCloudCenHeight;
-          int cubeK = int((pointSel.z + 25.0) / 50.0) + laserCloudCenDepth;
-
-          if (pointSel.x + 25.0 < 0) cubeI--;
-          if (pointSel.y + 25.0 < 0) cubeJ--;
-          if (pointSel.z + 25.0 < 0) cubeK--;
-
-          if (cubeI >= 0 && cubeI < laserCloudWidth && 
-              cubeJ >= 0 && cubeJ < laserCloudHeight && 
-              cubeK >= 0 && cubeK < laserCloudDepth) {
-            int cubeInd = cubeI + laserCloudWidth * cubeJ + laserCloudWidth * laserCloudHeight * cubeK;
-            laserCloudCornerArray[cubeInd]->push_back(pointSel);
-          }
-        }
+          LOAM_ALLOC_END(MappingSolve);
 
-        for (int i = 0; i < laserCloudSurfStackNum; i++) {
-          pointAssociateToMap(&laserCloudSurfStack->points[i], &pointSel);
-
-          int cubeI = int((pointSel.x + 25.0) / 50.0) + laserCloudCenWidth;
-          int cubeJ = int((pointSel.y + 25.0) / 50.0) + laserCloudCenHeight;
-          int cubeK = int((pointSel.z + 25.0) / 50.0) + laserCloudCenDepth;
-
-          if (pointSel.x + 25.0 < 0) cubeI--;
-          if (pointSel.y + 25.0 < 0) cubeJ--;
-          if (pointSel.z + 25.0 < 0) cubeK--;
-
-          if (cubeI >= 0 && cubeI < laserCloudWidth && 
-              cubeJ >= 0 && cubeJ < laserCloudHeight && 
-              cubeK >= 0 && cubeK < laserCloudDepth) {
-            int cubeInd = cubeI + laserCloudWidth * cubeJ + laserCloudWidth * laserCloudHeight * cubeK;
-            laserCloudSurfArray[cubeInd]->push_back(pointSel);
-          }
-        }
-
-        for (int i = 0; i < laserCloudValidNum; i++) {
-          int ind = laserCloudValidInd[i];
-
-          laserCloudCornerArray2[ind]->clear();
-          downSizeFilterCorner.setInputCloud(laserCloudCornerArray[ind]);
-          downSizeFilterCorner.filter(*laserCloudCornerArray2[ind]);
-
-          laserCloudSurfArray2[ind]->clear();
-          downSizeFilterSurf.setInputCloud(laserCloudSurfArray[ind]);
-          downSizeFilterSurf.filter(*laserCloudSurfArray2[ind]);
-
-          pcl::PointCloud<PointType>::Ptr laserCloudTemp = laserCloudCornerArray[ind];
-          laserCloudCornerArray[ind] = laserCloudCornerArray2[ind];
-          laserCloudCornerArray2[ind] = laserCloudTemp;
-
-          laserCloudTemp = laserCloudSurfArray[ind];
-          laserCloudSurfArray[ind] = laserCloudSurfArray2[ind];
-          laserCloudSurfArray2[ind] = laserCloudTemp;
-        }
-
-        mapFrameCount++;
-        if (mapFrameCount >= mapFrameNum) {
-          mapFrameCount = 0;
-
-          laserCloudSurround2->clear();
-          for (int i = 0; i < laserCloudSurroundNum; i++) {
-            int ind = laserCloudSurroundInd[i];
-            *laserCloudSurround2 += *laserCloudCornerArray[ind];
-            *laserCloudSurround2 += *laserCloudSurfArray[ind];
-          }
-
-          laserCloudSurround->clear();
-          downSizeFilterCorner.setInputCloud(laserCloudSurround2);
-          downSizeFilterCorner.filter(*laserCloudSurround);
-
-          sensor_msgs::PointCloud2 laserCloudSurround3;
-          pcl::toROSMsg(*laserCloudSurround, laserCloudSurround3);
-          laserCloudSurround3.header.stamp = ros::Time().fromSec(timeLaserOdometry);
-          laserCloudSurround3.header.frame_id = "/camera_init";
-          pubLaserCloudSurround.publish(laserCloudSurround3);
-        }
-
-        int laserCloudFullResNum = laserCloudFullRes->points.size();
-        for (int i = 0; i < laserCloudFullResNum; i++) {
-          pointAssociateToMap(&laserCloudFullRes->points[i], &laserCloudFullRes->points[i]);
+          transformUpdate();
+          LOAM_SPAN_END(MappingSolve);
         }
 
-        sensor_msgs::PointCloud2 laserCloudFullRes3;
-        pcl::toROSMsg(*laserCloudFullRes, laserCloudFullRes3);
-        laserCloudFullRes3.header.stamp = ros::Time().fromSec(timeLaserOdometry);
-        laserCloudFullRes3.header.frame_id = "/camera_init";
-        pubLaserCloudFullRes.publish(laserCloudFullRes3);
-
+        LOAM_SPAN_BEGIN(Publish);
         geometry_msgs::Quaternion geoQuat = tf::createQuaternionMsgFromRollPitchYaw
                                   (transformAftMapped[2], -transformAftMapped[0], -transformAftMapped[1]);
 
-        odomAftMapped.header.stamp = ros::Time().fromSec(timeLaserOdometry);
+        odomAftMapped.header.stamp = ros::Time().fromSec(timeSweep);
         odomAftMapped.pose.pose.orientation.x = -geoQuat.y;
         odomAftMapped.pose.pose.orientation.y = -geoQuat.z;
         odomAftMapped.pose.pose.orientation.z = geoQuat.x;
@@ -1083,18 +1907,81 @@ int main(int argc, char** argv)
         odomAftMapped.twist.twist.linear.z = transformBefMapped[5];
         pubOdomAftMapped.publish(odomAftMapped);
 
-        aftMappedTrans.stamp_ = ros::Time().fromSec(timeLaserOdometry);
+        aftMappedTrans.stamp_ = ros::Time().fromSec(timeSweep);
         aftMappedTrans.setRotation(tf::Quaternion(-geoQuat.y, -geoQuat.z, geoQuat.x, geoQuat.w));
         aftMappedTrans.setOrigin(tf::Vector3(transformAftMapped[3], 
                                              transformAftMapped[4], transformAftMapped[5]));
         tfBroadcaster.sendTransform(aftMappedTrans);
+        LOAM_SPAN_END(Publish);
+
+        solverStats.header.stamp = ros::Time().fromSec(timeSweep);
+        solverStats.degenerate = solverStats.inliers > 0 && isDegenerate;
+        solverStats.processing_time = (ros::WallTime::now() - timeFrameStart).toSec();
+        pubSolverStats.publish(solverStats);
+        ROS_DEBUG("laserMapping: sweep %.3f published after %.1f ms",
+                  timeSweep, (ros::Time::now().toSec() - timeSweep) * 1000);
+
+        // the pose is out, update the map off the critical path
+        MapUpdateJob job;
+        for (int i = 0; i < 6; i++) {
+          job.transform[i] = transformTobeMapped[i];
+        }
+        job.laserCloudCornerStack = laserCloudCornerStack;
+        job.laserCloudSurfStack = laserCloudSurfStack;
+        job.laserCloudFullRes = laserCloudFullRes;
+        job.laserCloudSurroundNum = laserCloudSurroundNum;
+        job.updateMap = !localizationOnly && isKeyframe(timeSweep);
+        if (job.updateMap) {
+          setKeyframe(timeSweep);
+        } else if (!localizationOnly) {
+          keyframeSkipped++;
+        }
+        job.timeSweep = timeSweep;
 
+        mapFrameCount++;
+        job.publishSurround = false;
+        if (mapFrameCount >= mapFrameNum) {
+          mapFrameCount = 0;
+          job.publishSurround = true;
+        }
+        submitMapUpdate(job);
       }
     }
 
-    status = ros::ok();
-    rate.sleep();
+    serveSaveRequest();
+
+    FrameCounters counters = frameSync.counters();
+    ROS_DEBUG_THROTTLE(10.0, "laserMapping: sweeps received %lu processed %lu dropped %lu superseded %lu, "
+                       "%ld not inserted below the keyframe thresholds",
+                       counters.received, counters.processed, counters.dropped, counters.superseded,
+                       keyframeSkipped);
+  }
+
+  FrameCounters counters = frameSync.counters();
+  ROS_INFO("laserMapping: sweeps received %lu processed %lu dropped %lu superseded %lu",
+           counters.received, counters.processed, counters.dropped, counters.superseded);
+
+  {
+    std::lock_guard<std::mutex> lock(mWorker);
+    workerQuit = true;
+    workerCond.notify_all();
+  }
+  worker.join();
+
+  // a service call that arrived during shutdown is answered before the spinner stops
+  serveSaveRequest(true);
+  // a frozen map is saved unchanged, only on request
+  if (!mapFile.empty() && mapSaveOnShutdown && !localizationOnly) {
+    CubeMapHeader header;
+    if (saveMap(mapFile, header)) {
+      ROS_INFO("laserMapping: saved %u cubes, %lu points to %s",
+               header.cubeCount, header.pointCount, mapFile.c_str());
+    } else {
+      ROS_WARN("laserMapping: failed to save the map to %s", mapFile.c_str());
+    }
   }
+  // flushes the pending evictions
+  tileStore.reset();
 
   return 0;
 }
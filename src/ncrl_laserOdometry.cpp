@@ -32,7 +32,14 @@
 */
 
 #include <ros/ros.h>
+#include <loam_velodyne/alloc_counter.h>
+#include <loam_velodyne/cloud_pool.h>
 #include <loam_velodyne/common.h>
+#include <loam_velodyne/frame_sync.h>
+#include <loam_velodyne/profile.h>
+#include <loam_velodyne/solver_buffers.h>
+#include <loam_velodyne/SolverStats.h>
+#include <loam_velodyne/telemetry.h>
 
 #include <nav_msgs/Odometry.h>
 #include <sensor_msgs/Imu.h>
@@ -40,6 +47,10 @@
 
 #include <opencv/cv.h>
 #include <cmath>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
@@ -52,22 +63,33 @@
 
 const float scanPeriod = 0.1;
 
-const int skipFrameNum = 1;
+// set from the active profile at the start of every sweep
+int skipFrameNum = 1;
 bool systemInited = false;
 
-double timeCornerPointsSharp = 0;
-double timeCornerPointsLessSharp = 0;
-double timeSurfPointsFlat = 0;
-double timeSurfPointsLessFlat = 0;
-double timeLaserCloudFullRes = 0;
-double timeImuTrans = 0;
-
-bool newCornerPointsSharp = false;
-bool newCornerPointsLessSharp = false;
-bool newSurfPointsFlat = false;
-bool newSurfPointsLessFlat = false;
-bool newLaserCloudFullRes = false;
-bool newImuTrans = false;
+// the subscriber thread assembles sweeps from the six inputs, the processing loop picks up
+// complete ones according to the drop policy
+enum OdometryInput {
+  InputCornerPointsSharp = 0,
+  InputCornerPointsLessSharp,
+  InputSurfPointsFlat,
+  InputSurfPointsLessFlat,
+  InputLaserCloudFullRes,
+  InputImuTrans,
+  OdometryInputNum
+};
+
+struct OdometryFrame {
+  pcl::PointCloud<PointType>::Ptr cornerPointsSharp;
+  pcl::PointCloud<PointType>::Ptr cornerPointsLessSharp;
+  pcl::PointCloud<PointType>::Ptr surfPointsFlat;
+  pcl::PointCloud<PointType>::Ptr surfPointsLessFlat;
+  pcl::PointCloud<PointType>::Ptr laserCloudFullRes;
+  pcl::PointCloud<pcl::PointXYZ>::Ptr imuTrans;
+};
+
+FrameSync<OdometryFrame, OdometryInputNum> frameSync;
+double timeSweep = 0;
 
 pcl::PointCloud<PointType>::Ptr cornerPointsSharp(new pcl::PointCloud<PointType>());
 pcl::PointCloud<PointType>::Ptr cornerPointsLessSharp(new pcl::PointCloud<PointType>());
@@ -79,6 +101,16 @@ pcl::PointCloud<PointType>::Ptr laserCloudOri(new pcl::PointCloud<PointType>());
 pcl::PointCloud<PointType>::Ptr coeffSel(new pcl::PointCloud<PointType>());
 pcl::PointCloud<PointType>::Ptr laserCloudFullRes(new pcl::PointCloud<PointType>());
 pcl::PointCloud<pcl::PointXYZ>::Ptr imuTrans(new pcl::PointCloud<pcl::PointXYZ>());
+
+// input clouds are recycled once the frame and the reference clouds built from it are dropped,
+// only the spinner thread acquires
+CloudPool<PointType> cornerPointsSharpPool;
+CloudPool<PointType> cornerPointsLessSharpPool;
+CloudPool<PointType> surfPointsFlatPool;
+CloudPool<PointType> surfPointsLessFlatPool;
+CloudPool<PointType> laserCloudFullResPool;
+CloudPool<pcl::PointXYZ> imuTransPool;
+std::vector<int> nanIndices;
 pcl::KdTreeFLANN<PointType>::Ptr kdtreeCornerLast(new pcl::KdTreeFLANN<PointType>());
 pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurfLast(new pcl::KdTreeFLANN<PointType>());
 
@@ -102,9 +134,39 @@ float imuRollLast = 0, imuPitchLast = 0, imuYawLast = 0;
 float imuShiftFromStartX = 0, imuShiftFromStartY = 0, imuShiftFromStartZ = 0;
 float imuVeloFromStartX = 0, imuVeloFromStartY = 0, imuVeloFromStartZ = 0;
 
+// transform and imu state needed to reproject a sweep to its end,
+// snapshotted after the solve so the worker does not race with the next sweep
+struct SweepEndTransform {
+  float transform[6];
+  float imuRollStart, imuPitchStart, imuYawStart;
+  float imuRollLast, imuPitchLast, imuYawLast;
+  float imuShiftFromStartX, imuShiftFromStartY, imuShiftFromStartZ;
+};
+
+// post-solve work of sweep k (reprojection to sweep end, kd-tree build, cloud publication),
+// executed by the worker thread while sweep k+1 is being received
+struct PostSolveJob {
+  SweepEndTransform end;
+  pcl::PointCloud<PointType>::Ptr cornerPointsLessSharp;
+  pcl::PointCloud<PointType>::Ptr surfPointsLessFlat;
+  pcl::PointCloud<PointType>::Ptr laserCloudFullRes;
+  bool publishClouds;
+  double timeSweep;
+};
+
+std::mutex mWorker;
+std::condition_variable workerCond;
+bool workerBusy = false;
+bool workerQuit = false;
+PostSolveJob workerJob;
+
+ros::Publisher pubLaserCloudCornerLast;
+ros::Publisher pubLaserCloudSurfLast;
+ros::Publisher pubLaserCloudFullRes;
+
 void TransformToStart(PointType const * const pi, PointType * const po)
 {
-  float s = 10 * (pi->intensity - int(pi->intensity));
+  float s = pi->t / scanPeriod;
 
   float rx = s * transform[0];
   float ry = s * transform[1];
@@ -125,18 +187,20 @@ void TransformToStart(PointType const * const pi, PointType * const po)
   po->y = y2;
   po->z = sin(ry) * x2 + cos(ry) * z2;
   po->intensity = pi->intensity;
+  po->t = pi->t;
+  po->ring = pi->ring;
 }
 
-void TransformToEnd(PointType const * const pi, PointType * const po)
+void TransformToEnd(PointType const * const pi, PointType * const po, SweepEndTransform const &e)
 {
-  float s = 10 * (pi->intensity - int(pi->intensity));
+  float s = pi->t / scanPeriod;
 
-  float rx = s * transform[0];
-  float ry = s * transform[1];
-  float rz = s * transform[2];
-  float tx = s * transform[3];
-  float ty = s * transform[4];
-  float tz = s * transform[5];
+  float rx = s * e.transform[0];
+  float ry = s * e.transform[1];
+  float rz = s * e.transform[2];
+  float tx = s * e.transform[3];
+  float ty = s * e.transform[4];
+  float tz = s * e.transform[5];
 
   float x1 = cos(rz) * (pi->x - tx) + sin(rz) * (pi->y - ty);
   float y1 = -sin(rz) * (pi->x - tx) + cos(rz) * (pi->y - ty);
@@ -150,12 +214,12 @@ void TransformToEnd(PointType const * const pi, PointType * const po)
   float y3 = y2;
   float z3 = sin(ry) * x2 + cos(ry) * z2;
 
-  rx = transform[0];
-  ry = transform[1];
-  rz = transform[2];
-  tx = transform[3];
-  ty = transform[4];
-  tz = transform[5];
+  rx = e.transform[0];
+  ry = e.transform[1];
+  rz = e.transform[2];
+  tx = e.transform[3];
+  ty = e.transform[4];
+  tz = e.transform[5];
 
   float x4 = cos(ry) * x3 + sin(ry) * z3;
   float y4 = y3;
@@ -169,32 +233,34 @@ void TransformToEnd(PointType const * const pi, PointType * const po)
   float y6 = sin(rz) * x5 + cos(rz) * y5 + ty;
   float z6 = z5 + tz;
 
-  float x7 = cos(imuRollStart) * (x6 - imuShiftFromStartX) 
-           - sin(imuRollStart) * (y6 - imuShiftFromStartY);
-  float y7 = sin(imuRollStart) * (x6 - imuShiftFromStartX) 
-           + cos(imuRollStart) * (y6 - imuShiftFromStartY);
-  float z7 = z6 - imuShiftFromStartZ;
+  float x7 = cos(e.imuRollStart) * (x6 - e.imuShiftFromStartX) 
+           - sin(e.imuRollStart) * (y6 - e.imuShiftFromStartY);
+  float y7 = sin(e.imuRollStart) * (x6 - e.imuShiftFromStartX) 
+           + cos(e.imuRollStart) * (y6 - e.imuShiftFromStartY);
+  float z7 = z6 - e.imuShiftFromStartZ;
 
   float x8 = x7;
-  float y8 = cos(imuPitchStart) * y7 - sin(imuPitchStart) * z7;
-  float z8 = sin(imuPitchStart) * y7 + cos(imuPitchStart) * z7;
+  float y8 = cos(e.imuPitchStart) * y7 - sin(e.imuPitchStart) * z7;
+  float z8 = sin(e.imuPitchStart) * y7 + cos(e.imuPitchStart) * z7;
 
-  float x9 = cos(imuYawStart) * x8 + sin(imuYawStart) * z8;
+  float x9 = cos(e.imuYawStart) * x8 + sin(e.imuYawStart) * z8;
   float y9 = y8;
-  float z9 = -sin(imuYawStart) * x8 + cos(imuYawStart) * z8;
+  float z9 = -sin(e.imuYawStart) * x8 + cos(e.imuYawStart) * z8;
 
-  float x10 = cos(imuYawLast) * x9 - sin(imuYawLast) * z9;
+  float x10 = cos(e.imuYawLast) * x9 - sin(e.imuYawLast) * z9;
   float y10 = y9;
-  float z10 = sin(imuYawLast) * x9 + cos(imuYawLast) * z9;
+  float z10 = sin(e.imuYawLast) * x9 + cos(e.imuYawLast) * z9;
 
   float x11 = x10;
-  float y11 = cos(imuPitchLast) * y10 + sin(imuPitchLast) * z10;
-  float z11 = -sin(imuPitchLast) * y10 + cos(imuPitchLast) * z10;
+  float y11 = cos(e.imuPitchLast) * y10 + sin(e.imuPitchLast) * z10;
+  float z11 = -sin(e.imuPitchLast) * y10 + cos(e.imuPitchLast) * z10;
 
-  po->x = cos(imuRollLast) * x11 + sin(imuRollLast) * y11;
-  po->y = -sin(imuRollLast) * x11 + cos(imuRollLast) * y11;
+  po->x = cos(e.imuRollLast) * x11 + sin(e.imuRollLast) * y11;
+  po->y = -sin(e.imuRollLast) * x11 + cos(e.imuRollLast) * y11;
   po->z = z11;
-  po->intensity = int(pi->intensity);
+  po->intensity = pi->intensity;
+  po->t = 0;
+  po->ring = pi->ring;
 }
 
 void PluginIMURotation(float bcx, float bcy, float bcz, float blx, float bly, float blz, 
@@ -278,66 +344,157 @@ void AccumulateRotation(float cx, float cy, float cz, float lx, float ly, float
 
 void laserCloudSharpHandler(const sensor_msgs::PointCloud2ConstPtr& cornerPointsSharp2)
 {
-  timeCornerPointsSharp = cornerPointsSharp2->header.stamp.toSec();
-
-  cornerPointsSharp->clear();
-  pcl::fromROSMsg(*cornerPointsSharp2, *cornerPointsSharp);
-  std::vector<int> indices;
-  pcl::removeNaNFromPointCloud(*cornerPointsSharp,*cornerPointsSharp, indices);
-  newCornerPointsSharp = true;
+  LOAM_TRACE_SWEEP(cornerPointsSharp2->header.stamp.toSec());
+  LOAM_SPAN(Ingest);
+  pcl::PointCloud<PointType>::Ptr cloud = cornerPointsSharpPool.acquire();
+  pcl::fromROSMsg(*cornerPointsSharp2, *cloud);
+  pcl::removeNaNFromPointCloud(*cloud, *cloud, nanIndices);
+
+  frameSync.add(InputCornerPointsSharp, cornerPointsSharp2->header.stamp.toSec(),
+                [&cloud](OdometryFrame &frame) { frame.cornerPointsSharp = cloud; });
 }
 
 void laserCloudLessSharpHandler(const sensor_msgs::PointCloud2ConstPtr& cornerPointsLessSharp2)
 {
-  timeCornerPointsLessSharp = cornerPointsLessSharp2->header.stamp.toSec();
-
-  cornerPointsLessSharp->clear();
-  pcl::fromROSMsg(*cornerPointsLessSharp2, *cornerPointsLessSharp);
-  std::vector<int> indices;
-  pcl::removeNaNFromPointCloud(*cornerPointsLessSharp,*cornerPointsLessSharp, indices);
-  newCornerPointsLessSharp = true;
+  LOAM_TRACE_SWEEP(cornerPointsLessSharp2->header.stamp.toSec());
+  LOAM_SPAN(Ingest);
+  pcl::PointCloud<PointType>::Ptr cloud = cornerPointsLessSharpPool.acquire();
+  pcl::fromROSMsg(*cornerPointsLessSharp2, *cloud);
+  pcl::removeNaNFromPointCloud(*cloud, *cloud, nanIndices);
+
+  frameSync.add(InputCornerPointsLessSharp, cornerPointsLessSharp2->header.stamp.toSec(),
+                [&cloud](OdometryFrame &frame) { frame.cornerPointsLessSharp = cloud; });
 }
 
 void laserCloudFlatHandler(const sensor_msgs::PointCloud2ConstPtr& surfPointsFlat2)
 {
-  timeSurfPointsFlat = surfPointsFlat2->header.stamp.toSec();
-
-  surfPointsFlat->clear();
-  pcl::fromROSMsg(*surfPointsFlat2, *surfPointsFlat);
-  std::vector<int> indices;
-  pcl::removeNaNFromPointCloud(*surfPointsFlat,*surfPointsFlat, indices);
-  newSurfPointsFlat = true;
+  LOAM_TRACE_SWEEP(surfPointsFlat2->header.stamp.toSec());
+  LOAM_SPAN(Ingest);
+  pcl::PointCloud<PointType>::Ptr cloud = surfPointsFlatPool.acquire();
+  pcl::fromROSMsg(*surfPointsFlat2, *cloud);
+  pcl::removeNaNFromPointCloud(*cloud, *cloud, nanIndices);
+
+  frameSync.add(InputSurfPointsFlat, surfPointsFlat2->header.stamp.toSec(),
+                [&cloud](OdometryFrame &frame) { frame.surfPointsFlat = cloud; });
 }
 
 void laserCloudLessFlatHandler(const sensor_msgs::PointCloud2ConstPtr& surfPointsLessFlat2)
 {
-  timeSurfPointsLessFlat = surfPointsLessFlat2->header.stamp.toSec();
-
-  surfPointsLessFlat->clear();
-  pcl::fromROSMsg(*surfPointsLessFlat2, *surfPointsLessFlat);
-  std::vector<int> indices;
-  pcl::removeNaNFromPointCloud(*surfPointsLessFlat,*surfPointsLessFlat, indices);
-  newSurfPointsLessFlat = true;
+  LOAM_TRACE_SWEEP(surfPointsLessFlat2->header.stamp.toSec());
+  LOAM_SPAN(Ingest);
+  pcl::PointCloud<PointType>::Ptr cloud = surfPointsLessFlatPool.acquire();
+  pcl::fromROSMsg(*surfPointsLessFlat2, *cloud);
+  pcl::removeNaNFromPointCloud(*cloud, *cloud, nanIndices);
+
+  frameSync.add(InputSurfPointsLessFlat, surfPointsLessFlat2->header.stamp.toSec(),
+                [&cloud](OdometryFrame &frame) { frame.surfPointsLessFlat = cloud; });
 }
 
 void laserCloudFullResHandler(const sensor_msgs::PointCloud2ConstPtr& laserCloudFullRes2)
 {
-  timeLaserCloudFullRes = laserCloudFullRes2->header.stamp.toSec();
-
-  laserCloudFullRes->clear();
-  pcl::fromROSMsg(*laserCloudFullRes2, *laserCloudFullRes);
-  std::vector<int> indices;
-  pcl::removeNaNFromPointCloud(*laserCloudFullRes,*laserCloudFullRes, indices);
-  newLaserCloudFullRes = true;
+  LOAM_TRACE_SWEEP(laserCloudFullRes2->header.stamp.toSec());
+  LOAM_SPAN(Ingest);
+  pcl::PointCloud<PointType>::Ptr cloud = laserCloudFullResPool.acquire();
+  pcl::fromROSMsg(*laserCloudFullRes2, *cloud);
+  pcl::removeNaNFromPointCloud(*cloud, *cloud, nanIndices);
+
+  frameSync.add(InputLaserCloudFullRes, laserCloudFullRes2->header.stamp.toSec(),
+                [&cloud](OdometryFrame &frame) { frame.laserCloudFullRes = cloud; });
 }
 
 void imuTransHandler(const sensor_msgs::PointCloud2ConstPtr& imuTrans2)
 {
-  timeImuTrans = imuTrans2->header.stamp.toSec();
+  LOAM_TRACE_SWEEP(imuTrans2->header.stamp.toSec());
+  LOAM_SPAN(Ingest);
+  pcl::PointCloud<pcl::PointXYZ>::Ptr cloud = imuTransPool.acquire();
+  pcl::fromROSMsg(*imuTrans2, *cloud);
+
+  frameSync.add(InputImuTrans, imuTrans2->header.stamp.toSec(),
+                [&cloud](OdometryFrame &frame) { frame.imuTrans = cloud; });
+}
+
+void submitPostSolve(PostSolveJob const &job)
+{
+  std::lock_guard<std::mutex> lock(mWorker);
+  workerJob = job;
+  workerBusy = true;
+  workerCond.notify_all();
+}
+
+// block until the reference clouds and kd-trees of the previous sweep are ready
+void waitPostSolve()
+{
+  std::unique_lock<std::mutex> lock(mWorker);
+  workerCond.wait(lock, []{ return !workerBusy; });
+}
+
+void postSolveWorker()
+{
+  while (true) {
+    std::unique_lock<std::mutex> lock(mWorker);
+    workerCond.wait(lock, []{ return workerBusy || workerQuit; });
+    if (!workerBusy) {
+      return;
+    }
+    PostSolveJob job = workerJob;
+    lock.unlock();
+    LOAM_TRACE_SWEEP(job.timeSweep);
+
+    int cornerPointsLessSharpNum = job.cornerPointsLessSharp->points.size();
+    for (int i = 0; i < cornerPointsLessSharpNum; i++) {
+      TransformToEnd(&job.cornerPointsLessSharp->points[i], &job.cornerPointsLessSharp->points[i], job.end);
+    }
+
+    int surfPointsLessFlatNum = job.surfPointsLessFlat->points.size();
+    for (int i = 0; i < surfPointsLessFlatNum; i++) {
+      TransformToEnd(&job.surfPointsLessFlat->points[i], &job.surfPointsLessFlat->points[i], job.end);
+    }
+
+    if (job.publishClouds) {
+      int laserCloudFullResNum = job.laserCloudFullRes->points.size();
+      for (int i = 0; i < laserCloudFullResNum; i++) {
+        TransformToEnd(&job.laserCloudFullRes->points[i], &job.laserCloudFullRes->points[i], job.end);
+      }
+    }
+
+    laserCloudCornerLast = job.cornerPointsLessSharp;
+    laserCloudSurfLast = job.surfPointsLessFlat;
+
+    laserCloudCornerLastNum = laserCloudCornerLast->points.size();
+    laserCloudSurfLastNum = laserCloudSurfLast->points.size();
+    if (laserCloudCornerLastNum > 10 && laserCloudSurfLastNum > 100) {
+      kdtreeCornerLast->setInputCloud(laserCloudCornerLast);
+      kdtreeSurfLast->setInputCloud(laserCloudSurfLast);
+    }
 
-  imuTrans->clear();
-  pcl::fromROSMsg(*imuTrans2, *imuTrans);
+    if (job.publishClouds) {
+      sensor_msgs::PointCloud2 laserCloudCornerLast2;
+      pcl::toROSMsg(*laserCloudCornerLast, laserCloudCornerLast2);
+      laserCloudCornerLast2.header.stamp = ros::Time().fromSec(job.timeSweep);
+      laserCloudCornerLast2.header.frame_id = "/camera";
+      pubLaserCloudCornerLast.publish(laserCloudCornerLast2);
+
+      sensor_msgs::PointCloud2 laserCloudSurfLast2;
+      pcl::toROSMsg(*laserCloudSurfLast, laserCloudSurfLast2);
+      laserCloudSurfLast2.header.stamp = ros::Time().fromSec(job.timeSweep);
+      laserCloudSurfLast2.header.frame_id = "/camera";
+      pubLaserCloudSurfLast.publish(laserCloudSurfLast2);
+
+      sensor_msgs::PointCloud2 laserCloudFullRes3;
+      pcl::toROSMsg(*job.laserCloudFullRes, laserCloudFullRes3);
+      laserCloudFullRes3.header.stamp = ros::Time().fromSec(job.timeSweep);
+      laserCloudFullRes3.header.frame_id = "/camera";
+      pubLaserCloudFullRes.publish(laserCloudFullRes3);
+    }
+
+    lock.lock();
+    workerBusy = false;
+    workerCond.notify_all();
+  }
+}
 
+void readImuTrans()
+{
   imuPitchStart = imuTrans->points[0].x;
   imuYawStart = imuTrans->points[0].y;
   imuRollStart = imuTrans->points[0].z;
@@ -353,8 +510,6 @@ void imuTransHandler(const sensor_msgs::PointCloud2ConstPtr& imuTrans2)
   imuVeloFromStartX = imuTrans->points[3].x;
   imuVeloFromStartY = imuTrans->points[3].y;
   imuVeloFromStartZ = imuTrans->points[3].z;
-
-  newImuTrans = true;
 }
 
 
@@ -362,20 +517,22 @@ int main(int argc, char** argv)
 {
   ros::init(argc, argv, "laserOdometry");
   ros::NodeHandle nh;
+  ros::NodeHandle nhPrivate("~");
 
   // declare subscriber
-  ros::Subscriber subCornerPointsSharp = nh.subscribe<sensor_msgs::PointCloud2> ("/laser_cloud_sharp", 2, laserCloudSharpHandler);
-  ros::Subscriber subCornerPointsLessSharp = nh.subscribe<sensor_msgs::PointCloud2> ("/laser_cloud_less_sharp", 2, laserCloudLessSharpHandler);
-  ros::Subscriber subSurfPointsFlat = nh.subscribe<sensor_msgs::PointCloud2> ("/laser_cloud_flat", 2, laserCloudFlatHandler);
-  ros::Subscriber subSurfPointsLessFlat = nh.subscribe<sensor_msgs::PointCloud2> ("/laser_cloud_less_flat", 2, laserCloudLessFlatHandler);
-  ros::Subscriber subLaserCloudFullRes = nh.subscribe<sensor_msgs::PointCloud2> ("/velodyne_cloud_2", 2, laserCloudFullResHandler);
+  ros::Subscriber subCornerPointsSharp = nh.subscribe<sensor_msgs::PointCloud2> ("/laser_cloud_sharp", 5, laserCloudSharpHandler);
+  ros::Subscriber subCornerPointsLessSharp = nh.subscribe<sensor_msgs::PointCloud2> ("/laser_cloud_less_sharp", 5, laserCloudLessSharpHandler);
+  ros::Subscriber subSurfPointsFlat = nh.subscribe<sensor_msgs::PointCloud2> ("/laser_cloud_flat", 5, laserCloudFlatHandler);
+  ros::Subscriber subSurfPointsLessFlat = nh.subscribe<sensor_msgs::PointCloud2> ("/laser_cloud_less_flat", 5, laserCloudLessFlatHandler);
+  ros::Subscriber subLaserCloudFullRes = nh.subscribe<sensor_msgs::PointCloud2> ("/velodyne_cloud_2", 5, laserCloudFullResHandler);
   ros::Subscriber subImuTrans = nh.subscribe<sensor_msgs::PointCloud2> ("/imu_trans", 5, imuTransHandler);
 
   // declare Publisher
-  ros::Publisher pubLaserCloudCornerLast = nh.advertise<sensor_msgs::PointCloud2> ("/laser_cloud_corner_last", 2);
-  ros::Publisher pubLaserCloudSurfLast = nh.advertise<sensor_msgs::PointCloud2> ("/laser_cloud_surf_last", 2);
-  ros::Publisher pubLaserCloudFullRes = nh.advertise<sensor_msgs::PointCloud2> ("/velodyne_cloud_3", 2);
+  pubLaserCloudCornerLast = nh.advertise<sensor_msgs::PointCloud2> ("/laser_cloud_corner_last", 2);
+  pubLaserCloudSurfLast = nh.advertise<sensor_msgs::PointCloud2> ("/laser_cloud_surf_last", 2);
+  pubLaserCloudFullRes = nh.advertise<sensor_msgs::PointCloud2> ("/velodyne_cloud_3", 2);
   ros::Publisher pubLaserOdometry = nh.advertise<nav_msgs::Odometry> ("/laser_odom_to_init", 5);
+  ros::Publisher pubSolverStats = nh.advertise<loam_velodyne::SolverStats> ("/laser_odom_solver_stats", 5);
 
   nav_msgs::Odometry laserOdometry;
   laserOdometry.header.frame_id = "/velodyne";
@@ -388,31 +545,57 @@ int main(int argc, char** argv)
 
   std::vector<int> pointSearchInd;
   std::vector<float> pointSearchSqDis;
+  std::vector<int> indices;
 
   PointType pointOri, pointSel, tripod1, tripod2, tripod3, pointProj, coeff;
 
   bool isDegenerate = false;
   cv::Mat matP(6, 6, CV_32F, cv::Scalar::all(0));
+  SolverBuffers solver;
+
+  ProfileManager profiles(nh, nhPrivate, "laserOdometry");
+  PipelineProfile profile = profiles.current();
+  skipFrameNum = profile.skipFrameNum;
 
   int frameCount = skipFrameNum;
-  ros::Rate rate(100);
-  bool status = ros::ok();
-  while (status) {
-    ros::spinOnce();
-
-    if (newCornerPointsSharp && newCornerPointsLessSharp && newSurfPointsFlat && 
-        newSurfPointsLessFlat && newLaserCloudFullRes && newImuTrans &&
-        fabs(timeCornerPointsSharp - timeSurfPointsLessFlat) < 0.005 &&
-        fabs(timeCornerPointsLessSharp - timeSurfPointsLessFlat) < 0.005 &&
-        fabs(timeSurfPointsFlat - timeSurfPointsLessFlat) < 0.005 &&
-        fabs(timeLaserCloudFullRes - timeSurfPointsLessFlat) < 0.005 &&
-        fabs(timeImuTrans - timeSurfPointsLessFlat) < 0.005) {
-      newCornerPointsSharp = false;
-      newCornerPointsLessSharp = false;
-      newSurfPointsFlat = false;
-      newSurfPointsLessFlat = false;
-      newLaserCloudFullRes = false;
-      newImuTrans = false;
+
+  // odometry is frame to frame, by default every sweep is processed as long as it keeps up
+  std::string framePolicyName;
+  int frameQueueSize;
+  nhPrivate.param<std::string>("frame_policy", framePolicyName, "bounded");
+  nhPrivate.param("frame_queue_size", frameQueueSize, 2);
+  FramePolicy framePolicy;
+  if (!parseFramePolicy(framePolicyName, framePolicy)) {
+    ROS_WARN("laserOdometry: unknown frame_policy %s, using bounded", framePolicyName.c_str());
+    framePolicy = FramePolicy::Bounded;
+  }
+  frameSync.configure(framePolicy, frameQueueSize);
+
+  LOAM_TELEMETRY_REPORTER(nh, nhPrivate, "ncrl_laserOdometry");
+  LOAM_TRACE_WRITER(nh, nhPrivate, "ncrl_laserOdometry");
+
+  // callbacks run on the spinner thread, the sweep is processed here as soon as it is complete
+  ros::AsyncSpinner spinner(1);
+  spinner.start();
+  std::thread worker(postSolveWorker);
+  OdometryFrame frame;
+  while (ros::ok()) {
+    // the timeout only bounds the shutdown latency, frames wake the loop immediately
+    if (frameSync.pop(frame, timeSweep, std::chrono::milliseconds(100))) {
+      cornerPointsSharp = frame.cornerPointsSharp;
+      cornerPointsLessSharp = frame.cornerPointsLessSharp;
+      surfPointsFlat = frame.surfPointsFlat;
+      surfPointsLessFlat = frame.surfPointsLessFlat;
+      laserCloudFullRes = frame.laserCloudFullRes;
+      imuTrans = frame.imuTrans;
+      ros::WallTime timeFrameStart = ros::WallTime::now();
+
+      // a profile switch takes effect at a sweep boundary
+      profile = profiles.current();
+      skipFrameNum = profile.skipFrameNum;
+
+      readImuTrans();
+      LOAM_TRACE_SWEEP(timeSweep);
 
       if (!systemInited) {
         pcl::PointCloud<PointType>::Ptr laserCloudTemp = cornerPointsLessSharp;
@@ -428,13 +611,13 @@ int main(int argc, char** argv)
 
         sensor_msgs::PointCloud2 laserCloudCornerLast2;
         pcl::toROSMsg(*laserCloudCornerLast, laserCloudCornerLast2);
-        laserCloudCornerLast2.header.stamp = ros::Time().fromSec(timeSurfPointsLessFlat);
+        laserCloudCornerLast2.header.stamp = ros::Time().fromSec(timeSweep);
         laserCloudCornerLast2.header.frame_id = "/velodyne";
         pubLaserCloudCornerLast.publish(laserCloudCornerLast2);
 
         sensor_msgs::PointCloud2 laserCloudSurfLast2;
         pcl::toROSMsg(*laserCloudSurfLast, laserCloudSurfLast2);
-        laserCloudSurfLast2.header.stamp = ros::Time().fromSec(timeSurfPointsLessFlat);
+        laserCloudSurfLast2.header.stamp = ros::Time().fromSec(timeSweep);
         laserCloudSurfLast2.header.frame_id = "/velodyne";
         pubLaserCloudSurfLast.publish(laserCloudSurfLast2);
 
@@ -445,6 +628,9 @@ int main(int argc, char** argv)
         continue;
       }
 
+      // the reference clouds of the previous sweep are built by the worker
+      waitPostSolve();
+
       laserCloudOri->clear();
       coeffSel->clear();
 
@@ -452,17 +638,23 @@ int main(int argc, char** argv)
       transform[4] -= imuVeloFromStartY * scanPeriod;
       transform[5] -= imuVeloFromStartZ * scanPeriod;
 
+      loam_velodyne::SolverStats solverStats;
+      solverStats.max_iterations = profile.odometryMaxIterations;
+
       if (laserCloudCornerLastNum > 10 && laserCloudSurfLastNum > 100) {
-        std::vector<int> indices;
+        LOAM_ALLOC_SCOPE(OdometrySolve);
         pcl::removeNaNFromPointCloud(*cornerPointsSharp,*cornerPointsSharp, indices);
         int cornerPointsSharpNum = cornerPointsSharp->points.size();
         int surfPointsFlatNum = surfPointsFlat->points.size();
-        for (int iterCount = 0; iterCount < 25; iterCount++) {
+        LOAM_SPAN_DEFER(OdomCorrespondence);
+        LOAM_SPAN_DEFER(OdomSolve);
+        for (int iterCount = 0; iterCount < profile.odometryMaxIterations; iterCount++) {
+          solverStats.iterations = iterCount + 1;
+          LOAM_SPAN_RESUME(OdomCorrespondence);
           for (int i = 0; i < cornerPointsSharpNum; i++) {
             TransformToStart(&cornerPointsSharp->points[i], &pointSel);
 
             if (iterCount % 5 == 0) {
-              std::vector<int> indices;
               pcl::removeNaNFromPointCloud(*laserCloudCornerLast,*laserCloudCornerLast, indices);
  
               kdtreeCornerLast->nearestKSearch(pointSel, 1, pointSearchInd, pointSearchSqDis);
@@ -470,11 +662,11 @@ int main(int argc, char** argv)
               int closestPointInd = -1, minPointInd2 = -1;
               if (pointSearchSqDis[0] < 25) {
                 closestPointInd = pointSearchInd[0];
-                int closestPointScan = int(laserCloudCornerLast->points[closestPointInd].intensity);
+                int closestPointScan = laserCloudCornerLast->points[closestPointInd].ring;
 
                 float pointSqDis, minPointSqDis2 = 25;
                 for (int j = closestPointInd + 1; j < cornerPointsSharpNum; j++) {
-                  if (int(laserCloudCornerLast->points[j].intensity) > closestPointScan + 2.5) {
+                  if (laserCloudCornerLast->points[j].ring > closestPointScan + 2.5) {
                     break;
                   }
 
@@ -485,7 +677,7 @@ int main(int argc, char** argv)
                                (laserCloudCornerLast->points[j].z - pointSel.z) * 
                                (laserCloudCornerLast->points[j].z - pointSel.z);
 
-                  if (int(laserCloudCornerLast->points[j].intensity) > closestPointScan) {
+                  if (laserCloudCornerLast->points[j].ring > closestPointScan) {
                     if (pointSqDis < minPointSqDis2) {
                       minPointSqDis2 = pointSqDis;
                       minPointInd2 = j;
@@ -493,7 +685,7 @@ int main(int argc, char** argv)
                   }
                 }
                 for (int j = closestPointInd - 1; j >= 0; j--) {
-                  if (int(laserCloudCornerLast->points[j].intensity) < closestPointScan - 2.5) {
+                  if (laserCloudCornerLast->points[j].ring < closestPointScan - 2.5) {
                     break;
                   }
 
@@ -504,7 +696,7 @@ int main(int argc, char** argv)
                                (laserCloudCornerLast->points[j].z - pointSel.z) * 
                                (laserCloudCornerLast->points[j].z - pointSel.z);
 
-                  if (int(laserCloudCornerLast->points[j].intensity) < closestPointScan) {
+                  if (laserCloudCornerLast->points[j].ring < closestPointScan) {
                     if (pointSqDis < minPointSqDis2) {
                       minPointSqDis2 = pointSqDis;
                       minPointInd2 = j;
@@ -582,11 +774,11 @@ int main(int argc, char** argv)
               int closestPointInd = -1, minPointInd2 = -1, minPointInd3 = -1;
               if (pointSearchSqDis[0] < 25) {
                 closestPointInd = pointSearchInd[0];
-                int closestPointScan = int(laserCloudSurfLast->points[closestPointInd].intensity);
+                int closestPointScan = laserCloudSurfLast->points[closestPointInd].ring;
 
                 float pointSqDis, minPointSqDis2 = 25, minPointSqDis3 = 25;
                 for (int j = closestPointInd + 1; j < surfPointsFlatNum; j++) {
-                  if (int(laserCloudSurfLast->points[j].intensity) > closestPointScan + 2.5) {
+                  if (laserCloudSurfLast->points[j].ring > closestPointScan + 2.5) {
                     break;
                   }
 
@@ -597,7 +789,7 @@ int main(int argc, char** argv)
                                (laserCloudSurfLast->points[j].z - pointSel.z) * 
                                (laserCloudSurfLast->points[j].z - pointSel.z);
 
-                  if (int(laserCloudSurfLast->points[j].intensity) <= closestPointScan) {
+                  if (laserCloudSurfLast->points[j].ring <= closestPointScan) {
                      if (pointSqDis < minPointSqDis2) {
                        minPointSqDis2 = pointSqDis;
                        minPointInd2 = j;
@@ -610,7 +802,7 @@ int main(int argc, char** argv)
                   }
                 }
                 for (int j = closestPointInd - 1; j >= 0; j--) {
-                  if (int(laserCloudSurfLast->points[j].intensity) < closestPointScan - 2.5) {
+                  if (laserCloudSurfLast->points[j].ring < closestPointScan - 2.5) {
                     break;
                   }
 
@@ -621,7 +813,7 @@ int main(int argc, char** argv)
                                (laserCloudSurfLast->points[j].z - pointSel.z) * 
                                (laserCloudSurfLast->points[j].z - pointSel.z);
 
-                  if (int(laserCloudSurfLast->points[j].intensity) >= closestPointScan) {
+                  if (laserCloudSurfLast->points[j].ring >= closestPointScan) {
                     if (pointSqDis < minPointSqDis2) {
                       minPointSqDis2 = pointSqDis;
                       minPointInd2 = j;
@@ -685,19 +877,22 @@ int main(int argc, char** argv)
           }
 
           int pointSelNum = laserCloudOri->points.size();
+          LOAM_SPAN_PAUSE(OdomCorrespondence);
           if (pointSelNum < 10) {
             continue;
           }
 
-          cv::Mat matA(pointSelNum, 6, CV_32F, cv::Scalar::all(0));
-          cv::Mat matAt(6, pointSelNum, CV_32F, cv::Scalar::all(0));
-          cv::Mat matAtA(6, 6, CV_32F, cv::Scalar::all(0));
-          cv::Mat matB(pointSelNum, 1, CV_32F, cv::Scalar::all(0));
-          cv::Mat matAtB(6, 1, CV_32F, cv::Scalar::all(0));
-          cv::Mat matX(6, 1, CV_32F, cv::Scalar::all(0));
+          LOAM_SPAN_RESUME(OdomSolve);
+          solver.resize(pointSelNum);
+          cv::Mat &matA = solver.matA;
+          cv::Mat &matB = solver.matB;
+          cv::Mat &matAtA = solver.matAtA;
+          cv::Mat &matX = solver.matX;
+          float residualSqSum = 0;
           for (int i = 0; i < pointSelNum; i++) {
             pointOri = laserCloudOri->points[i];
             coeff = coeffSel->points[i];
+            residualSqSum += coeff.intensity * coeff.intensity;
 
             float s = 1;
 
@@ -752,18 +947,21 @@ int main(int argc, char** argv)
             matA.at<float>(i, 5) = atz;
             matB.at<float>(i, 0) = -0.05 * d2;
           }
-          cv::transpose(matA, matAt);
-          matAtA = matAt * matA;
-          matAtB = matAt * matB;
-          cv::solve(matAtA, matAtB, matX, cv::DECOMP_QR);
+          solver.solve();
+          solverStats.inliers = pointSelNum;
+          solverStats.residual_rms = sqrt(residualSqSum / pointSelNum);
 
           if (iterCount == 0) {
-            cv::Mat matE(1, 6, CV_32F, cv::Scalar::all(0));
-            cv::Mat matV(6, 6, CV_32F, cv::Scalar::all(0));
-            cv::Mat matV2(6, 6, CV_32F, cv::Scalar::all(0));
+            cv::Mat &matE = solver.matE;
+            cv::Mat &matV = solver.matV;
+            cv::Mat &matV2 = solver.matV2;
 
             cv::eigen(matAtA, matE, matV);
             matV.copyTo(matV2);
+            // cv::eigen sorts descending
+            for (int i = 0; i < 6; i++) {
+              solverStats.eigenvalues[i] = matE.at<float>(0, 5 - i);
+            }
 
             isDegenerate = false;
             float eignThre[6] = {10, 10, 10, 10, 10, 10};
@@ -777,11 +975,12 @@ int main(int argc, char** argv)
                 break;
               }
             }
-            matP = matV.inv() * matV2;
+            cv::invert(matV, solver.matVInv);
+            matP = solver.matVInv * matV2;
           }
 
           if (isDegenerate) {
-            cv::Mat matX2(6, 1, CV_32F, cv::Scalar::all(0));
+            cv::Mat &matX2 = solver.matX2;
             matX.copyTo(matX2);
             matX = matP * matX2;
           }
@@ -811,7 +1010,9 @@ int main(int argc, char** argv)
                               pow(matX.at<float>(4, 0) * 100, 2) +
                               pow(matX.at<float>(5, 0) * 100, 2));
 
+          LOAM_SPAN_PAUSE(OdomSolve);
           if (deltaR < 0.1 && deltaT < 0.1) {
+            solverStats.converged = true;
             break;
           }
         }
@@ -845,9 +1046,10 @@ int main(int argc, char** argv)
       transformSum[4] = ty;
       transformSum[5] = tz;
 
+      LOAM_SPAN_BEGIN(Publish);
       geometry_msgs::Quaternion geoQuat = tf::createQuaternionMsgFromRollPitchYaw(rz, -rx, -ry);
 
-      laserOdometry.header.stamp = ros::Time().fromSec(timeSurfPointsLessFlat);
+      laserOdometry.header.stamp = ros::Time().fromSec(timeSweep);
       laserOdometry.pose.pose.orientation.x = -geoQuat.y;
       laserOdometry.pose.pose.orientation.y = -geoQuat.z;
       laserOdometry.pose.pose.orientation.z = geoQuat.x;
@@ -857,72 +1059,62 @@ int main(int argc, char** argv)
       laserOdometry.pose.pose.position.z = tz;
       pubLaserOdometry.publish(laserOdometry);
 
-      laserOdometryTrans.stamp_ = ros::Time().fromSec(timeSurfPointsLessFlat);
+      laserOdometryTrans.stamp_ = ros::Time().fromSec(timeSweep);
       laserOdometryTrans.setRotation(tf::Quaternion(-geoQuat.y, -geoQuat.z, geoQuat.x, geoQuat.w));
       laserOdometryTrans.setOrigin(tf::Vector3(tx, ty, tz));
       tfBroadcaster.sendTransform(laserOdometryTrans);
-
-      int cornerPointsLessSharpNum = cornerPointsLessSharp->points.size();
-      for (int i = 0; i < cornerPointsLessSharpNum; i++) {
-        TransformToEnd(&cornerPointsLessSharp->points[i], &cornerPointsLessSharp->points[i]);
-      }
-
-      int surfPointsLessFlatNum = surfPointsLessFlat->points.size();
-      for (int i = 0; i < surfPointsLessFlatNum; i++) {
-        TransformToEnd(&surfPointsLessFlat->points[i], &surfPointsLessFlat->points[i]);
+      LOAM_SPAN_END(Publish);
+
+      solverStats.header.stamp = ros::Time().fromSec(timeSweep);
+      solverStats.degenerate = solverStats.inliers > 0 && isDegenerate;
+      solverStats.processing_time = (ros::WallTime::now() - timeFrameStart).toSec();
+      pubSolverStats.publish(solverStats);
+      ROS_DEBUG("laserOdometry: sweep %.3f published after %.1f ms",
+                timeSweep, (ros::Time::now().toSec() - timeSweep) * 1000);
+
+      // odometry is out, reproject and index this sweep off the critical path
+      PostSolveJob job;
+      for (int i = 0; i < 6; i++) {
+        job.end.transform[i] = transform[i];
       }
+      job.end.imuRollStart = imuRollStart;
+      job.end.imuPitchStart = imuPitchStart;
+      job.end.imuYawStart = imuYawStart;
+      job.end.imuRollLast = imuRollLast;
+      job.end.imuPitchLast = imuPitchLast;
+      job.end.imuYawLast = imuYawLast;
+      job.end.imuShiftFromStartX = imuShiftFromStartX;
+      job.end.imuShiftFromStartY = imuShiftFromStartY;
+      job.end.imuShiftFromStartZ = imuShiftFromStartZ;
+      job.cornerPointsLessSharp = cornerPointsLessSharp;
+      job.surfPointsLessFlat = surfPointsLessFlat;
+      job.laserCloudFullRes = laserCloudFullRes;
+      job.timeSweep = timeSweep;
 
       frameCount++;
-      if (frameCount >= skipFrameNum + 1) {
-        int laserCloudFullResNum = laserCloudFullRes->points.size();
-        for (int i = 0; i < laserCloudFullResNum; i++) {
-          TransformToEnd(&laserCloudFullRes->points[i], &laserCloudFullRes->points[i]);
-        }
-      }
-
-      pcl::PointCloud<PointType>::Ptr laserCloudTemp = cornerPointsLessSharp;
-      cornerPointsLessSharp = laserCloudCornerLast;
-      laserCloudCornerLast = laserCloudTemp;
-
-      laserCloudTemp = surfPointsLessFlat;
-      surfPointsLessFlat = laserCloudSurfLast;
-      laserCloudSurfLast = laserCloudTemp;
-
-      laserCloudCornerLastNum = laserCloudCornerLast->points.size();
-      laserCloudSurfLastNum = laserCloudSurfLast->points.size();
-      if (laserCloudCornerLastNum > 10 && laserCloudSurfLastNum > 100) {
-
-        kdtreeCornerLast->setInputCloud(laserCloudCornerLast);
-        kdtreeSurfLast->setInputCloud(laserCloudSurfLast);
-
-      }
-
+      job.publishClouds = false;
       if (frameCount >= skipFrameNum + 1) {
         frameCount = 0;
-
-        sensor_msgs::PointCloud2 laserCloudCornerLast2;
-        pcl::toROSMsg(*laserCloudCornerLast, laserCloudCornerLast2);
-        laserCloudCornerLast2.header.stamp = ros::Time().fromSec(timeSurfPointsLessFlat);
-        laserCloudCornerLast2.header.frame_id = "/camera";
-        pubLaserCloudCornerLast.publish(laserCloudCornerLast2);
-
-        sensor_msgs::PointCloud2 laserCloudSurfLast2;
-        pcl::toROSMsg(*laserCloudSurfLast, laserCloudSurfLast2);
-        laserCloudSurfLast2.header.stamp = ros::Time().fromSec(timeSurfPointsLessFlat);
-        laserCloudSurfLast2.header.frame_id = "/camera";
-        pubLaserCloudSurfLast.publish(laserCloudSurfLast2);
-
-        sensor_msgs::PointCloud2 laserCloudFullRes3;
-        pcl::toROSMsg(*laserCloudFullRes, laserCloudFullRes3);
-        laserCloudFullRes3.header.stamp = ros::Time().fromSec(timeSurfPointsLessFlat);
-        laserCloudFullRes3.header.frame_id = "/camera";
-        pubLaserCloudFullRes.publish(laserCloudFullRes3);
+        job.publishClouds = true;
       }
+      submitPostSolve(job);
     }
 
-    status = ros::ok();
-    rate.sleep();
+    FrameCounters counters = frameSync.counters();
+    ROS_DEBUG_THROTTLE(10.0, "laserOdometry: sweeps received %lu processed %lu dropped %lu superseded %lu",
+                       counters.received, counters.processed, counters.dropped, counters.superseded);
+  }
+
+  FrameCounters counters = frameSync.counters();
+  ROS_INFO("laserOdometry: sweeps received %lu processed %lu dropped %lu superseded %lu",
+           counters.received, counters.processed, counters.dropped, counters.superseded);
+
+  {
+    std::lock_guard<std::mutex> lock(mWorker);
+    workerQuit = true;
+    workerCond.notify_all();
   }
+  worker.join();
 
   return 0;
 }
@@ -31,11 +31,21 @@
      Robotics: Science and Systems Conference (RSS). Berkeley, CA, July 2014.
 */
 #include <ros/ros.h>
+#include <loam_velodyne/alloc_counter.h>
 #include <loam_velodyne/common.h>
+#include <loam_velodyne/FeatureBudget.h>
+#include <loam_velodyne/profile.h>
+#include <loam_velodyne/SolverStats.h>
+#include <loam_velodyne/telemetry.h>
+#include <loam_velodyne/voxel_filter.h>
 #include <vector>
+#include <algorithm>
 #include <opencv/cv.h>
 #include <eigen3/Eigen/Dense>
 #include <string>
+#include <cstdio>
+#include <ctime>
+#include <sys/stat.h>
 
 #include <nav_msgs/Odometry.h>
 #include <geometry_msgs/PoseStamped.h>
@@ -45,7 +55,7 @@
 #include <pcl_conversions/pcl_conversions.h>
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
-#include <pcl/filters/voxel_grid.h>
+#include <pcl/filters/filter.h>
 #include <pcl/kdtree/kdtree_flann.h>
 
 #include <sensor_msgs/Imu.h>
@@ -76,8 +86,71 @@ float avg_x_imu = 0, avg_y_imu = 0, avg_z_imu = 0;
 int count_imu = 0;
 // declare imu calibrate
 
+// persisted imu bias, reloaded on restart so the calibration and systemDelay are skipped.
+// A file older than biasMaxAge or with a component above biasMax is ignored and the bias is
+// calibrated again; a refined bias above biasMax is not saved
+std::string biasFile;
+double biasMaxAge = 86400;   // s, 0 accepts any age
+double biasMax = 1.0;        // m/s^2 per axis, includes the tilt of the calibration pose
+// online bias refinement : low-pass the residual acceleration while the platform is at rest.
+// The per sample test also passes at constant velocity and under gentle acceleration, so the
+// imu has to pass it for stationaryWindow and the laser odometry has to report no motion over
+// the same window
+const float biasRefineRate = 0.001;
+const float stationaryGyroThre = 0.05;  // rad/s
+const float stationaryAccThre = 0.2;    // m/s^2 away from gravity
+const double stationaryWindow = 1.0;    // s
+const double stationarySpeedThre = 0.05;  // m/s of the laser odometry
+const double odometryTimeout = 0.5;     // s, older odometry does not count as at rest
+double imuStillSince = -1;     // stamp of the first imu sample of the current run at rest
+double odomStillSince = -1;    // stamp of the first odometry of the current run at rest
+double lastOdomTime = -1;
+geometry_msgs::Point lastOdomPosition;
+
 const int N_SCANS = 16;
 
+// feature budget : the nominal per sector counts are scaled to hold the downstream deadlines,
+// decreased multiplicatively when odometry or mapping runs late, increased slowly with headroom
+const int sectorNum = 6;
+const float curvatureThre = 0.1;
+const int sharpNumNominal = 2;
+const int lessSharpNumNominal = 20;
+const int flatNumNominal = 4;
+float lessFlatLeafSizeNominal = 0.2;   // from the active profile
+int sharpNum = sharpNumNominal;
+int lessSharpNum = lessSharpNumNominal;
+int flatNum = flatNumNominal;
+float lessFlatLeafSize = lessFlatLeafSizeNominal;
+
+// off by default, the nominal counts are the behaviour of the original pipeline
+bool adaptiveBudget = false;
+double budgetScale = 1.0, budgetScaleMin = 0.5, budgetScaleMax = 2.0;
+double odometryDeadline = 0.05, mappingDeadline = 0.1;
+double odometryLatency = 0, mappingLatency = 0;
+// the budget holds until both stages reported, a missing stage is not headroom
+bool odometryStatsReceived = false, mappingStatsReceived = false;
+const double latencyFilterRate = 0.3;
+
+ProfileManager *profiles = NULL;
+
+// reused by every ring of every sweep
+VoxelFilter<PointType> lessFlatFilter;
+
+// per sweep buffers of cb_laserCloud, cleared instead of reallocated so their capacity carries
+// over from sweep to sweep
+std::vector<int> scanStartInd(N_SCANS, 0);
+std::vector<int> scanEndInd(N_SCANS, 0);
+pcl::PointCloud<pcl::PointXYZI> laserCloudIn;
+std::vector<int> nanIndices;
+std::vector<pcl::PointCloud<PointType> > laserCloudScans(N_SCANS);
+pcl::PointCloud<PointType>::Ptr laserCloud(new pcl::PointCloud<PointType>());
+pcl::PointCloud<PointType> cornerPointsSharp;
+pcl::PointCloud<PointType> cornerPointsLessSharp;
+pcl::PointCloud<PointType> surfPointsFlat;
+pcl::PointCloud<PointType> surfPointsLessFlat;
+pcl::PointCloud<PointType> surfPointsLessFlatScan;
+pcl::PointCloud<pcl::PointXYZ> imuTrans(4, 1);
+
 float cloudCurvature[40000];
 int cloudSortInd[40000];
 int cloudNeighborPicked[40000];
@@ -122,6 +195,7 @@ ros::Publisher pubCornerPointsLessSharp;
 ros::Publisher pubSurfPointsFlat;
 ros::Publisher pubSurfPointsLessFlat;
 ros::Publisher pubImuTrans;
+ros::Publisher pubFeatureBudget;
 
 void ShiftToStartIMU(float pointTime)
 {
@@ -275,7 +349,7 @@ void AccumulateIMUShift()
   accY     = sin(yaw)*x2 + cos(yaw)*y2;
   accZ     = z2;
 
-  printf ("world frame : x : %f\t y : %f\t z : %f\n",accX,accY,accZ);
+  ROS_DEBUG("world frame : x : %f\t y : %f\t z : %f",accX,accY,accZ);
 
   // imuPointerBack means number n-2 when n data received
   int imuPointerBack = (imuPointerLast + imuQueLength - 1) % imuQueLength;
@@ -296,6 +370,101 @@ void AccumulateIMUShift()
   }
 }
 
+bool plausibleImuBias(float bx, float by, float bz)
+{
+  return fabs(bx) <= biasMax && fabs(by) <= biasMax && fabs(bz) <= biasMax;
+}
+
+bool loadImuBias(const std::string& file)
+{
+  struct stat info;
+  if (stat(file.c_str(), &info) != 0) {
+    return false;
+  }
+  double age = difftime(time(NULL), info.st_mtime);
+  if (biasMaxAge > 0 && age > biasMaxAge) {
+    ROS_WARN("imu bias in %s is %.0f s old, calibrating again", file.c_str(), age);
+    return false;
+  }
+  FILE *fp = fopen(file.c_str(), "r");
+  if (fp == NULL) {
+    return false;
+  }
+  float bx, by, bz;
+  int num = fscanf(fp, "%f %f %f", &bx, &by, &bz);
+  fclose(fp);
+  // the comparisons are false for nan
+  if (num != 3 || !plausibleImuBias(bx, by, bz)) {
+    ROS_WARN("imu bias in %s is not usable, calibrating again", file.c_str());
+    return false;
+  }
+  bias_x = bx;
+  bias_y = by;
+  bias_z = bz;
+  return true;
+}
+
+bool saveImuBias(const std::string& file)
+{
+  if (!plausibleImuBias(bias_x, bias_y, bias_z)) {
+    ROS_WARN("imu bias %f %f %f out of range, not saved", bias_x, bias_y, bias_z);
+    return false;
+  }
+  // write to a temporary file and rename, so a crash never leaves a truncated bias file
+  std::string tmpFile = file + ".tmp";
+  FILE *fp = fopen(tmpFile.c_str(), "w");
+  if (fp == NULL) {
+    return false;
+  }
+  fprintf(fp, "%.9f %.9f %.9f\n", bias_x, bias_y, bias_z);
+  bool ok = (fclose(fp) == 0);
+  return ok && rename(tmpFile.c_str(), file.c_str()) == 0;
+}
+
+void cb_odometryStats(const loam_velodyne::SolverStats::ConstPtr& stats)
+{
+  if (!odometryStatsReceived) {
+    odometryLatency = stats->processing_time;
+    odometryStatsReceived = true;
+  } else {
+    odometryLatency += latencyFilterRate * (stats->processing_time - odometryLatency);
+  }
+}
+
+void cb_mappingStats(const loam_velodyne::SolverStats::ConstPtr& stats)
+{
+  if (!mappingStatsReceived) {
+    mappingLatency = stats->processing_time;
+    mappingStatsReceived = true;
+  } else {
+    mappingLatency += latencyFilterRate * (stats->processing_time - mappingLatency);
+  }
+}
+
+// once per sweep, before the features are picked
+void updateFeatureBudget()
+{
+  if (profiles != NULL) {
+    lessFlatLeafSizeNominal = profiles->current().lessFlatLeafSize;
+  }
+
+  if (adaptiveBudget && odometryStatsReceived && mappingStatsReceived) {
+    double load = std::max(odometryLatency / odometryDeadline, mappingLatency / mappingDeadline);
+    if (load > 1.0) {
+      budgetScale *= 0.85;
+    } else if (load < 0.7) {
+      budgetScale *= 1.05;
+    }
+    budgetScale = std::min(std::max(budgetScale, budgetScaleMin), budgetScaleMax);
+  }
+
+  sharpNum = std::max(1, int(std::round(sharpNumNominal * budgetScale)));
+  lessSharpNum = std::max(sharpNum, int(std::round(lessSharpNumNominal * budgetScale)));
+  flatNum = std::max(1, int(std::round(flatNumNominal * budgetScale)));
+  // only coarsen under load, a finer grid than nominal does not help the mapping
+  lessFlatLeafSize = lessFlatLeafSizeNominal / std::min(budgetScale, 1.0);
+}
+
 void cb_laserCloud(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg)
 {
   // initial state is true to check that imu bias
@@ -309,17 +478,20 @@ void cb_laserCloud(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg)
       return;
     }
 
-    std::vector<int> scanStartInd(N_SCANS, 0);
-
-    std::vector<int> scanEndInd(N_SCANS, 0);
+    std::fill(scanStartInd.begin(), scanStartInd.end(), 0);
+    std::fill(scanEndInd.begin(), scanEndInd.end(), 0);
 
     // trans ros msg to pcl msg and remove useless point
+    LOAM_TRACE_SWEEP(laserCloudMsg->header.stamp.toSec());
+    LOAM_SPAN_BEGIN(Ingest);
     double timeScanCur = laserCloudMsg->header.stamp.toSec();
-    pcl::PointCloud<pcl::PointXYZ> laserCloudIn;
     pcl::fromROSMsg(*laserCloudMsg, laserCloudIn);
-    std::vector<int> indices;
-    pcl::removeNaNFromPointCloud(laserCloudIn, laserCloudIn, indices);
+    pcl::removeNaNFromPointCloud(laserCloudIn, laserCloudIn, nanIndices);
     int cloudSize = laserCloudIn.points.size();
+    LOAM_SPAN_END(Ingest);
+
+    LOAM_SPAN_BEGIN(Deskew);
+    LOAM_ALLOC_BEGIN(ScanFeatures);
 
     // caculate the start & end orientation ; atan2 count -pi to pi
     float startOri = -atan2(laserCloudIn.points[0].y, laserCloudIn.points[0].x);
@@ -334,7 +506,9 @@ void cb_laserCloud(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg)
     bool halfPassed = false;
     int count = cloudSize;
     PointType point;
-    std::vector<pcl::PointCloud<PointType> > laserCloudScans(N_SCANS); // 16 vector of pointcloud type
+    for (int i = 0; i < N_SCANS; i++) {
+      laserCloudScans[i].clear();
+    }
 
     //===================================
     for (int i = 0; i < cloudSize; i++) {
@@ -346,6 +520,7 @@ void cb_laserCloud(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg)
       point.x = laserCloudIn.points[i].x;
       point.y = laserCloudIn.points[i].y;
       point.z = laserCloudIn.points[i].z;
+      point.intensity = laserCloudIn.points[i].intensity;
 
       // classfy each point into 360 degree
       float angle = rad2deg( atan( point.z/ sqrt(pow(point.y,2)+pow(point.x,2)) ) );
@@ -390,8 +565,8 @@ void cb_laserCloud(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg)
 
       // caculate relative scan time based on point orientation
       float relTime = (ori - startOri) /(endOri - startOri);
-      // scanPeriod = 0.1 and means scanPeriod * relTime won't exceed 0.1
-      point.intensity = scanID + scanPeriod * relTime; // integer = scanID float = scan time
+      point.ring = scanID;
+      point.t = scanPeriod * relTime;
 
       // interact with imu
       //===================================
@@ -477,12 +652,14 @@ void cb_laserCloud(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg)
 
     cloudSize = count;
 
-    pcl::PointCloud<PointType>::Ptr laserCloud(new pcl::PointCloud<PointType>());
+    laserCloud->clear();
     // assign each ring into Point Cloud
     for (int i = 0; i < N_SCANS; i++) {
       *laserCloud += laserCloudScans[i];
     }
+    LOAM_SPAN_END(Deskew);
 
+    LOAM_SPAN_BEGIN(Curvature);
     int scanCount = -1;
     for (int i = 5; i < cloudSize - 5; i++) {
       // compare point i and other 10 points to caculate the smooth
@@ -511,8 +688,8 @@ void cb_laserCloud(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg)
       cloudNeighborPicked[i] = 0;
       cloudLabel[i] = 0;
 
-      if (int(laserCloud->points[i].intensity) != scanCount) {
-        scanCount = int(laserCloud->points[i].intensity);
+      if (laserCloud->points[i].ring != scanCount) {
+        scanCount = laserCloud->points[i].ring;
 
         if (scanCount > 0 && scanCount < N_SCANS) {
           scanStartInd[scanCount] = i + 5;
@@ -582,18 +759,20 @@ void cb_laserCloud(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg)
         cloudNeighborPicked[i] = 1;
       }
     }
+    LOAM_SPAN_END(Curvature);
 
-
-    pcl::PointCloud<PointType> cornerPointsSharp;
-    pcl::PointCloud<PointType> cornerPointsLessSharp;
-    pcl::PointCloud<PointType> surfPointsFlat;
-    pcl::PointCloud<PointType> surfPointsLessFlat;
+    LOAM_SPAN_BEGIN(FeaturePick);
+    updateFeatureBudget();
+    cornerPointsSharp.clear();
+    cornerPointsLessSharp.clear();
+    surfPointsFlat.clear();
+    surfPointsLessFlat.clear();
 
     for (int i = 0; i < N_SCANS; i++) {
-      pcl::PointCloud<PointType>::Ptr surfPointsLessFlatScan(new pcl::PointCloud<PointType>);
-      for (int j = 0; j < 6; j++) {
-        int sp = (scanStartInd[i] * (6 - j)  + scanEndInd[i] * j) / 6;
-        int ep = (scanStartInd[i] * (5 - j)  + scanEndInd[i] * (j + 1)) / 6 - 1;
+      surfPointsLessFlatScan.clear();
+      for (int j = 0; j < sectorNum; j++) {
+        int sp = (scanStartInd[i] * (sectorNum - j)  + scanEndInd[i] * j) / sectorNum;
+        int ep = (scanStartInd[i] * (sectorNum - 1 - j)  + scanEndInd[i] * (j + 1)) / sectorNum - 1;
 
         for (int k = sp + 1; k <= ep; k++) {
           for (int l = k; l >= sp + 1; l--) {
@@ -609,14 +788,14 @@ void cb_laserCloud(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg)
         for (int k = ep; k >= sp; k--) {
           int ind = cloudSortInd[k];
           if (cloudNeighborPicked[ind] == 0 &&
-              cloudCurvature[ind] > 0.1) {
+              cloudCurvature[ind] > curvatureThre) {
 
             largestPickedNum++;
-            if (largestPickedNum <= 2) {
+            if (largestPickedNum <= sharpNum) {
               cloudLabel[ind] = 2;
               cornerPointsSharp.push_back(laserCloud->points[ind]);
               cornerPointsLessSharp.push_back(laserCloud->points[ind]);
-            } else if (largestPickedNum <= 20) {
+            } else if (largestPickedNum <= lessSharpNum) {
               cloudLabel[ind] = 1;
               cornerPointsLessSharp.push_back(laserCloud->points[ind]);
             } else {
@@ -654,13 +833,13 @@ void cb_laserCloud(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg)
         for (int k = sp; k <= ep; k++) {
           int ind = cloudSortInd[k];
           if (cloudNeighborPicked[ind] == 0 &&
-              cloudCurvature[ind] < 0.1) {
+              cloudCurvature[ind] < curvatureThre) {
 
             cloudLabel[ind] = -1;
             surfPointsFlat.push_back(laserCloud->points[ind]);
 
             smallestPickedNum++;
-            if (smallestPickedNum >= 4) {
+            if (smallestPickedNum >= flatNum) {
               break;
             }
 
@@ -696,20 +875,20 @@ void cb_laserCloud(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg)
 
         for (int k = sp; k <= ep; k++) {
           if (cloudLabel[k] <= 0) {
-            surfPointsLessFlatScan->push_back(laserCloud->points[k]);
+            surfPointsLessFlatScan.push_back(laserCloud->points[k]);
           }
         }
       }
 
-      pcl::PointCloud<PointType> surfPointsLessFlatScanDS;
-      pcl::VoxelGrid<PointType> downSizeFilter;
-      downSizeFilter.setInputCloud(surfPointsLessFlatScan);
-      downSizeFilter.setLeafSize(0.2, 0.2, 0.2);
-      downSizeFilter.filter(surfPointsLessFlatScanDS);
+      lessFlatFilter.setLeafSize(lessFlatLeafSize, lessFlatLeafSize, lessFlatLeafSize);
+      lessFlatFilter.filter(surfPointsLessFlatScan, surfPointsLessFlatScan);
 
-      surfPointsLessFlat += surfPointsLessFlatScanDS;
+      surfPointsLessFlat += surfPointsLessFlatScan;
     }
+    LOAM_ALLOC_END(ScanFeatures);
+    LOAM_SPAN_END(FeaturePick);
 
+    LOAM_SPAN(Publish);
     sensor_msgs::PointCloud2 laserCloudOutMsg;
     pcl::toROSMsg(*laserCloud, laserCloudOutMsg);
     laserCloudOutMsg.header.stamp = laserCloudMsg->header.stamp;
@@ -740,7 +919,6 @@ void cb_laserCloud(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg)
     surfPointsLessFlat2.header.frame_id = "/velodyne";
     pubSurfPointsLessFlat.publish(surfPointsLessFlat2);
 
-    pcl::PointCloud<pcl::PointXYZ> imuTrans(4, 1);
     imuTrans.points[0].x = imuPitchStart;
     imuTrans.points[0].y = imuYawStart;
     imuTrans.points[0].z = imuRollStart;
@@ -762,6 +940,19 @@ void cb_laserCloud(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg)
     imuTransMsg.header.stamp = laserCloudMsg->header.stamp;
     imuTransMsg.header.frame_id = "/velodyne";
     pubImuTrans.publish(imuTransMsg);
+
+    loam_velodyne::FeatureBudget featureBudget;
+    featureBudget.header.stamp = laserCloudMsg->header.stamp;
+    featureBudget.sectors = sectorNum;
+    featureBudget.sharp_per_sector = sharpNum;
+    featureBudget.less_sharp_per_sector = lessSharpNum;
+    featureBudget.flat_per_sector = flatNum;
+    featureBudget.curvature_threshold = curvatureThre;
+    featureBudget.less_flat_leaf_size = lessFlatLeafSize;
+    featureBudget.scale = budgetScale;
+    featureBudget.odometry_latency = odometryLatency;
+    featureBudget.mapping_latency = mappingLatency;
+    pubFeatureBudget.publish(featureBudget);
   }
 }
 
@@ -794,6 +985,9 @@ void cb_imu(const sensor_msgs::Imu::ConstPtr& imuIn)
       count_imu += 1;
       ROS_INFO("---Finish---");
       state = false;
+      if (!biasFile.empty() && !saveImuBias(biasFile)) {
+        ROS_WARN("failed to save imu bias to %s", biasFile.c_str());
+      }
     }
   }
 
@@ -805,14 +999,35 @@ void cb_imu(const sensor_msgs::Imu::ConstPtr& imuIn)
     tf::quaternionMsgToTF(imuIn->orientation, orientation);
     tf::Matrix3x3(orientation).getRPY(roll, pitch, yaw);
 
-    printf("Roll : %f\t Pitch : %f\t Yaw : %f\n",roll,pitch,yaw);
+    ROS_DEBUG("Roll : %f\t Pitch : %f\t Yaw : %f",roll,pitch,yaw);
 
     // delete the gravity effect
     float accX = imuIn->linear_acceleration.x + sin(pitch)*cos(roll)*9.81 - bias_x;
     float accY = imuIn->linear_acceleration.y - sin(roll)*cos(pitch)*9.81 - bias_y;
     float accZ = imuIn->linear_acceleration.z - cos(roll)*cos(pitch)*9.81 - bias_z;
 
-    printf("acc x  : %f\t y : %f\t z : %f\n",accX,accY,accZ);
+    ROS_DEBUG("acc x  : %f\t y : %f\t z : %f",accX,accY,accZ);
+
+    // refine the bias in the background : at rest the residual acceleration is pure bias error
+    float gyroNorm = sqrt(pow(imuIn->angular_velocity.x,2) + pow(imuIn->angular_velocity.y,2)
+                        + pow(imuIn->angular_velocity.z,2));
+    float accNorm = sqrt(pow(imuIn->linear_acceleration.x,2) + pow(imuIn->linear_acceleration.y,2)
+                       + pow(imuIn->linear_acceleration.z,2));
+    double imuTimeCur = imuIn->header.stamp.toSec();
+    if (gyroNorm < stationaryGyroThre && fabs(accNorm - 9.81) < stationaryAccThre) {
+      if (imuStillSince < 0) {
+        imuStillSince = imuTimeCur;
+      }
+    } else {
+      imuStillSince = -1;
+    }
+    bool odomStill = odomStillSince >= 0 && lastOdomTime - odomStillSince >= stationaryWindow
+                  && imuTimeCur - lastOdomTime < odometryTimeout;
+    if (imuStillSince >= 0 && imuTimeCur - imuStillSince >= stationaryWindow && odomStill) {
+      bias_x += biasRefineRate * accX;
+      bias_y += biasRefineRate * accY;
+      bias_z += biasRefineRate * accZ;
+    }
 
     // initial imuPointerLast is -1  imuQueLength = 200
     imuPointerLast = (imuPointerLast + 1) % imuQueLength;
@@ -830,14 +1045,64 @@ void cb_imu(const sensor_msgs::Imu::ConstPtr& imuIn)
   }
 }
 
+// at rest for the bias refinement when the position changes less than stationarySpeedThre
+void cb_laserOdometry(const nav_msgs::Odometry::ConstPtr& odometry)
+{
+  double odomTime = odometry->header.stamp.toSec();
+  geometry_msgs::Point const& position = odometry->pose.pose.position;
+  if (lastOdomTime >= 0 && odomTime > lastOdomTime) {
+    double dx = position.x - lastOdomPosition.x;
+    double dy = position.y - lastOdomPosition.y;
+    double dz = position.z - lastOdomPosition.z;
+    double speed = sqrt(dx * dx + dy * dy + dz * dz) / (odomTime - lastOdomTime);
+    if (speed < stationarySpeedThre) {
+      if (odomStillSince < 0) {
+        odomStillSince = lastOdomTime;
+      }
+    } else {
+      odomStillSince = -1;
+    }
+  }
+  lastOdomTime = odomTime;
+  lastOdomPosition = position;
+}
+
 int main(int argc, char** argv)
 {
   //ros::init(argc, argv, "scanRegistration");
   ros::init(argc, argv, "ncrl_scanRegistration");
   ros::NodeHandle nh;
+  ros::NodeHandle nhPrivate("~");
+
+  // warm start : reuse the last bias and skip both the calibration and the startup delay
+  nhPrivate.param<std::string>("imu_bias_file", biasFile, "");
+  nhPrivate.param("imu_bias_max_age", biasMaxAge, biasMaxAge);
+  nhPrivate.param("imu_bias_max", biasMax, biasMax);
+  if (!biasFile.empty() && loadImuBias(biasFile)) {
+    ROS_INFO("loaded imu bias from %s : bias_x = %f, bias_y = %f, bias_z = %f",
+             biasFile.c_str(), bias_x, bias_y, bias_z);
+    state = false;
+    systemInited = true;
+  }
+
+  nhPrivate.param("adaptive_feature_budget", adaptiveBudget, false);
+  nhPrivate.param("odometry_deadline", odometryDeadline, 0.05);
+  nhPrivate.param("mapping_deadline", mappingDeadline, 0.1);
+  nhPrivate.param("feature_budget_scale_min", budgetScaleMin, 0.5);
+  nhPrivate.param("feature_budget_scale_max", budgetScaleMax, 2.0);
+
+  ProfileManager profileManager(nh, nhPrivate, "scanRegistration");
+  profiles = &profileManager;
+
   // declare subscriber
   ros::Subscriber subLaserCloud = nh.subscribe<sensor_msgs::PointCloud2> ("/velodyne_points", 2, cb_laserCloud);
   ros::Subscriber subImu = nh.subscribe<sensor_msgs::Imu> ("/imu/data", 50, cb_imu);
+  ros::Subscriber subLaserOdometry = nh.subscribe<nav_msgs::Odometry>
+                                     ("/laser_odom_to_init", 5, cb_laserOdometry);
+  ros::Subscriber subOdometryStats = nh.subscribe<loam_velodyne::SolverStats>
+                                     ("/laser_odom_solver_stats", 5, cb_odometryStats);
+  ros::Subscriber subMappingStats = nh.subscribe<loam_velodyne::SolverStats>
+                                    ("/aft_mapped_solver_stats", 5, cb_mappingStats);
   // declare publisher
   pubLaserCloud = nh.advertise<sensor_msgs::PointCloud2> ("/velodyne_cloud_2", 2);
   pubCornerPointsSharp = nh.advertise<sensor_msgs::PointCloud2> ("/laser_cloud_sharp", 2);
@@ -845,9 +1110,18 @@ int main(int argc, char** argv)
   pubSurfPointsFlat = nh.advertise<sensor_msgs::PointCloud2> ("/laser_cloud_flat", 2);
   pubSurfPointsLessFlat = nh.advertise<sensor_msgs::PointCloud2> ("/laser_cloud_less_flat", 2);
   pubImuTrans = nh.advertise<sensor_msgs::PointCloud2> ("/imu_trans", 5);
+  pubFeatureBudget = nh.advertise<loam_velodyne::FeatureBudget> ("/feature_budget", 5);
+
+  LOAM_TELEMETRY_REPORTER(nh, nhPrivate, "ncrl_scanRegistration");
+  LOAM_TRACE_WRITER(nh, nhPrivate, "ncrl_scanRegistration");
 
   ros::spin();
 
+  // keep the refined bias for the next start
+  if (!state && !biasFile.empty() && !saveImuBias(biasFile)) {
+    ROS_WARN("failed to save imu bias to %s", biasFile.c_str());
+  }
+
   return 0;
 }
 
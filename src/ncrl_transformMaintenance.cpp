@@ -33,7 +33,11 @@
 #include <cmath>
 
 #include <loam_velodyne/common.h>
+#include <loam_velodyne/GetPoseAtTime.h>
+#include <loam_velodyne/pose_history.h>
+#include <loam_velodyne/telemetry.h>
 #include <nav_msgs/Odometry.h>
+#include <sensor_msgs/Imu.h>
 #include <opencv/cv.h>
 #include <pcl_conversions/pcl_conversions.h>
 #include <pcl/point_cloud.h>
@@ -57,6 +61,33 @@ tf::TransformBroadcaster *tfBroadcaster2Pointer = NULL;
 nav_msgs::Odometry laserOdometry2;
 tf::StampedTransform laserOdometryTrans2;
 
+// high rate output : the last integrated pose is propagated with the imu orientation change
+// and the velocity between the last two odometry poses, re-anchored on every odometry or mapping update
+const int imuQueLength = 400;
+int imuPointerLast = -1;
+double imuTime[imuQueLength] = {0};
+tf::Quaternion imuOrientation[imuQueLength];
+
+bool systemInited = false;
+bool anchorInited = false;
+double timeAnchor = 0;
+tf::Quaternion anchorOrientation;
+tf::Vector3 anchorPosition;
+tf::Quaternion anchorImuOrientation;
+tf::Vector3 anchorVelocity(0, 0, 0);
+double timeLastOdometry = 0;
+tf::Vector3 lastOdometryPosition;
+
+double maxPropagationTime = 0.5;
+double imuLatencySum = 0, imuLatencyMax = 0;
+int imuLatencyCount = 0;
+
+ros::Publisher *pubImuOdometryPointer = NULL;
+nav_msgs::Odometry imuOdometry;
+
+// fused poses at odometry rate for pose-at-time queries, resized from the parameter in main
+PoseHistory poseHistory;
+
 void transformAssociateToMap()
 {
   float x1 = cos(transformSum[1]) * (transformBefMapped[3] - transformSum[3]) 
@@ -144,8 +175,65 @@ void transformAssociateToMap()
                      - (-sin(transformMapped[1]) * x2 + cos(transformMapped[1]) * z2);
 }
 
+// imu orientation at time t, interpolated from the queue
+bool imuOrientationAt(double t, tf::Quaternion &q)
+{
+  if (imuPointerLast < 0) {
+    return false;
+  }
+
+  int imuPointerFront = imuPointerLast;
+  for (int i = 0; i < imuQueLength - 1; i++) {
+    int imuPointerBack = (imuPointerFront + imuQueLength - 1) % imuQueLength;
+    if (imuTime[imuPointerBack] <= 0 || imuTime[imuPointerFront] <= t) {
+      break;
+    }
+    imuPointerFront = imuPointerBack;
+  }
+
+  int imuPointerBack = (imuPointerFront + imuQueLength - 1) % imuQueLength;
+  if (imuTime[imuPointerFront] <= t || imuTime[imuPointerBack] <= 0 || imuTime[imuPointerBack] > t) {
+    // newest sample is older than t, or t predates the queue
+    q = imuOrientation[imuPointerFront];
+    return fabs(imuTime[imuPointerFront] - t) < maxPropagationTime;
+  }
+
+  double ratio = (t - imuTime[imuPointerBack]) / (imuTime[imuPointerFront] - imuTime[imuPointerBack]);
+  q = imuOrientation[imuPointerBack].slerp(imuOrientation[imuPointerFront], ratio);
+  return true;
+}
+
+void setAnchor(double t, tf::Quaternion const &orientation, tf::Vector3 const &position, bool updateVelocity)
+{
+  // velocity only from consecutive odometry poses, mapping corrections are jumps, not motion
+  if (updateVelocity) {
+    double dt = t - timeLastOdometry;
+    if (timeLastOdometry > 0 && dt > 0 && dt < 1.0) {
+      anchorVelocity = (position - lastOdometryPosition) / dt;
+    } else {
+      anchorVelocity.setValue(0, 0, 0);
+    }
+    timeLastOdometry = t;
+    lastOdometryPosition = position;
+  }
+
+  tf::Quaternion imuQ;
+  if (!imuOrientationAt(t, imuQ)) {
+    anchorInited = false;
+    return;
+  }
+
+  timeAnchor = t;
+  anchorOrientation = orientation;
+  anchorPosition = position;
+  anchorImuOrientation = imuQ;
+  anchorInited = true;
+}
+
 void laserOdometryHandler(const nav_msgs::Odometry::ConstPtr& laserOdometry)
 {
+  LOAM_TRACE_SWEEP(laserOdometry->header.stamp.toSec());
+  LOAM_SPAN(Publish);
   double roll, pitch, yaw;
   geometry_msgs::Quaternion geoQuat = laserOdometry->pose.pose.orientation;
   tf::Matrix3x3(tf::Quaternion(geoQuat.z, -geoQuat.x, -geoQuat.y, geoQuat.w)).getRPY(roll, pitch, yaw);
@@ -177,9 +265,15 @@ void laserOdometryHandler(const nav_msgs::Odometry::ConstPtr& laserOdometry)
   laserOdometryTrans2.setRotation(tf::Quaternion(-geoQuat.y, -geoQuat.z, geoQuat.x, geoQuat.w));
   laserOdometryTrans2.setOrigin(tf::Vector3(transformMapped[3], transformMapped[4], transformMapped[5]));
   tfBroadcaster2Pointer->sendTransform(laserOdometryTrans2);
+
+  systemInited = true;
+  tf::Quaternion q(-geoQuat.y, -geoQuat.z, geoQuat.x, geoQuat.w);
+  tf::Vector3 p(transformMapped[3], transformMapped[4], transformMapped[5]);
+  poseHistory.push(laserOdometry->header.stamp.toSec(), q, p);
+  setAnchor(laserOdometry->header.stamp.toSec(), q, p, true);
 }
 
-void odomAftMappedHandler(const nav_msgs::Odometry::ConstPtr& odomAftMapped)
+void readOdomAftMapped(const nav_msgs::Odometry::ConstPtr& odomAftMapped)
 {
   double roll, pitch, yaw;
   geometry_msgs::Quaternion geoQuat = odomAftMapped->pose.pose.orientation;
@@ -202,6 +296,103 @@ void odomAftMappedHandler(const nav_msgs::Odometry::ConstPtr& odomAftMapped)
   transformBefMapped[5] = odomAftMapped->twist.twist.linear.z;
 }
 
+// re-anchor the high rate output on the corrected pose of the last odometry
+void reanchor()
+{
+  if (!systemInited) {
+    return;
+  }
+  transformAssociateToMap();
+
+  geometry_msgs::Quaternion geoQuat = tf::createQuaternionMsgFromRollPitchYaw
+                                      (transformMapped[2], -transformMapped[0], -transformMapped[1]);
+  tf::Quaternion q(-geoQuat.y, -geoQuat.z, geoQuat.x, geoQuat.w);
+  tf::Vector3 p(transformMapped[3], transformMapped[4], transformMapped[5]);
+  // replaces the history entry of the last odometry with its corrected pose
+  poseHistory.push(laserOdometry2.header.stamp.toSec(), q, p);
+  setAnchor(laserOdometry2.header.stamp.toSec(), q, p, false);
+}
+
+void odomAftMappedHandler(const nav_msgs::Odometry::ConstPtr& odomAftMapped)
+{
+  readOdomAftMapped(odomAftMapped);
+  reanchor();
+}
+
+void imuHandler(const sensor_msgs::Imu::ConstPtr& imuIn)
+{
+  double timeImu = imuIn->header.stamp.toSec();
+
+  imuPointerLast = (imuPointerLast + 1) % imuQueLength;
+  imuTime[imuPointerLast] = timeImu;
+  tf::quaternionMsgToTF(imuIn->orientation, imuOrientation[imuPointerLast]);
+
+  if (!anchorInited || timeImu < timeAnchor) {
+    return;
+  }
+  // bound the open-loop propagation, without fresh odometry the output stops
+  if (timeImu - timeAnchor > maxPropagationTime) {
+    ROS_WARN_THROTTLE(1.0, "transformMaintenance: no odometry for %.2f s, imu rate pose suspended",
+                      timeImu - timeAnchor);
+    return;
+  }
+
+  // rotation since the anchor in the imu body frame, expressed in the camera axes
+  // used by loam (x <- imu y, y <- imu z, z <- imu x)
+  tf::Quaternion dq = anchorImuOrientation.inverse() * imuOrientation[imuPointerLast];
+  tf::Quaternion dqCamera(dq.y(), dq.z(), dq.x(), dq.w());
+
+  double dt = timeImu - timeAnchor;
+  tf::Quaternion orientation = anchorOrientation * dqCamera;
+  orientation.normalize();
+  tf::Vector3 position = anchorPosition + anchorVelocity * dt;
+
+  imuOdometry.header.stamp = imuIn->header.stamp;
+  imuOdometry.pose.pose.orientation.x = orientation.x();
+  imuOdometry.pose.pose.orientation.y = orientation.y();
+  imuOdometry.pose.pose.orientation.z = orientation.z();
+  imuOdometry.pose.pose.orientation.w = orientation.w();
+  imuOdometry.pose.pose.position.x = position.x();
+  imuOdometry.pose.pose.position.y = position.y();
+  imuOdometry.pose.pose.position.z = position.z();
+  imuOdometry.twist.twist.linear.x = anchorVelocity.x();
+  imuOdometry.twist.twist.linear.y = anchorVelocity.y();
+  imuOdometry.twist.twist.linear.z = anchorVelocity.z();
+  pubImuOdometryPointer->publish(imuOdometry);
+
+  // latency from the imu stamp to the publication of the propagated pose
+  double latency = ros::Time::now().toSec() - timeImu;
+  imuLatencySum += latency;
+  imuLatencyCount++;
+  if (latency > imuLatencyMax) {
+    imuLatencyMax = latency;
+  }
+  if (imuLatencyCount >= 1000) {
+    ROS_DEBUG("transformMaintenance: imu rate pose latency mean %.2f ms max %.2f ms",
+              imuLatencySum / imuLatencyCount * 1000, imuLatencyMax * 1000);
+    imuLatencySum = 0;
+    imuLatencyMax = 0;
+    imuLatencyCount = 0;
+  }
+}
+
+bool getPoseAtTime(loam_velodyne::GetPoseAtTime::Request &req,
+                   loam_velodyne::GetPoseAtTime::Response &res)
+{
+  tf::Quaternion q;
+  tf::Vector3 p;
+  res.success = poseHistory.lookup(req.stamp.toSec(), q, p);
+  if (!res.success) {
+    return true;
+  }
+
+  res.pose.header.stamp = req.stamp;
+  res.pose.header.frame_id = "/camera_init";
+  tf::quaternionTFToMsg(q, res.pose.pose.orientation);
+  tf::pointTFToMsg(p, res.pose.pose.position);
+  return true;
+}
+
 int main(int argc, char** argv)
 {
   ros::init(argc, argv, "transformMaintenance");
@@ -213,6 +404,25 @@ int main(int argc, char** argv)
   ros::Subscriber subOdomAftMapped = nh.subscribe<nav_msgs::Odometry> 
                                      ("/aft_mapped_to_init", 5, odomAftMappedHandler);
 
+  ros::NodeHandle nhPrivate("~");
+  nhPrivate.param("max_propagation_time", maxPropagationTime, 0.5);
+  int poseHistorySize;
+  nhPrivate.param("pose_history_size", poseHistorySize, 2000);
+  poseHistory = PoseHistory(poseHistorySize > 1 ? poseHistorySize : 2);
+
+  LOAM_TELEMETRY_REPORTER(nh, nhPrivate, "ncrl_transformMaintenance");
+  LOAM_TRACE_WRITER(nh, nhPrivate, "ncrl_transformMaintenance");
+
+  ros::ServiceServer srvGetPoseAtTime = nh.advertiseService("/get_pose_at_time", getPoseAtTime);
+
+  ros::Subscriber subImu = nh.subscribe<sensor_msgs::Imu> ("/imu/data", 50, imuHandler,
+                                                           ros::TransportHints().tcpNoDelay());
+
+  ros::Publisher pubImuOdometry = nh.advertise<nav_msgs::Odometry> ("/integrated_to_init_imu", 50);
+  pubImuOdometryPointer = &pubImuOdometry;
+  imuOdometry.header.frame_id = "/camera_init";
+  imuOdometry.child_frame_id = "/camera";
+
   ros::Publisher pubLaserOdometry2 = nh.advertise<nav_msgs::Odometry> ("/integrated_to_init", 5);
   pubLaserOdometry2Pointer = &pubLaserOdometry2;
   laserOdometry2.header.frame_id = "/camera_init";
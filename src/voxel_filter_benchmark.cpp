@@ -0,0 +1,89 @@
+// Compares VoxelFilter with pcl::VoxelGrid at the point counts of the ncrl pipeline.
+// Built with -DLOAM_BENCHMARKS=ON, run without arguments.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include <pcl/filters/voxel_grid.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include <loam_velodyne/voxel_filter.h>
+
+typedef pcl::PointXYZI PointType;
+
+// ground plane and two walls with 2 cm noise inside an extent x extent box
+pcl::PointCloud<PointType>::Ptr makeCloud(size_t num, float extent, unsigned seed)
+{
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> uniform(-extent / 2, extent / 2);
+  std::normal_distribution<float> noise(0, 0.02);
+  pcl::PointCloud<PointType>::Ptr cloud(new pcl::PointCloud<PointType>());
+  cloud->points.reserve(num);
+  for (size_t i = 0; i < num; i++) {
+    PointType point;
+    float u = uniform(rng);
+    float v = uniform(rng);
+    switch (i % 3) {
+      case 0: point.x = u; point.y = -1.5 + noise(rng); point.z = v; break;
+      case 1: point.x = extent / 4 + noise(rng); point.y = v / 10; point.z = u; break;
+      default: point.x = u; point.y = v / 10; point.z = -extent / 4 + noise(rng); break;
+    }
+    point.intensity = i % 16 + 0.1 * (i % 10);
+    cloud->push_back(point);
+  }
+  return cloud;
+}
+
+template <typename Fn>
+double medianMs(int repeats, Fn fn)
+{
+  std::vector<double> times;
+  for (int r = 0; r < repeats; r++) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    fn();
+    times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+  }
+  std::sort(times.begin(), times.end());
+  return times[times.size() / 2];
+}
+
+int main()
+{
+  struct Case { const char *name; size_t points; float extent; float leaf; int repeats; };
+  const Case cases[] = {
+    {"less flat ring", 1500, 60, 0.2, 2000},
+    {"surf stack", 15000, 60, 0.4, 200},
+    {"valid cube", 60000, 50, 0.4, 50},
+    {"surround", 250000, 250, 0.2, 10},
+  };
+
+  printf("%-16s %8s %8s %12s %12s %12s\n", "case", "points", "voxels", "pcl ms", "centroid ms", "first ms");
+  for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    Case const &cs = cases[c];
+    pcl::PointCloud<PointType>::Ptr cloud = makeCloud(cs.points, cs.extent, c + 1);
+    pcl::PointCloud<PointType> output;
+
+    pcl::VoxelGrid<PointType> voxelGrid;
+    voxelGrid.setLeafSize(cs.leaf, cs.leaf, cs.leaf);
+    double pclMs = medianMs(cs.repeats, [&]{
+      voxelGrid.setInputCloud(cloud);
+      voxelGrid.filter(output);
+    });
+    size_t pclVoxels = output.points.size();
+
+    VoxelFilter<PointType> centroid(cs.leaf, VoxelFilter<PointType>::Centroid);
+    double centroidMs = medianMs(cs.repeats, [&]{ centroid.filter(*cloud, output); });
+    size_t voxels = output.points.size();
+
+    VoxelFilter<PointType> first(cs.leaf, VoxelFilter<PointType>::FirstPoint);
+    double firstMs = medianMs(cs.repeats, [&]{ first.filter(*cloud, output); });
+
+    printf("%-16s %8zu %8zu %12.3f %12.3f %12.3f%s\n", cs.name, cs.points, voxels,
+           pclMs, centroidMs, firstMs, voxels == pclVoxels ? "" : "  (voxel count differs from pcl)");
+  }
+  return 0;
+}
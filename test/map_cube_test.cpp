@@ -0,0 +1,220 @@
+// MapCube storage: quantization error of the stored points and intensities, voxel stability of
+// the running mean and of decoded points inserted again, intensity range handling.
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include <loam_velodyne/map_cube.h>
+
+typedef pcl::PointXYZI PointType;
+
+const float cubeSize = 50.0;
+const float lower = -25.0;   // lower corner of the cube around the origin
+const float step = cubeSize / 65535;
+
+PointType makePoint(float x, float y, float z, float intensity)
+{
+  PointType point;
+  point.x = x;
+  point.y = y;
+  point.z = z;
+  point.intensity = intensity;
+  return point;
+}
+
+// voxel index of a coordinate along one axis of the cube around the origin
+int voxelOf(float coordinate, float leafSize)
+{
+  return int(std::floor((coordinate - lower) / leafSize));
+}
+
+// voxel the cube bins a coordinate into, that of its quantized position
+int quantizedVoxelOf(float coordinate, float leafSize)
+{
+  int q = int(std::min(std::max((coordinate - lower) / step, 0.0f), 65535.0f) + 0.5f);
+  return int(q * step * (1.0f / leafSize));
+}
+
+bool lessXYZ(PointType const &a, PointType const &b)
+{
+  if (a.x != b.x) return a.x < b.x;
+  if (a.y != b.y) return a.y < b.y;
+  return a.z < b.z;
+}
+
+TEST(MapCube, DecodedPointsWithinHalfStep)
+{
+  // one point per voxel, away from the faces, so every stored point is the encoded input
+  const float leafSize = 0.5;
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<int> voxel(0, 99);
+  std::uniform_real_distribution<float> offset(0.1, 0.9);
+  std::uniform_real_distribution<float> intensity(0, 255);
+
+  MapCube<PointType> cube(leafSize, cubeSize);
+  std::vector<std::vector<PointType> > byVoxel(100 * 100 * 100);
+  for (int n = 0; n < 20000; n++) {
+    int i = voxel(rng), j = voxel(rng), k = voxel(rng);
+    std::vector<PointType> &inVoxel = byVoxel[i + 100 * (j + 100 * k)];
+    if (!inVoxel.empty()) {
+      continue;
+    }
+    PointType point = makePoint(lower + (i + offset(rng)) * leafSize, lower + (j + offset(rng)) * leafSize,
+                                lower + (k + offset(rng)) * leafSize, intensity(rng));
+    ASSERT_TRUE(cube.insert(point));
+    inVoxel.push_back(point);
+  }
+
+  pcl::PointCloud<PointType> decoded;
+  cube.appendTo(decoded);
+  ASSERT_EQ(cube.size(), decoded.points.size());
+  float maxError = 0;
+  float maxIntensityError = 0;
+  for (size_t p = 0; p < decoded.points.size(); p++) {
+    PointType const &point = decoded.points[p];
+    std::vector<PointType> const &inVoxel = byVoxel[voxelOf(point.x, leafSize) +
+                                                    100 * (voxelOf(point.y, leafSize) + 100 * voxelOf(point.z, leafSize))];
+    ASSERT_EQ(1u, inVoxel.size());
+    maxError = std::max(maxError, std::fabs(point.x - inVoxel[0].x));
+    maxError = std::max(maxError, std::fabs(point.y - inVoxel[0].y));
+    maxError = std::max(maxError, std::fabs(point.z - inVoxel[0].z));
+    maxIntensityError = std::max(maxIntensityError, std::fabs(point.intensity - inVoxel[0].intensity));
+  }
+  // half a step plus the float rounding of coordinates around 25 m
+  EXPECT_LE(maxError, step / 2 + 4e-6);
+  EXPECT_LE(maxIntensityError, 256.0f / 65535 / 2 + 1e-5);
+  EXPECT_EQ(0u, cube.clampedIntensities());
+}
+
+TEST(MapCube, MeanStaysInVoxel)
+{
+  // many points per voxel spread up to the faces, merged into running means
+  const float leafSizes[] = {0.1, 0.2, 0.4};
+  for (size_t l = 0; l < sizeof(leafSizes) / sizeof(leafSizes[0]); l++) {
+    float leafSize = leafSizes[l];
+    std::mt19937 rng(10 + l);
+    std::uniform_int_distribution<int> voxel(0, 19);
+    std::uniform_real_distribution<float> offset(0, 1);
+    MapCube<PointType> cube(leafSize, cubeSize);
+    std::vector<double> sum(20 * 20 * 20 * 3, 0);
+    std::vector<int> count(20 * 20 * 20, 0);
+    for (int n = 0; n < 100000; n++) {
+      int i = voxel(rng), j = voxel(rng), k = voxel(rng);
+      PointType point = makePoint(lower + (i + offset(rng)) * leafSize, lower + (j + offset(rng)) * leafSize,
+                                  lower + (k + offset(rng)) * leafSize, 10);
+      i = quantizedVoxelOf(point.x, leafSize);
+      j = quantizedVoxelOf(point.y, leafSize);
+      k = quantizedVoxelOf(point.z, leafSize);
+      if (i >= 20 || j >= 20 || k >= 20) {
+        continue;   // quantized onto the far face of the block
+      }
+      cube.insert(point);
+      int v = i + 20 * (j + 20 * k);
+      sum[3 * v] += point.x;
+      sum[3 * v + 1] += point.y;
+      sum[3 * v + 2] += point.z;
+      count[v]++;
+    }
+
+    pcl::PointCloud<PointType> decoded;
+    cube.appendTo(decoded);
+    ASSERT_EQ(size_t(std::count_if(count.begin(), count.end(), [](int c) { return c > 0; })), decoded.points.size());
+    float maxMeanError = 0;
+    for (size_t p = 0; p < decoded.points.size(); p++) {
+      PointType const &point = decoded.points[p];
+      // the decoded mean is in the voxel its points were binned into
+      int i = quantizedVoxelOf(point.x, leafSize);
+      int j = quantizedVoxelOf(point.y, leafSize);
+      int k = quantizedVoxelOf(point.z, leafSize);
+      ASSERT_TRUE(i >= 0 && i < 20 && j >= 0 && j < 20 && k >= 0 && k < 20);
+      int v = i + 20 * (j + 20 * k);
+      ASSERT_GT(count[v], 0) << "point " << p << " left its voxel";
+      // counts saturate at 255 and every update is rounded, the mean drifts by a few steps
+      if (count[v] < 255) {
+        maxMeanError = std::max(maxMeanError, float(std::fabs(point.x - sum[3 * v] / count[v])));
+        maxMeanError = std::max(maxMeanError, float(std::fabs(point.y - sum[3 * v + 1] / count[v])));
+        maxMeanError = std::max(maxMeanError, float(std::fabs(point.z - sum[3 * v + 2] / count[v])));
+      }
+    }
+    EXPECT_LT(maxMeanError, 8 * step) << "leaf " << leafSize;
+
+    // decoded points are in the voxel they came from, inserting them again adds none
+    for (size_t p = 0; p < decoded.points.size(); p++) {
+      EXPECT_FALSE(cube.insert(decoded.points[p]));
+    }
+    EXPECT_EQ(decoded.points.size(), cube.size());
+  }
+}
+
+TEST(MapCube, ReinsertedCubeIsIdentical)
+{
+  std::mt19937 rng(3);
+  std::uniform_real_distribution<float> uniform(-24.9, 24.9);
+  std::uniform_real_distribution<float> intensity(0, 255);
+  MapCube<PointType> cube(0.2, cubeSize);
+  for (int n = 0; n < 50000; n++) {
+    cube.insert(makePoint(uniform(rng), uniform(rng) / 8, uniform(rng), intensity(rng)));
+  }
+  pcl::PointCloud<PointType> decoded;
+  cube.appendTo(decoded);
+
+  // as a cube evicted to the tile store or saved with the map and loaded again
+  MapCube<PointType> again(0.2, cubeSize);
+  again.insert(decoded);
+  pcl::PointCloud<PointType> decodedAgain;
+  again.appendTo(decodedAgain);
+
+  ASSERT_EQ(decoded.points.size(), decodedAgain.points.size());
+  std::sort(decoded.points.begin(), decoded.points.end(), lessXYZ);
+  std::sort(decodedAgain.points.begin(), decodedAgain.points.end(), lessXYZ);
+  for (size_t p = 0; p < decoded.points.size(); p++) {
+    EXPECT_EQ(decoded.points[p].x, decodedAgain.points[p].x);
+    EXPECT_EQ(decoded.points[p].y, decodedAgain.points[p].y);
+    EXPECT_EQ(decoded.points[p].z, decodedAgain.points[p].z);
+    EXPECT_EQ(decoded.points[p].intensity, decodedAgain.points[p].intensity);
+  }
+}
+
+TEST(MapCube, IntensityRange)
+{
+  MapCube<PointType> cube(1.0, cubeSize);
+  cube.insert(makePoint(0.5, 0.5, 0.5, 300));
+  cube.insert(makePoint(2.5, 0.5, 0.5, -4));
+  cube.insert(makePoint(4.5, 0.5, 0.5, std::numeric_limits<float>::quiet_NaN()));
+  cube.insert(makePoint(6.5, 0.5, 0.5, 255.5));
+  EXPECT_EQ(3u, cube.clampedIntensities());
+
+  pcl::PointCloud<PointType> decoded;
+  cube.appendTo(decoded);
+  ASSERT_EQ(4u, decoded.points.size());
+  std::sort(decoded.points.begin(), decoded.points.end(), lessXYZ);
+  EXPECT_FLOAT_EQ(256, decoded.points[0].intensity);
+  EXPECT_FLOAT_EQ(0, decoded.points[1].intensity);
+  EXPECT_FLOAT_EQ(0, decoded.points[2].intensity);
+  EXPECT_NEAR(255.5, decoded.points[3].intensity, 256.0 / 65535);
+
+  // 16 bit sensor intensities with a matching range
+  MapCube<PointType> wide(1.0, cubeSize, 65535);
+  wide.insert(makePoint(0.5, 0.5, 0.5, 3000));
+  wide.insert(makePoint(2.5, 0.5, 0.5, 65535));
+  EXPECT_EQ(0u, wide.clampedIntensities());
+  wide.appendTo(decoded);
+  EXPECT_NEAR(3000, decoded.points[4].intensity + decoded.points[5].intensity - 65535, 0.5);
+
+  cube.clear();
+  EXPECT_EQ(0u, cube.clampedIntensities());
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,168 @@
+// VoxelFilter against pcl::VoxelGrid: same voxels and counts, centroids equal up to the float
+// rounding of the summation order. The order of the output differs, voxels are matched by the voxel their centroid falls into.
+
+#include <cmath>
+#include <limits>
+#include <map>
+#include <random>
+
+#include <gtest/gtest.h>
+
+#include <pcl/filters/voxel_grid.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include <loam_velodyne/voxel_filter.h>
+
+typedef pcl::PointXYZI PointType;
+
+// clusters of a few points per voxel plus scattered points, some of them not finite
+pcl::PointCloud<PointType>::Ptr makeCloud(size_t num, unsigned seed)
+{
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> uniform(-20, 20);
+  std::normal_distribution<float> noise(0, 0.05);
+  std::uniform_real_distribution<float> intensity(0, 100);
+  pcl::PointCloud<PointType>::Ptr cloud(new pcl::PointCloud<PointType>());
+  PointType center;
+  center.x = center.y = center.z = 0;
+  for (size_t i = 0; i < num; i++) {
+    if (i % 8 == 0) {
+      center.x = uniform(rng);
+      center.y = uniform(rng) / 4;
+      center.z = uniform(rng);
+    }
+    PointType point;
+    point.x = center.x + noise(rng);
+    point.y = center.y + noise(rng);
+    point.z = center.z + noise(rng);
+    point.intensity = intensity(rng);
+    if (i % 997 == 0) {
+      point.x = std::numeric_limits<float>::quiet_NaN();
+    }
+    cloud->push_back(point);
+  }
+  cloud->is_dense = false;
+  return cloud;
+}
+
+// the voxels of a filtered cloud by key, false when two points share a voxel
+bool byVoxel(pcl::PointCloud<PointType> const &cloud, float leafSize, std::map<uint64_t, PointType> &voxels)
+{
+  float const inverseLeaf[3] = {1.0f / leafSize, 1.0f / leafSize, 1.0f / leafSize};
+  voxels.clear();
+  for (size_t i = 0; i < cloud.points.size(); i++) {
+    PointType const &point = cloud.points[i];
+    uint64_t key;
+    if (!packVoxelKey(point.x, point.y, point.z, inverseLeaf, key) || !voxels.insert(std::make_pair(key, point)).second) {
+      return false;
+    }
+  }
+  return true;
+}
+
+pcl::PointCloud<PointType> voxelGrid(pcl::PointCloud<PointType>::Ptr const &input, float leafSize)
+{
+  pcl::VoxelGrid<PointType> grid;
+  grid.setLeafSize(leafSize, leafSize, leafSize);
+  grid.setInputCloud(input);
+  pcl::PointCloud<PointType> output;
+  grid.filter(output);
+  return output;
+}
+
+TEST(VoxelFilter, CentroidMatchesVoxelGrid)
+{
+  float const leafSizes[] = {0.1, 0.2, 0.4};
+  for (size_t l = 0; l < sizeof(leafSizes) / sizeof(leafSizes[0]); l++) {
+    float leafSize = leafSizes[l];
+    pcl::PointCloud<PointType>::Ptr input = makeCloud(20000, l + 1);
+    pcl::PointCloud<PointType> expected = voxelGrid(input, leafSize);
+
+    VoxelFilter<PointType> filter(leafSize);
+    pcl::PointCloud<PointType> output;
+    filter.filter(*input, output);
+
+    ASSERT_EQ(expected.points.size(), output.points.size()) << "leaf " << leafSize;
+    EXPECT_EQ(output.points.size(), output.width);
+    EXPECT_EQ(1u, output.height);
+
+    std::map<uint64_t, PointType> expectedVoxels, outputVoxels;
+    ASSERT_TRUE(byVoxel(expected, leafSize, expectedVoxels));
+    ASSERT_TRUE(byVoxel(output, leafSize, outputVoxels));
+    ASSERT_EQ(expectedVoxels.size(), outputVoxels.size());
+    for (std::map<uint64_t, PointType>::const_iterator it = expectedVoxels.begin(); it != expectedVoxels.end(); ++it) {
+      std::map<uint64_t, PointType>::const_iterator found = outputVoxels.find(it->first);
+      ASSERT_TRUE(found != outputVoxels.end()) << "leaf " << leafSize;
+      EXPECT_NEAR(it->second.x, found->second.x, 1e-4);
+      EXPECT_NEAR(it->second.y, found->second.y, 1e-4);
+      EXPECT_NEAR(it->second.z, found->second.z, 1e-4);
+      EXPECT_NEAR(it->second.intensity, found->second.intensity, 1e-3);
+    }
+  }
+}
+
+TEST(VoxelFilter, InPlaceMatchesSeparateOutput)
+{
+  pcl::PointCloud<PointType>::Ptr input = makeCloud(20000, 7);
+  VoxelFilter<PointType> filter(0.2);
+  pcl::PointCloud<PointType> output;
+  filter.filter(*input, output);
+
+  pcl::PointCloud<PointType> inPlace = *input;
+  filter.filter(inPlace, inPlace);
+
+  ASSERT_EQ(output.points.size(), inPlace.points.size());
+  EXPECT_EQ(output.width, inPlace.width);
+  for (size_t i = 0; i < output.points.size(); i++) {
+    EXPECT_EQ(output.points[i].x, inPlace.points[i].x);
+    EXPECT_EQ(output.points[i].y, inPlace.points[i].y);
+    EXPECT_EQ(output.points[i].z, inPlace.points[i].z);
+    EXPECT_EQ(output.points[i].intensity, inPlace.points[i].intensity);
+  }
+  EXPECT_EQ(voxelGrid(input, 0.2).points.size(), inPlace.points.size());
+}
+
+TEST(VoxelFilter, ReusedFilterMatchesFreshFilter)
+{
+  VoxelFilter<PointType> reused(0.2);
+  size_t const sizes[] = {20000, 500, 60000, 20000};
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    pcl::PointCloud<PointType>::Ptr input = makeCloud(sizes[s], 20 + s);
+    pcl::PointCloud<PointType> expected, output;
+    VoxelFilter<PointType>(0.2).filter(*input, expected);
+    reused.filter(*input, output);
+    ASSERT_EQ(expected.points.size(), output.points.size());
+    for (size_t i = 0; i < output.points.size(); i++) {
+      EXPECT_EQ(expected.points[i].x, output.points[i].x);
+      EXPECT_EQ(expected.points[i].intensity, output.points[i].intensity);
+    }
+  }
+}
+
+TEST(VoxelFilter, FirstPointKeepsInputPoints)
+{
+  pcl::PointCloud<PointType>::Ptr input = makeCloud(20000, 11);
+  VoxelFilter<PointType> filter(0.2, VoxelFilter<PointType>::FirstPoint);
+  pcl::PointCloud<PointType> output;
+  filter.filter(*input, output);
+
+  EXPECT_EQ(voxelGrid(input, 0.2).points.size(), output.points.size());
+  // voxels come out in the order they are first hit, so the kept points are an ordered subset
+  size_t p = 0;
+  for (size_t i = 0; i < output.points.size(); i++) {
+    while (p < input->points.size() && (input->points[p].x != output.points[i].x ||
+                                        input->points[p].y != output.points[i].y ||
+                                        input->points[p].z != output.points[i].z)) {
+      p++;
+    }
+    ASSERT_LT(p, input->points.size()) << "point " << i << " is not an input point";
+    p++;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}